@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Synthetic nano-cpp program generator for compile-throughput benchmarks.
+
+Every program is written in the language subset accepted by ncc and scales
+linearly with --scale (1.0 gives the full benchmark sizes).
+"""
+
+import argparse
+import os
+
+
+def scaled(n, scale):
+    return max(1, int(n * scale))
+
+
+def gen_functions(scale):
+    """Many small functions calling each other."""
+    n = scaled(10000, scale)
+    out = ["void write(int x);\n"]
+    out.append("int f0(int x) { return x + 1; }\n")
+    for i in range(1, n):
+        out.append("int f%d(int x)\n{\n    int y = x * %d + %d;\n"
+                   "    if (y > %d)\n        y = y - f%d(x);\n    return y;\n}\n"
+                   % (i, i % 7 + 1, i, i * 3, i - 1))
+    out.append("int main()\n{\n    write(f%d(1));\n    return 0;\n}\n" % (n - 1))
+    return "".join(out)
+
+
+def gen_locals(scale):
+    """A single scope holding a huge number of local variables."""
+    n = scaled(100000, scale)
+    out = ["void write(int x);\n\nint main()\n{\n"]
+    for i in range(n):
+        out.append("    int v%d = %d;\n" % (i, i))
+    out.append("    int sum = 0;\n")
+    for i in range(0, n, max(1, n // 100)):
+        out.append("    sum = sum + v%d;\n" % i)
+    out.append("    write(sum);\n    return 0;\n}\n")
+    return "".join(out)
+
+
+def gen_nesting(scale):
+    """Deeply nested blocks, each opening a new scope."""
+    depth = scaled(1000, scale)
+    out = ["void write(int x);\n\nint main()\n{\n    int x = 0;\n"]
+    for i in range(depth):
+        ind = "    " * (i % 16 + 1)
+        out.append("%sif (x < %d) {\n%s    int a%d = x + %d;\n%s    x = a%d;\n"
+                   % (ind, depth * 2, ind, i, i, ind, i))
+    for i in reversed(range(depth)):
+        out.append("%s}\n" % ("    " * (i % 16 + 1)))
+    out.append("    write(x);\n    return 0;\n}\n")
+    return "".join(out)
+
+
+def gen_classes(scale):
+    """Wide classes derived along a long chain of base classes."""
+    chain = scaled(200, scale)
+    width = 50
+    out = []
+    for c in range(chain):
+        base = " : public C%d" % (c - 1) if c else ""
+        out.append("class C%d%s\n{\npublic:\n" % (c, base))
+        for m in range(width):
+            out.append("    int m%d_%d;\n" % (c, m))
+        out.append("};\n\n")
+    out.append("int main()\n{\n    C%d obj;\n    obj.m%d_0 = 1;\n"
+               "    return obj.m%d_0 + obj.m%d_%d;\n}\n"
+               % (chain - 1, chain - 1, chain - 1, chain - 1, width - 1))
+    return "".join(out)
+
+
+def gen_switch(scale):
+    """A huge switch statement over a dense case range."""
+    n = scaled(10000, scale)
+    out = ["void write(int x);\n\nint dispatch(int op, int acc)\n{\n"
+           "    switch (op) {\n"]
+    for i in range(n):
+        out.append("    case %d:\n        acc = acc + %d;\n        break;\n"
+                   % (i, i * 3 + 1))
+    out.append("    default:\n        acc = 0;\n    }\n    return acc;\n}\n\n")
+    out.append("int main()\n{\n    write(dispatch(%d, 1));\n    return 0;\n}\n"
+               % (n // 2))
+    return "".join(out)
+
+
+def gen_arrays(scale):
+    """Large list-initialized arrays."""
+    n = scaled(50000, scale)
+    out = ["void write(int x);\n\n", "int table[%d] = {" % n]
+    for i in range(n):
+        out.append("%s%d" % ("\n    " if i % 16 == 0 else " ", (i * 2654435761) % 1000))
+        if i + 1 < n:
+            out.append(",")
+    out.append("\n};\n\nint main()\n{\n    int local[%d] = {" % min(n, 1024))
+    out.append(", ".join(str(i) for i in range(min(n, 1024))))
+    out.append("};\n    write(table[%d] + local[1]);\n    return 0;\n}\n" % (n - 1))
+    return "".join(out)
+
+
+GENERATORS = {
+    "functions": gen_functions,
+    "locals": gen_locals,
+    "nesting": gen_nesting,
+    "classes": gen_classes,
+    "switch": gen_switch,
+    "arrays": gen_arrays,
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="size factor applied to every program")
+    parser.add_argument("--out", default="bin/bench",
+                        help="output directory for generated programs")
+    parser.add_argument("programs", nargs="*", default=sorted(GENERATORS),
+                        help="programs to generate (default: all)")
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    for name in args.programs:
+        path = os.path.join(args.out, name + ".cpp")
+        with open(path, "w") as f:
+            f.write(GENERATORS[name](args.scale))
+        print(path)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""Compile-throughput benchmark harness.
+
+Generates the synthetic programs from gen.py, runs lextest, parsetest and ncc
+(plain, -o, -ss and -o -ss) over each of them and reports source lines per
+second for every compile phase. ncc phases are taken from -ftime-report.
+
+Results are compared with a baseline measured on the same machine, kept under
+bin/ with the binaries; the run fails when any phase throughput drops more
+than --threshold below it, or when there is no baseline. --update-baseline
+stores the current results as the new baseline.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+import gen
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+NCC_CONFIGS = {
+    "ncc": [],
+    "ncc-o": ["-o"],
+    "ncc-ss": ["-ss", "{asm}"],
+    "ncc-o-ss": ["-o", "-ss", "{asm}"],
+    "ncc-o-ss-sched": ["-o", "-ss-sched", "-ss", "{asm}"],
+}
+
+# Phase timings below this are dominated by noise and are not compared
+MIN_TIME = 0.005
+
+PHASE_LINE = re.compile(
+    r"^(\S.*?)\s+([\d.]+)\s+[\d.]+%\s+([\d.]+)\s+[\d.]+%\s+(\d+)$")
+
+
+def run_timed(cmd, src, stderr=subprocess.DEVNULL):
+    """Runs cmd with src as stdin, returning (wall seconds, stderr text)."""
+    with open(src, "rb") as f:
+        start = time.perf_counter()
+        proc = subprocess.run(cmd, stdin=f, stdout=subprocess.DEVNULL,
+                              stderr=stderr)
+        wall = time.perf_counter() - start
+    if proc.returncode != 0:
+        raise RuntimeError("%s failed on %s (exit %d)"
+                           % (" ".join(cmd), src, proc.returncode))
+    err = proc.stderr.decode(errors="replace") if proc.stderr else ""
+    return wall, err
+
+
+def parse_time_report(text):
+    """Extracts {phase: wall seconds} from ncc -ftime-report output."""
+    phases = {}
+    for line in text.splitlines():
+        m = PHASE_LINE.match(line.strip())
+        if m and m.group(1) != "Total":
+            phases[m.group(1)] = float(m.group(2))
+    return phases
+
+
+def measure(bin_dir, src, out_dir, repeat):
+    """Returns {"tool/phase": best wall seconds} for one program."""
+    asm = os.path.join(out_dir, "bench.s")
+    times = {}
+
+    def keep(key, t):
+        times[key] = min(t, times.get(key, t))
+
+    for _ in range(repeat):
+        t, _ = run_timed([os.path.join(bin_dir, "lextest.exe")], src)
+        keep("lextest/Total", t)
+        t, _ = run_timed([os.path.join(bin_dir, "parsetest.exe")], src)
+        keep("parsetest/Total", t)
+
+        for name, flags in sorted(NCC_CONFIGS.items()):
+            cmd = [os.path.join(bin_dir, "ncc.exe"), "-ftime-report"]
+            cmd += [f.format(asm=asm) for f in flags]
+            t, err = run_timed(cmd, src, stderr=subprocess.PIPE)
+            keep(name + "/Total", t)
+            for phase, pt in parse_time_report(err).items():
+                keep(name + "/" + phase, pt)
+    return times
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--bin", default=os.path.join(ROOT_DIR, "bin"),
+                        help="directory holding lextest/parsetest/ncc")
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="size factor passed to the generator")
+    parser.add_argument("--repeat", type=int, default=3,
+                        help="runs per measurement, the fastest one is kept")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="allowed relative throughput regression")
+    parser.add_argument("--baseline",
+                        help="baseline file to compare against "
+                             "(default: BIN/bench/baseline.json)")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="store the results as the new baseline")
+    parser.add_argument("programs", nargs="*", default=sorted(gen.GENERATORS),
+                        help="programs to benchmark (default: all)")
+    args = parser.parse_args()
+
+    out_dir = os.path.join(args.bin, "bench")
+    os.makedirs(out_dir, exist_ok=True)
+    if not args.baseline:
+        args.baseline = os.path.join(out_dir, "baseline.json")
+    if not args.update_baseline and not os.path.exists(args.baseline):
+        print("no baseline at %s, run make bench-baseline first" % args.baseline,
+              file=sys.stderr)
+        return 1
+
+    results = {}
+    for name in args.programs:
+        src = os.path.join(out_dir, name + ".cpp")
+        text = gen.GENERATORS[name](args.scale)
+        with open(src, "w") as f:
+            f.write(text)
+        lines = text.count("\n")
+
+        for key, t in sorted(measure(args.bin, src, out_dir, args.repeat).items()):
+            results["%s/%s" % (name, key)] = {
+                "lines": lines,
+                "seconds": t,
+                "lines_per_sec": lines / t if t > 0 else 0.0,
+            }
+
+    baseline = {}
+    if not args.update_baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    print("%-40s %10s %12s %12s %8s" %
+          ("benchmark", "lines", "lines/s", "baseline", "change"))
+    failed = []
+    for key, r in sorted(results.items()):
+        base = baseline.get(key)
+        line = "%-40s %10d %12.0f" % (key, r["lines"], r["lines_per_sec"])
+        if base and base["lines_per_sec"] > 0:
+            change = r["lines_per_sec"] / base["lines_per_sec"] - 1
+            line += " %12.0f %+7.1f%%" % (base["lines_per_sec"], change * 100)
+            if (change < -args.threshold and r["seconds"] >= MIN_TIME
+                    and base["seconds"] >= MIN_TIME):
+                failed.append(key)
+                line += "  REGRESSION"
+        print(line)
+
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+        print("baseline written to %s" % args.baseline)
+
+    if failed:
+        print("%d benchmark(s) regressed more than %.0f%%: %s"
+              % (len(failed), args.threshold * 100, ", ".join(failed)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
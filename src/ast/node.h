@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../core/compileStats.h"
 #include "../core/operator.h"
 #include "../core/typeEnum.h"
 #include "../parser/yylocation.h"
@@ -122,6 +123,7 @@ using PtrVec = std::vector<Ptr<T>>;
 template <typename T, typename... Args>
 inline Ptr<T> MkNode(Args &&... args)
 {
+    compileStats.astNodes++;
     return std::make_unique<T>(std::forward<Args>(args)...);
 }
 
@@ -1,4 +1,5 @@
 #include "../ast/node.h"
+#include "../core/stats.h"
 #include "context.h"
 
 namespace ast {
@@ -7,6 +8,9 @@ void TranslationUnit::Codegen(CodegenContext &context) const
 {
     // Restore point
     for (const auto &n : decls) {
+        TraceRecorder::Scope trace("Declaration",
+                                   "line " + std::to_string(n->srcLocation.begin.line));
+
         context.decl = {DeclState::FULLDECL};
         try {
             n->Codegen(context);
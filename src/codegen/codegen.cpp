@@ -13,6 +13,8 @@ CodeGenHelper::CodeGenHelper(LLVMContext &llvmContext,
     : ctx(llvmContext)
     , module(module)
     , Builder(Builder)
+    , scope(nullptr)
+    , lastAlloca(nullptr)
 {}
 
 llvm::Constant *CodeGenHelper::CreateConstant(const ::Type &t, ::Constant constant)
@@ -152,8 +154,7 @@ CodeGenHelper::ConvertType(::Type fromT, const ::Type &toT, llvm::Value *fromV)
     // O. r-value to const l-value (creates temporary)
     else if (!fromT.IsRef() && toT.IsRef() && toT.cv == CVQualifier::CONST
              && !fromT.IsSimple(TypeKind::FUNCTION)) {
-        auto tempVar = Builder.CreateAlloca(MakeType(fromT), nullptr);
-        tempVar->setAlignment(llvm::Align(fromT.Alignment()));
+        auto tempVar = CreateEntryAlloca(fromT);
 
         Builder.CreateAlignedStore(toV, tempVar, llvm::Align(fromT.Alignment()));
         toV = tempVar;
@@ -246,6 +247,59 @@ void CodeGenHelper::GenZeroInit(SymbolSet varSymbol)
     }
 }
 
+AllocaInst *CodeGenHelper::CreateEntryAlloca(const ::Type &t, const std::string &name)
+{
+    // Temporaries of global initializers have no function to be allocated in
+    if (!Builder.GetInsertBlock()) {
+        auto allocInst = Builder.CreateAlloca(MakeType(t), nullptr, name);
+        allocInst->setAlignment(Align(t.Alignment()));
+        return allocInst;
+    }
+
+    auto function = Builder.GetInsertBlock()->getParent();
+    auto entryBB  = &function->getEntryBlock();
+
+    // After the allocas already there, in the order of creation. The entry block is
+    // only searched when allocating in another function than last time.
+    auto insertPoint = entryBB->begin();
+    if (lastAlloca && lastAlloca->getFunction() == function)
+        insertPoint = std::next(lastAlloca->getIterator());
+    else {
+        while (insertPoint != entryBB->end() && isa<AllocaInst>(*insertPoint))
+            insertPoint++;
+    }
+
+    IRBuilder<> entryBuilder(entryBB, insertPoint);
+    lastAlloca = entryBuilder.CreateAlloca(MakeType(t), nullptr, name);
+    lastAlloca->setAlignment(Align(t.Alignment()));
+
+    if (scope && scope->isMarked) {
+        Builder.CreateLifetimeStart(lastAlloca);
+        scope->objects.push_back(lastAlloca);
+    }
+    return lastAlloca;
+}
+
+CodeGenHelper::Scope::Scope(CodeGenHelper &helper, bool isMarked)
+    : helper(helper)
+    , isMarked(isMarked)
+    , parent(helper.scope)
+{
+    helper.scope = this;
+}
+
+CodeGenHelper::Scope::~Scope()
+{
+    // Paths leaving the scope by a jump keep their objects alive, which is only
+    // less precise
+    auto BB = helper.Builder.GetInsertBlock();
+    if (BB && !BB->getTerminator()) {
+        for (auto it = objects.rbegin(); it != objects.rend(); it++)
+            helper.Builder.CreateLifetimeEnd(*it);
+    }
+    helper.scope = parent;
+}
+
 void CodeGenHelper::GenAssignInit(SymbolSet        varSymbol,
                                   const ::Type &   exprType,
                                   const ExprState &expr)
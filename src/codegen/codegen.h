@@ -30,6 +30,29 @@ public:
     void
     GenAssignInit(SymbolSet varSymbol, const ::Type &exprType, const ExprState &expr);
 
+    // Local variables and temporaries are allocated in the entry block of the
+    // function, so that no alloca runs more than once and all can be promoted
+    llvm::AllocaInst *CreateEntryAlloca(const ::Type &t, const std::string &name = {});
+
+    // Scope of the objects allocated while it is alive. In a marked scope, each
+    // object is alive from its creation (llvm.lifetime.start) to the end of the
+    // scope (llvm.lifetime.end); a scope that a case label may jump into is not
+    // marked, as the jump would skip the start of the objects before it.
+    class Scope
+    {
+    public:
+        Scope(CodeGenHelper &helper, bool isMarked);
+        ~Scope();
+
+    private:
+        friend class CodeGenHelper;
+
+        CodeGenHelper &                 helper;
+        bool                            isMarked;
+        std::vector<llvm::AllocaInst *> objects;
+        Scope *                         parent;
+    };
+
 private:
     llvm::Constant *CreateFundTypeConstant(FundType fundType, ::Constant constant);
 
@@ -41,4 +64,6 @@ private:
     llvm::Module &                                                  module;
     llvm::IRBuilder<> &                                             Builder;
     std::unordered_map<const ClassDescriptor *, llvm::StructType *> structTypeMap;
+    Scope *                                                         scope;
+    llvm::AllocaInst *                                              lastAlloca;
 };
\ No newline at end of file
@@ -63,12 +63,8 @@ void BlockDeclaration::Codegen(CodegenContext &context) const
 
             if (context.symtab->GetParent()) {
                 // Local variables
-                auto localVar = context.IRBuilder.CreateAlloca(
-                    context.cgHelper.MakeType(context.type),
-                    nullptr,
-                    varSymbol->id);
-                localVar->setAlignment(llvm::Align(context.type.Alignment()));
-                varSymbol->value = localVar;
+                varSymbol->value =
+                    context.cgHelper.CreateEntryAlloca(context.type, varSymbol->id);
             }
             else if (!varSymbol->type.IsSimple(TypeKind::FUNCTION)) {
                 // Global variables
@@ -1,4 +1,5 @@
 #include "../ast/node.h"
+#include "../core/stats.h"
 #include "context.h"
 
 #include <cassert>
@@ -345,6 +346,8 @@ void FunctionDefinition::Codegen(CodegenContext &context) const
     auto function = llvm::cast<llvm::Function>(funcDesc->defSymbol->value);
     auto funcBB   = llvm::BasicBlock::Create(context.llvmContext, "entry", function);
 
+    TraceRecorder::Scope trace("FunctionDefinition", function->getName().str());
+
     // Enter function scope
     CodegenContext newContext(*contextPtr);
     newContext.decl.state = DeclState::NODECL;
@@ -354,6 +357,9 @@ void FunctionDefinition::Codegen(CodegenContext &context) const
     auto previousIP = context.IRBuilder.saveAndClearIP();
     context.IRBuilder.SetInsertPoint(funcBB);
 
+    // Objects of the function scope live as long as the function runs
+    CodeGenHelper::Scope functionScope(context.cgHelper, false);
+
     auto param = funcDesc->paramList.begin();
     auto arg   = function->arg_begin();
     for (; arg != function->arg_end(); arg++, param++) {
@@ -362,11 +368,8 @@ void FunctionDefinition::Codegen(CodegenContext &context) const
         if (param->symbol->id.empty())
             continue;
 
-        auto argVar = context.IRBuilder.CreateAlloca(
-            context.cgHelper.MakeType(param->symbol->type),
-            nullptr,
-            param->symbol->id);
-        argVar->setAlignment(llvm::Align(param->symbol->type.Alignment()));
+        auto argVar =
+            context.cgHelper.CreateEntryAlloca(param->symbol->type, param->symbol->id);
         context.IRBuilder.CreateAlignedStore(
             param->symbol->value,
             argVar,
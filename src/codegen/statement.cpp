@@ -54,12 +54,15 @@ void ExpressionStatement::Codegen(CodegenContext &context) const
 
 void CompoundStatement::Codegen(CodegenContext &context) const
 {
-    SymbolTable    localSymtab(context.symtab);
-    CodegenContext newContext(context);
+    SymbolTable                          localSymtab(context.symtab);
+    CodegenContext                       newContext(context);
+    llvm::Optional<CodeGenHelper::Scope> scope;
 
     // Enter new local scope
-    if (!newContext.stmt.keepScope)
+    if (!newContext.stmt.keepScope) {
         newContext.symtab = &localSymtab;
+        scope.emplace(context.cgHelper, !context.stmt.isSwitchLevel);
+    }
 
     // Restore point
     for (const auto &stmt : stmts) {
@@ -262,8 +265,9 @@ void DoStatement::Codegen(CodegenContext &context) const
 
 void ForStatement::Codegen(CodegenContext &context) const
 {
-    SymbolTable    localSymtab(context.symtab);
-    CodegenContext newContext(context);
+    SymbolTable          localSymtab(context.symtab);
+    CodegenContext       newContext(context);
+    CodeGenHelper::Scope scope(context.cgHelper, true);
 
     newContext.symtab             = &localSymtab;
     newContext.stmt.keepScope     = true;
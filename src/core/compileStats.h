@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Counters of the work done by each compile phase
+struct CompileStats
+{
+    std::uint64_t tokens;              // tokens returned by lexer
+    std::uint64_t astNodes;            // nodes created by parser
+    std::uint64_t symbols;             // symbols inserted into symbol tables
+    std::uint64_t irInstructions;      // LLVM IR instructions after code generation
+    std::uint64_t optInstructions;     // LLVM IR instructions after optimization
+    std::uint64_t mipsLines;           // lines emitted by MIPS assembly generation
+    std::uint64_t livenessIterations;  // blocks visited by MIPS liveness analysis
+    std::uint64_t peepholeRemoved;     // MIPS instructions removed by peephole
+    std::uint64_t delaySlotsFilled;    // MIPS delay slots filled by the scheduler
+};
+
+// Counters of the whole compilation, printed by -ftime-report. Not atomic: only
+// the main thread updates them. Functions generated on worker threads count into
+// a CompileStats of their own, which the main thread adds in when it writes them.
+extern CompileStats compileStats;
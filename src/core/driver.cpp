@@ -2,11 +2,13 @@
 
 #include "../codegen/context.h"
 #include "../parser/yyparser.h"
-#include "../pass/MipsAsmGen/MipsAssemblyGenPass.h"
 
 #include <sstream>
 
-Driver::Driver(std::ostream &errorStream) : errorStream(errorStream) {}
+Driver::Driver(std::ostream &errorStream, TimeReport *timeReport)
+    : errorStream(errorStream)
+    , timeReport(timeReport)
+{}
 
 bool Driver::Parse(bool isDebugMode, bool printLocalTable)
 {
@@ -17,11 +19,14 @@ bool Driver::Parse(bool isDebugMode, bool printLocalTable)
 
     /* Parser analysis */
 
-    int        errCnt = 0;
-    yy::parser parser(ast, errCnt, errorStream, {});
+    int errCnt = 0;
+    {
+        TimeReport::Scope timer(timeReport, "Parse");
+        yy::parser        parser(ast, errCnt, errorStream, {});
 
-    // parser.set_debug_level(isDebugMode);
-    errCnt += parser() != 0;
+        // parser.set_debug_level(isDebugMode);
+        errCnt += parser() != 0;
+    }
 
     if (errCnt > 0) {
         errorStream << "parsing failed, " << errCnt << " error generated!\n";
@@ -30,9 +35,16 @@ bool Driver::Parse(bool isDebugMode, bool printLocalTable)
 
     /* Semantic analysis & Code generation */
 
+    TimeReport::Scope timer(timeReport, "Codegen");
     globalSymtab = std::make_unique<SymbolTable>(nullptr);
     llvmContext  = std::make_unique<llvm::LLVMContext>();
     module       = std::make_unique<llvm::Module>("NCC Module", *llvmContext);
+
+    // Without a layout, passes widen indices to 64-bit pointers and narrow values
+    // to any width, and the backend sizes pointers as 64-bit; keep both to the
+    // 32-bit registers the MIPS backend has
+    module->setDataLayout(MipsDataLayout);
+
     llvm::IRBuilder<> IRBuilder(*llvmContext);
     CodeGenHelper     cgHelper(*llvmContext, *module, IRBuilder);
 
@@ -46,6 +58,7 @@ bool Driver::Parse(bool isDebugMode, bool printLocalTable)
                             cgHelper,
                             globalSymtab.get()};
     ast->Codegen(context);
+    compileStats.irInstructions += module->getInstructionCount();
 
     if (errCnt > 0) {
         errorStream << "semantic check failed, " << errCnt << " error generated!\n";
@@ -55,26 +68,170 @@ bool Driver::Parse(bool isDebugMode, bool printLocalTable)
     return true;
 }
 
-void Driver::Optimize()
+// Name of the function, loop or call graph node a new pass manager pass runs on
+static std::string IRUnitName(const llvm::Any &IR)
 {
-    llvm::legacy::FunctionPassManager fpm(module.get());
-
-    // Promote allocas to registers.
-    fpm.add(llvm::createPromoteMemoryToRegisterPass());
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    fpm.add(llvm::createInstructionCombiningPass());
-    // Reassociate expressions.
-    fpm.add(llvm::createReassociatePass());
-    // Eliminate Common SubExpressions.
-    fpm.add(llvm::createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    fpm.add(llvm::createCFGSimplificationPass());
-
-    fpm.doInitialization();
-    for (auto &function : module->functions()) {
-        fpm.run(function);
+    if (auto function = llvm::any_cast<const llvm::Function *>(&IR))
+        return (*function)->getName().str();
+    if (auto loop = llvm::any_cast<const llvm::Loop *>(&IR))
+        return (*loop)->getHeader()->getParent()->getName().str();
+    if (auto SCC = llvm::any_cast<const llvm::LazyCallGraph::SCC *>(&IR))
+        return (*SCC)->getName();
+    return {};
+}
+
+// Size budget, in IR instructions, of a fully unrolled loop of the tuned loop level
+static const int LoopUnrollThreshold = 50;
+
+// Pipeline tuned to the MIPS backend: a few function passes, and at the loop level,
+// loop passes with a small budget for full unrolling
+static void RunTunedPipeline(llvm::Module &module, bool loops)
+{
+    std::vector<llvm::Pass *> passes = {
+        // Promote allocas to registers.
+        llvm::createPromoteMemoryToRegisterPass(),
+        // Do simple "peephole" optimizations and bit-twiddling optzns.
+        llvm::createInstructionCombiningPass(),
+        // Reassociate expressions.
+        llvm::createReassociatePass(),
+        // Eliminate Common SubExpressions.
+        llvm::createGVNPass(),
+        // Simplify the control flow graph (deleting unreachable blocks, etc).
+        llvm::createCFGSimplificationPass()};
+
+    // Loop passes, which bring their loop simplification and LCSSA with them. Loop
+    // idiom recognition is left out, the MIPS backend calling no memset or memcpy.
+    if (loops) {
+        llvm::Pass *loopPasses[] = {
+            // Rotate loops into guarded do-while form, with a preheader.
+            llvm::createLoopRotatePass(),
+            // Hoist invariants, like the row base addresses of array loops.
+            llvm::createLICMPass(),
+            // Canonicalize induction variables and simplify exit conditions.
+            llvm::createIndVarSimplifyPass(),
+            // Fully unroll short loops of constant trip count; no partial or
+            // runtime unrolling, which would add remainder loops.
+            llvm::createLoopUnrollPass(2, false, false, LoopUnrollThreshold, -1, 0, 0),
+            // Clean up the unrolled bodies.
+            llvm::createInstructionCombiningPass(),
+            llvm::createGVNPass(),
+            llvm::createCFGSimplificationPass(),
+            // Step addresses with pointer induction variables instead of scaling
+            // the index each iteration. Last, so that no cleanup folds them back.
+            llvm::createLoopStrengthReducePass()};
+        passes.insert(passes.end(), std::begin(loopPasses), std::end(loopPasses));
+    }
+
+    // Each pass runs in its own manager, so that every pass run on every
+    // function can be recorded as a separate trace event.
+    std::vector<std::unique_ptr<llvm::legacy::FunctionPassManager>> fpms;
+    for (auto pass : passes) {
+        fpms.push_back(std::make_unique<llvm::legacy::FunctionPassManager>(&module));
+        fpms.back()->add(pass);
+        fpms.back()->doInitialization();
     }
-    fpm.doFinalization();
+
+    for (auto &function : module.functions()) {
+        if (function.isDeclaration())
+            continue;
+
+        for (size_t i = 0; i < fpms.size(); i++) {
+            TraceRecorder::Scope trace(passes[i]->getPassName().str(),
+                                       function.getName().str());
+            fpms[i]->run(function);
+        }
+    }
+
+    for (auto &fpm : fpms)
+        fpm->doFinalization();
+}
+
+// Default pipeline of LLVM at an optimization level, with module passes
+static void RunDefaultPipeline(llvm::Module &module, OptLevel level)
+{
+    // Every pass run is recorded as a trace event, nested in the run of the pass
+    // manager or adaptor running it
+    llvm::PassInstrumentationCallbacks                  callbacks;
+    std::vector<std::unique_ptr<TraceRecorder::Scope>> traces;
+    if (traceRecorder) {
+        callbacks.registerBeforeNonSkippedPassCallback(
+            [&](llvm::StringRef pass, llvm::Any IR) {
+                traces.push_back(
+                    std::make_unique<TraceRecorder::Scope>(pass.str(), IRUnitName(IR)));
+            });
+        callbacks.registerAfterPassCallback(
+            [&](llvm::StringRef, llvm::Any, const llvm::PreservedAnalyses &) {
+                traces.pop_back();
+            });
+        callbacks.registerAfterPassInvalidatedCallback(
+            [&](llvm::StringRef, const llvm::PreservedAnalyses &) { traces.pop_back(); });
+    }
+
+    // No vectorization, MIPS32 having no vector registers
+    llvm::PipelineTuningOptions tuning;
+    tuning.LoopVectorization = false;
+    tuning.SLPVectorization  = false;
+    tuning.LoopInterleaving  = false;
+
+    llvm::PassBuilder             builder(nullptr, tuning, llvm::None, &callbacks);
+    llvm::LoopAnalysisManager     LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager    CGAM;
+    llvm::ModuleAnalysisManager   MAM;
+
+    // Programs run without a C library, so no call to memset, memcpy or any other
+    // library function may be formed. Registered first, it wins over the default.
+    llvm::TargetLibraryInfoImpl libraryInfo(llvm::Triple(module.getTargetTriple()));
+    libraryInfo.disableAllFunctions();
+    FAM.registerPass([&] { return llvm::TargetLibraryAnalysis(libraryInfo); });
+
+    builder.registerModuleAnalyses(MAM);
+    builder.registerCGSCCAnalyses(CGAM);
+    builder.registerFunctionAnalyses(FAM);
+    builder.registerLoopAnalyses(LAM);
+    builder.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager passes;
+    switch (level) {
+    case OptLevel::O0:
+    default:
+        passes = builder.buildO0DefaultPipeline(llvm::OptimizationLevel::O0);
+        break;
+    case OptLevel::O1:
+        passes = builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O1);
+        break;
+    case OptLevel::O2:
+        passes = builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+        break;
+    case OptLevel::O3:
+        passes = builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+        break;
+    case OptLevel::Os:
+        passes = builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::Os);
+        break;
+    }
+
+    // Step addresses with pointer induction variables instead of scaling the index
+    // each iteration, as the code generation pipeline of LLVM does. Last, so that
+    // no cleanup folds them back.
+    if (level != OptLevel::O0 && level != OptLevel::O1) {
+        passes.addPass(llvm::createModuleToFunctionPassAdaptor(
+            llvm::createFunctionToLoopPassAdaptor(llvm::LoopStrengthReducePass())));
+    }
+
+    passes.run(module, MAM);
+}
+
+void Driver::Optimize(OptLevel level)
+{
+    TimeReport::Scope timer(timeReport, "Optimize");
+
+    if (level == OptLevel::Tuned || level == OptLevel::TunedLoops)
+        RunTunedPipeline(*module, level == OptLevel::TunedLoops);
+    else
+        RunDefaultPipeline(*module, level);
+
+    compileStats.optInstructions += module->getInstructionCount();
 }
 
 std::string Driver::PrintSymbolTable() const
@@ -89,6 +246,7 @@ std::string Driver::PrintSymbolTable() const
 
 std::string Driver::PrintIR() const
 {
+    TimeReport::Scope        timer(timeReport, "Print IR");
     std::string              IR;
     llvm::raw_string_ostream ss(IR);
 
@@ -100,6 +258,8 @@ std::string Driver::PrintIR() const
 
 bool Driver::EmitAssemblyCode(std::string filename) const
 {
+    TimeReport::Scope timer(timeReport, "Emit LLVM assembly");
+
     auto targetTriple = "mips-unknown-linux-gnu";
     // auto targetTriple = llvm::sys::getDefaultTargetTriple();
 
@@ -148,23 +308,25 @@ bool Driver::EmitAssemblyCode(std::string filename) const
     return true;
 }
 
-bool Driver::EmitSimpleMipsCode(std::string filename) const
+bool Driver::EmitSimpleMipsCode(std::string filename, const MipsAsmOptions &options) const
 {
-    llvm::legacy::PassManager pm;
-    auto                      mipsPass = createMipsAssemblyGenPass();
-
-    pm.add(mipsPass);
-    pm.run(*module);
+    TimeReport::Scope timer(timeReport, "Emit MIPS assembly");
 
     std::error_code      ec;
-    llvm::raw_fd_ostream dest(filename, ec, llvm::sys::fs::OF_Text);
+    llvm::raw_fd_ostream dest(filename, ec,
+                              options.object ? llvm::sys::fs::OF_None
+                                             : llvm::sys::fs::OF_Text);
 
     if (ec) {
         errorStream << "Could not open file: " << ec.message() << '\n';
         return false;
     }
 
-    mipsPass->print(dest, nullptr);
+    // Functions are streamed to the file as they are generated
+    llvm::legacy::PassManager pm;
+    pm.add(createMipsAssemblyGenPass(options, &dest));
+    pm.run(*module);
+
     dest.flush();
     return true;
 }
\ No newline at end of file
@@ -2,22 +2,30 @@
 
 #include "../ast/node.h"
 #include "../llvm.h"
+#include "../pass/MipsAsmGen/MipsAssemblyGenPass.h"
+#include "stats.h"
 #include "symbol.h"
 
+// Optimization levels: those of the LLVM default pipelines, Os optimizing for size,
+// and the pipeline tuned to the MIPS backend, without or with its loop passes
+enum class OptLevel { O0, O1, O2, O3, Os, Tuned, TunedLoops };
+
 class Driver
 {
 public:
-    Driver(std::ostream &errorStream);
+    Driver(std::ostream &errorStream, TimeReport *timeReport = nullptr);
 
     bool        Parse(bool isDebugMode = false, bool printLocalTable = false);
-    void        Optimize();
+    void        Optimize(OptLevel level = OptLevel::O1);
     std::string PrintSymbolTable() const;
     std::string PrintIR() const;
     bool        EmitAssemblyCode(std::string filename) const;
-    bool        EmitSimpleMipsCode(std::string filename) const;
+    bool        EmitSimpleMipsCode(std::string           filename,
+                                   const MipsAsmOptions &options = {}) const;
 
 private:
     std::ostream &errorStream;
+    TimeReport *  timeReport;
 
     ast::Ptr<ast::TranslationUnit>     ast;
     std::unique_ptr<SymbolTable>       globalSymtab;
@@ -1,16 +1,23 @@
 #include "driver.h"
 
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 
 int main(int argc, char *argv[])
 {
     bool        debug = false;
     bool        table = false, fullTable = false;
-    bool        optimize = false;
+    OptLevel    optLevel = OptLevel::O0;
     bool        ir       = false;
     bool        assembly = false, simpleMips = false;
-    std::string asmFilename, simpleMipsFilename;
+    bool        timeReport = false;
+
+    MipsAsmOptions mipsOptions;
+    std::string asmFilename, simpleMipsFilename, traceFilename;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0)
             debug = true;
@@ -18,10 +25,31 @@ int main(int argc, char *argv[])
             table = true;
         else if (strcmp(argv[i], "-ft") == 0)
             fullTable = table = true;
+        else if (strcmp(argv[i], "-O0") == 0)
+            optLevel = OptLevel::O0;
+        else if (strcmp(argv[i], "-O1") == 0)
+            optLevel = OptLevel::O1;
+        else if (strcmp(argv[i], "-O2") == 0)
+            optLevel = OptLevel::O2;
+        else if (strcmp(argv[i], "-O3") == 0)
+            optLevel = OptLevel::O3;
+        else if (strcmp(argv[i], "-Os") == 0)
+            optLevel = OptLevel::Os;
         else if (strcmp(argv[i], "-o") == 0)
-            optimize = true;
+            optLevel = OptLevel::Tuned;
+        else if (strcmp(argv[i], "-o2") == 0)
+            optLevel = OptLevel::TunedLoops;
         else if (strcmp(argv[i], "-ir") == 0)
             ir = true;
+        else if (strcmp(argv[i], "-ftime-report") == 0)
+            timeReport = true;
+        else if (strncmp(argv[i], "-ftrace=", 8) == 0) {
+            traceFilename = argv[i] + 8;
+            if (traceFilename.empty()) {
+                std::cerr << "Require trace filename!\n";
+                return 1;
+            }
+        }
         else if (strcmp(argv[i], "-s") == 0) {
             assembly = true;
             if (i + 1 < argc)
@@ -31,6 +59,23 @@ int main(int argc, char *argv[])
                 return 1;
             }
         }
+        else if (strcmp(argv[i], "-ss-sched") == 0)
+            mipsOptions.schedule = true;
+        else if (strcmp(argv[i], "-ss-obj") == 0)
+            mipsOptions.object = true;
+        else if (strcmp(argv[i], "-fverbose-asm") == 0)
+            mipsOptions.comments = true;
+        else if (strncmp(argv[i], "-fjobs=", 7) == 0) {
+            // 0 picks one thread per core, as does leaving the option out
+            char *end;
+            errno     = 0;
+            long jobs = strtol(argv[i] + 7, &end, 10);
+            if (end == argv[i] + 7 || *end || errno || jobs < 0 || jobs > UINT_MAX) {
+                std::cerr << "Invalid thread count: " << argv[i] << '\n';
+                return 1;
+            }
+            mipsOptions.threads = jobs;
+        }
         else if (strcmp(argv[i], "-ss") == 0) {
             simpleMips = true;
             if (i + 1 < argc)
@@ -42,15 +87,22 @@ int main(int argc, char *argv[])
         }
     }
 
-    for (;;) {
-        Driver driver(std::cerr);
+    TimeReport    report;
+    TraceRecorder recorder;
+    if (!traceFilename.empty())
+        traceRecorder = &recorder;
+
+    for (int unit = 1;; unit++) {
+        TraceRecorder::Scope trace("Translation unit", std::to_string(unit));
+        Driver               driver(std::cerr, timeReport ? &report : nullptr);
+        report.AddTranslationUnit();
 
         if (driver.Parse(debug, fullTable)) {
             if (table)
                 std::cout << driver.PrintSymbolTable();
 
-            if (optimize)
-                driver.Optimize();
+            if (optLevel != OptLevel::O0)
+                driver.Optimize(optLevel);
 
             if (ir)
                 std::cout << driver.PrintIR();
@@ -59,7 +111,7 @@ int main(int argc, char *argv[])
                 driver.EmitAssemblyCode(asmFilename);
 
             if (simpleMips)
-                driver.EmitSimpleMipsCode(simpleMipsFilename);
+                driver.EmitSimpleMipsCode(simpleMipsFilename, mipsOptions);
         }
 
         char peek = getc(stdin);
@@ -68,4 +120,16 @@ int main(int argc, char *argv[])
         else
             ungetc(peek, stdin);
     }
+
+    if (timeReport)
+        report.Print(std::cerr);
+
+    if (!traceFilename.empty()) {
+        std::ofstream traceFile(traceFilename);
+        if (!traceFile) {
+            std::cerr << "Could not open file: " << traceFilename << '\n';
+            return 1;
+        }
+        recorder.Write(traceFile);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <iomanip>
+
+CompileStats   compileStats {};
+TraceRecorder *traceRecorder = nullptr;
+
+TraceRecorder::Scope::Scope(std::string name, std::string detail)
+    : recorder(traceRecorder)
+{
+    if (recorder) {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        eventIndex = recorder->events.size();
+        recorder->events.push_back({std::move(name), std::move(detail), recorder->Now(),
+                                    0, recorder->ThreadId()});
+    }
+}
+
+TraceRecorder::Scope::~Scope()
+{
+    if (recorder) {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+
+        auto &event    = recorder->events[eventIndex];
+        event.duration = recorder->Now() - event.startTime;
+    }
+}
+
+TraceRecorder::TraceRecorder() : startTime(std::chrono::steady_clock::now()) {}
+
+std::int64_t TraceRecorder::Now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - startTime)
+        .count();
+}
+
+int TraceRecorder::ThreadId()
+{
+    auto id = std::find(threads.begin(), threads.end(), std::this_thread::get_id());
+    if (id == threads.end())
+        id = threads.insert(id, std::this_thread::get_id());
+    return id - threads.begin() + 1;
+}
+
+static void WriteJsonString(std::ostream &os, const std::string &str)
+{
+    os << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if ((unsigned char)c < 0x20) {
+            const char *hex = "0123456789abcdef";
+            os << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        }
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+void TraceRecorder::Write(std::ostream &os) const
+{
+    os << "{\"traceEvents\":[";
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const auto &event = events[i];
+
+        os << (i ? ",\n" : "\n") << "{\"name\":";
+        WriteJsonString(os, event.name);
+        os << ",\"cat\":\"ncc\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.threadId
+           << ",\"ts\":" << event.startTime << ",\"dur\":" << event.duration;
+        if (!event.detail.empty()) {
+            os << ",\"args\":{\"detail\":";
+            WriteJsonString(os, event.detail);
+            os << '}';
+        }
+        os << '}';
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+TimeReport::Scope::Scope(TimeReport *report, const char *phase)
+    : report(report)
+    , phase(phase)
+    , trace(phase)
+{
+    if (report) {
+        wallStart = std::chrono::steady_clock::now();
+        cpuStart  = std::clock();
+    }
+}
+
+TimeReport::Scope::~Scope()
+{
+    if (report) {
+        std::chrono::duration<double> wallTime =
+            std::chrono::steady_clock::now() - wallStart;
+        double cpuTime = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+        report->AddTime(phase, wallTime.count(), cpuTime);
+    }
+}
+
+TimeReport::TimeReport() : unitCount(0) {}
+
+void TimeReport::AddTranslationUnit()
+{
+    unitCount++;
+}
+
+void TimeReport::AddTime(const char *phase, double wallTime, double cpuTime)
+{
+    for (auto &p : phases) {
+        if (p.name == phase) {
+            p.wallTime += wallTime;
+            p.cpuTime += cpuTime;
+            p.runs++;
+            return;
+        }
+    }
+
+    phases.push_back({phase, wallTime, cpuTime, 1});
+}
+
+void TimeReport::Print(std::ostream &os) const
+{
+    double totalWall = 0, totalCpu = 0;
+    for (const auto &p : phases) {
+        totalWall += p.wallTime;
+        totalCpu += p.cpuTime;
+    }
+
+    auto flags     = os.flags();
+    auto precision = os.precision();
+
+    os << std::string(80, '-') << '\n';
+    os << "Compile time report (" << unitCount << " translation unit"
+       << (unitCount == 1 ? "" : "s") << ")\n";
+    os << std::string(80, '-') << '\n';
+    os << std::left << std::setw(24) << "Phase" << std::right << std::setw(12)
+       << "Wall (s)" << std::setw(9) << "Wall %" << std::setw(12) << "CPU (s)"
+       << std::setw(9) << "CPU %" << std::setw(8) << "Runs" << '\n';
+
+    os << std::fixed;
+    for (const auto &p : phases) {
+        os << std::left << std::setw(24) << p.name << std::right << std::setprecision(4)
+           << std::setw(12) << p.wallTime << std::setprecision(1) << std::setw(8)
+           << (totalWall > 0 ? p.wallTime * 100 / totalWall : 0) << '%'
+           << std::setprecision(4) << std::setw(12) << p.cpuTime << std::setprecision(1)
+           << std::setw(8) << (totalCpu > 0 ? p.cpuTime * 100 / totalCpu : 0) << '%'
+           << std::setw(8) << p.runs << '\n';
+    }
+    os << std::left << std::setw(24) << "Total" << std::right << std::setprecision(4)
+       << std::setw(12) << totalWall << std::setw(9) << "" << std::setw(12) << totalCpu
+       << '\n';
+
+    os << std::string(80, '-') << '\n';
+    os << std::left << std::setw(24) << "Counter" << std::right << std::setw(12)
+       << "Count" << '\n';
+
+    const std::pair<const char *, std::uint64_t> counters[] = {
+        {"tokens lexed", compileStats.tokens},
+        {"AST nodes", compileStats.astNodes},
+        {"symbols inserted", compileStats.symbols},
+        {"IR instructions", compileStats.irInstructions},
+        {"IR instructions (opt)", compileStats.optInstructions},
+        {"MIPS lines emitted", compileStats.mipsLines},
+        {"liveness iterations", compileStats.livenessIterations},
+        {"peephole removed", compileStats.peepholeRemoved},
+        {"delay slots filled", compileStats.delaySlotsFilled}};
+
+    for (const auto &c : counters)
+        os << std::left << std::setw(24) << c.first << std::right << std::setw(12)
+           << c.second << '\n';
+    os << std::string(80, '-') << '\n';
+
+    os.flags(flags);
+    os.precision(precision);
+}
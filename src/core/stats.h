@@ -0,0 +1,95 @@
+#pragma once
+
+#include "compileStats.h"
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Recorder of nested timed events, written in Chrome trace event format (-ftrace).
+// Events may be recorded from several threads, each shown as a track of its own.
+class TraceRecorder
+{
+public:
+    // Records the enclosing scope as one event, if a recorder is installed
+    class Scope
+    {
+    public:
+        Scope(std::string name, std::string detail = {});
+        ~Scope();
+
+    private:
+        TraceRecorder *recorder;
+        std::size_t    eventIndex;
+    };
+
+    TraceRecorder();
+
+    void Write(std::ostream &os) const;
+
+private:
+    struct Event
+    {
+        std::string  name;
+        std::string  detail;
+        std::int64_t startTime;  // in microseconds since recorder creation
+        std::int64_t duration;   // in microseconds
+        int          threadId;   // in order of the first event of each thread
+    };
+
+    std::int64_t Now() const;
+    int          ThreadId();
+
+    std::vector<Event>                    events;
+    std::vector<std::thread::id>          threads;
+    std::mutex                            mutex;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// Installed trace recorder, or null when tracing is disabled
+extern TraceRecorder *traceRecorder;
+
+// Wall/CPU time accumulated for each compile phase (-ftime-report). Phases are
+// also recorded as trace events.
+class TimeReport
+{
+public:
+    // Times the enclosing scope as one run of a phase. A null report disables timing.
+    class Scope
+    {
+    public:
+        Scope(TimeReport *report, const char *phase);
+        ~Scope();
+
+    private:
+        TimeReport *                          report;
+        const char *                          phase;
+        std::chrono::steady_clock::time_point wallStart;
+        std::clock_t                          cpuStart;
+        TraceRecorder::Scope                  trace;
+    };
+
+    TimeReport();
+
+    void AddTranslationUnit();
+    void Print(std::ostream &os) const;
+
+private:
+    struct Phase
+    {
+        std::string name;
+        double      wallTime;  // in seconds
+        double      cpuTime;   // in seconds
+        int         runs;
+    };
+
+    void AddTime(const char *phase, double wallTime, double cpuTime);
+
+    std::vector<Phase> phases;
+    int                unitCount;
+};
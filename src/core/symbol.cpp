@@ -1,5 +1,7 @@
 #include "symbol.h"
 
+#include "compileStats.h"
+
 #include <algorithm>
 #include <cassert>
 #include <iomanip>
@@ -168,6 +170,7 @@ SymbolSet SymbolTable::AddSymbol(Symbol symbol)
         }
     }
 
+    compileStats.symbols++;
     auto it = symbols.insert(std::make_pair(symbol.id, symbol));
     return {&it->second, this};
 }
@@ -1,8 +1,19 @@
 #include "MipsAssemblyGenPass.h"
 
+#include "../../core/stats.h"
+#include "MipsBlockLayout.h"
+#include "MipsEncoder.h"
+#include "MipsPeephole.h"
+#include "MipsScheduler.h"
+
 using namespace llvm;
 
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
 
 namespace {
 
@@ -24,395 +35,884 @@ bool isPowerOf2(uint32_t x)
     return x && !(x & (x - 1));
 }
 
-struct MipsAssemblyGenPass : public ModulePass
+// Multiplier and shift replacing signed division by a constant d, |d| >= 2, with
+// the high word of a multiplication (Hacker's Delight, 10-1)
+struct SignedMagic
 {
-    enum Mips32Reg {
-        ZERO,
-        AT,
-        V0,
-        V1,
-        A0,
-        A1,
-        A2,
-        A3,
-        T0,
-        T1,
-        T2,
-        T3,
-        T4,
-        T5,
-        T6,
-        T7,
-        S0,
-        S1,
-        S2,
-        S3,
-        S4,
-        S5,
-        S6,
-        S7,
-        T8,
-        T9,
-        K0,
-        K1,
-        GP,
-        SP,
-        FP,
-        RA
-    };
+    int32_t multiplier;
+    int     shift;
+};
 
-    static char ID;
-    MipsAssemblyGenPass() : ModulePass(ID), ss(assemblyText) {}
-    bool runOnModule(Module &M) override;
-    void print(raw_ostream &O, const Module *M) const override { O << assemblyText; }
+SignedMagic signedMagic(int32_t d)
+{
+    const uint32_t two31 = 0x80000000u;
+
+    uint32_t ad  = d < 0 ? 0u - (uint32_t)d : d;
+    uint32_t t   = two31 + ((uint32_t)d >> 31);
+    uint32_t anc = t - 1 - t % ad;  // absolute value of nc
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta;
+    int      p = 31;
+
+    do {
+        p++;
+        q1 = 2 * q1, r1 = 2 * r1;
+        if (r1 >= anc)
+            q1++, r1 -= anc;
+        q2 = 2 * q2, r2 = 2 * r2;
+        if (r2 >= ad)
+            q2++, r2 -= ad;
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    int32_t multiplier = q2 + 1;
+    return {d < 0 ? -multiplier : multiplier, p - 32};
+}
+
+// Multiplier and shift replacing unsigned division by a constant d >= 2. If
+// needAdd, the multiplier has 33 bits and its top bit is added back through
+// the dividend (Hacker's Delight, 10-2).
+struct UnsignedMagic
+{
+    uint32_t multiplier;
+    int      shift;
+    bool     needAdd;
+};
+
+UnsignedMagic unsignedMagic(uint32_t d)
+{
+    uint32_t nc = -1 - (0u - d) % d;
+    uint32_t q1 = 0x80000000u / nc, r1 = 0x80000000u - q1 * nc;
+    uint32_t q2 = 0x7fffffffu / d, r2 = 0x7fffffffu - q2 * d;
+    uint32_t delta;
+    bool     needAdd = false;
+    int      p       = 31;
+
+    do {
+        p++;
+        if (r1 >= nc - r1)
+            q1 = 2 * q1 + 1, r1 = 2 * r1 - nc;
+        else
+            q1 = 2 * q1, r1 = 2 * r1;
+        if (r2 + 1 >= d - r2) {
+            needAdd |= q2 >= 0x7fffffffu;
+            q2 = 2 * q2 + 1, r2 = 2 * r2 + 1 - d;
+        }
+        else {
+            needAdd |= q2 >= 0x80000000u;
+            q2 = 2 * q2, r2 = 2 * r2 + 1;
+        }
+        delta = d - 1 - r2;
+    } while (p < 64 && (q1 < delta || (q1 == delta && r1 == 0)));
+
+    return {q2 + 1, p - 32, needAdd};
+}
+
+// Calls to intrinsics produce no code
+bool isCall(const Instruction *I)
+{
+    auto callInst = dyn_cast<CallInst>(I);
+    return callInst && !callInst->getCalledFunction()->isIntrinsic();
+}
+
+// Integer extensions, casts between pointers and integers and freezes change no
+// bit of a 32-bit register, and share the register of their operand
+bool isRegisterCopy(const Value *value)
+{
+    return isa<SExtInst>(value) || isa<ZExtInst>(value) || isa<BitCastInst>(value)
+           || isa<PtrToIntInst>(value) || isa<IntToPtrInst>(value)
+           || isa<FreezeInst>(value);
+}
+
+// A GEP with constant indices used only as the address of loads, stores and
+// other GEPs is folded into their offsets, and needs no register
+bool isFoldedAddress(const Value *value)
+{
+    auto GEPInst = dyn_cast<GetElementPtrInst>(value);
+    if (!GEPInst || !GEPInst->hasAllConstantIndices())
+        return false;
+
+    for (auto user : GEPInst->users()) {
+        auto storeInst = dyn_cast<StoreInst>(user);
+        auto userGEP   = dyn_cast<GetElementPtrInst>(user);
+        if (isa<LoadInst>(user) || storeInst && storeInst->getValueOperand() != GEPInst
+            || userGEP && userGEP->getPointerOperand() == GEPInst)
+            continue;
+        return false;
+    }
+    return true;
+}
+
+// The address of a stack or global object plus a constant offset is recomputed
+// where needed instead of being spilled
+bool isRematerializable(const Value *value)
+{
+    if (!isa<GetElementPtrInst>(value))
+        return false;
+
+    for (;;) {
+        if (auto GEP = dyn_cast<GEPOperator>(value)) {
+            if (!GEP->hasAllConstantIndices())
+                return false;
+            value = GEP->getPointerOperand();
+        }
+        else if (isa<BitCastOperator>(value))
+            value = cast<Operator>(value)->getOperand(0);
+        else
+            break;
+    }
+    return isa<AllocaInst>(value) || isa<GlobalVariable>(value);
+}
+
+// Label of a global
+std::string globalLabel(const GlobalValue *global)
+{
+    return ("G_" + global->getName()).str();
+}
+
+// An integer comparison used only by the conditional branch of its block is
+// emitted as part of the branch, and needs no register
+bool isFusedCompare(const Value *value)
+{
+    auto icmpInst = dyn_cast<ICmpInst>(value);
+    if (!icmpInst || !icmpInst->hasOneUse()
+        || !icmpInst->getOperand(0)->getType()->isIntegerTy())
+        return false;
+
+    auto branchInst = dyn_cast<BranchInst>(icmpInst->user_back());
+    if (!branchInst || branchInst->getParent() != icmpInst->getParent())
+        return false;
+
+    // The operands are read after the PHI moves on the way to the successors,
+    // which must not overwrite them
+    for (const auto &op : icmpInst->operands()) {
+        auto PHIInst = dyn_cast<PHINode>(op.get());
+        if (PHIInst && PHIInst->getBasicBlockIndex(icmpInst->getParent()) >= 0)
+            return false;
+    }
+    return !isa<ConstantInt>(icmpInst->getOperand(0))
+           || !isa<ConstantInt>(icmpInst->getOperand(1));
+}
+
+// Whether the result of an instruction is read by one of the next instructions of
+// its block, which would wait for a slow result
+bool isUsedSoon(const Instruction *I)
+{
+    auto next = I->getNextNode();
+    for (int i = 0; i < 2 && next; i++, next = next->getNextNode()) {
+        if (is_contained(next->operands(), I))
+            return true;
+    }
+    return false;
+}
+
+// Instructions generated as one instruction reading their operands and writing
+// the result, constant operands going through scratch registers, so the result
+// may be given the register of an operand
+bool writesResultLast(const Instruction *I)
+{
+    if (isa<SelectInst>(I))
+        return true;
+
+    if (auto intrinsicInst = dyn_cast<IntrinsicInst>(I)) {
+        switch (intrinsicInst->getIntrinsicID()) {
+        case Intrinsic::smax:
+        case Intrinsic::smin:
+        case Intrinsic::umax:
+        case Intrinsic::umin:
+        case Intrinsic::abs:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    auto binaryOpInst = dyn_cast<BinaryOperator>(I);
+    if (!binaryOpInst)
+        return false;
+
+    switch (binaryOpInst->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+    case Instruction::Mul:
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+    case Instruction::And:
+    case Instruction::Or:
+    case Instruction::Xor:
+        return true;
+    default:
+        return false;
+    }
+}
+
+enum Mips32Reg {
+    ZERO,
+    AT,
+    V0,
+    V1,
+    A0,
+    A1,
+    A2,
+    A3,
+    T0,
+    T1,
+    T2,
+    T3,
+    T4,
+    T5,
+    T6,
+    T7,
+    S0,
+    S1,
+    S2,
+    S3,
+    S4,
+    S5,
+    S6,
+    S7,
+    T8,
+    T9,
+    K0,
+    K1,
+    GP,
+    SP,
+    FP,
+    RA
+};
+
+raw_ostream &operator<<(raw_ostream &os, Mips32Reg reg)
+{
+    const char *RegNames[32] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+                                "t0",   "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+                                "s0",   "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+                                "t8",   "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
+    os << '$' << RegNames[reg];
+    return os;
+}
+
+// Generator of the assembly of one function. All state of register and stack
+// allocation is its own, so that functions can be generated in parallel; the
+// module only shares the read-only global layout.
+struct MipsFunctionAsmGen
+{
+    MipsFunctionAsmGen(const DenseMap<const Value *, int32_t> &globalAlloc,
+                       const MipsAsmOptions &                  options)
+        : schedule(options.schedule)
+        , comments(options.comments)
+        , object(options.object)
+        , globalAlloc(globalAlloc)
+    {
+    }
+    void genFunctionAsm(const Function *F);
+
+    std::string           assemblyText;  // the function, unless encoded
+    MipsInstList          insts;         // the function, for an object
+    std::vector<MipsData> data;          // jump tables of the function, in .rodata
+    CompileStats          stats {};      // counters of the function, summed up
 
 private:
     // General purpose registers for register allocation
     static const Mips32Reg RegPool[20];
-    static const Mips32Reg TempReg[12];
+    static const Mips32Reg TempFirstRegPool[20];
 
-    std::string        assemblyText;
-    raw_string_ostream ss;
+    bool schedule;  // fill delay slots, output is ".set noreorder"
+    bool comments;  // annotate stack and register allocation
+    bool object;    // keep the instructions to be encoded
 
     DenseMap<const Value *, Mips32Reg> regAlloc;
     DenseMap<const Value *, uint32_t>  stackAlloc;
     uint32_t                           stackTop;
-    DenseMap<const Value *, uint32_t>  globalAlloc;
-    uint32_t                           globalTop;
+    uint32_t                           frameSize;
+    uint32_t                           outgoingSize;  // outgoing arguments at 0($sp)
+    uint32_t                           localBase;     // offset of stack slots from $sp
+    bool                               isLeaf;
 
-    std::multimap<const BasicBlock *, const PHINode *>               phiBlocks;
-    std::map<Mips32Reg, const Value *>                               FRegs;
-    std::map<const BasicBlock *, std::map<Mips32Reg, const Value *>> BBToRegs;
+    // Offsets of small data from $gp, shared by all functions
+    const DenseMap<const Value *, int32_t> &globalAlloc;
 
-    enum CFGNodeStatus { UNVISITED, VISITED, PROCESSED };
-    DenseMap<const BasicBlock *, SmallPtrSet<const Value *, 32>> live, defs;
-    DenseMap<const BasicBlock *, CFGNodeStatus>                  BBStatus;
+    std::map<Mips32Reg, const Value *> FRegs;
+
+    // Edges whose PHI copies are placed in a block of their own, after the function
+    std::vector<std::pair<const BasicBlock *, const BasicBlock *>> edgeBlocks;
+
+    // Jump tables of switches, placed in .rodata after the function
+    struct JumpTable
+    {
+        const BasicBlock *               BB;  // of the switch
+        std::vector<const BasicBlock *> targets;
+    };
+    std::vector<JumpTable> jumpTables;
+
+    // Consecutive case values of a switch going to the same successor
+    struct CaseRange
+    {
+        int64_t           low, high;
+        const BasicBlock *toBB;
+    };
+
+    // Loops of the function, shared by block layout and spill weights
+    DominatorTree dominatorTree;
+    LoopInfo      loopInfo;
+
+    // Blocks in emission order, and the block emitted after each one
+    std::vector<const BasicBlock *>                  blockLayout;
+    DenseMap<const BasicBlock *, const BasicBlock *> nextBlock;
+
+    // Liveness of values needing a register, as bit vectors over dense value numbers
+    std::vector<const Value *>             liveValues;
+    DenseMap<const Value *, unsigned>      valueIndex;
+    DenseMap<const BasicBlock *, unsigned> BBIndex;
+    std::vector<BitVector>                 liveIn, liveOut, useSet, defSet;
+
+    // Live range of a value over the linear instruction numbering of a function
+    struct LiveInterval
+    {
+        const Value *value;
+        uint32_t     start, end;
+        float        spillWeight;  // uses and defs weighted by loop depth
+    };
+    DenseMap<const Instruction *, uint32_t>                     instIndex;
+    DenseMap<const BasicBlock *, std::pair<uint32_t, uint32_t>> BBRange;
+
+    // Calls in instruction order, and the caller-saved registers live across each
+    std::vector<const Instruction *>                      calls;
+    std::vector<uint32_t>                                 callPositions;
+    DenseMap<const Instruction *, std::vector<Mips32Reg>> callSaveRegs;
 
-    void genFunctionAsm(const Function *F);
     void genBasicBlockAsm(const BasicBlock *BB);
     void genInstructionAsm(const Instruction *I);
-    void globalAllocate(const Module *M);
     void stackAllocate(const Function *F);
     void registerAllocate(const Function *F);
-    void recordPhiBlock(const Function *F);
+    void numberInstructions(const Function *F);
+    void buildLiveIntervals(const Function *F, std::vector<LiveInterval> &intervals);
+    void spillValue(const Value *value);
+    void assignSpillSlots(const std::vector<LiveInterval> &intervals);
+    void coalescePhis(std::vector<LiveInterval> &                          intervals,
+                      DenseMap<const Value *, std::vector<const Value *>> &coalesced);
+    bool isLiveAt(const Value *value, const Value *def);
+    bool crossesCall(const LiveInterval &interval) const;
     void analysisLiveness(const Function *F);
-    void addLiveInToUserBlock(const Value *value, const User *user);
-    bool dfsCFGLiveSet(const BasicBlock *BB);
+    int  liveValueIndex(const Value *value);
     bool needRegister(const Instruction *I);
 
-    void                genFName(const Function *F);
-    void                genBBName(const BasicBlock *BB);
+    int32_t frameOffset(uint32_t offset) const { return offset + localBase; }
+
+    // Append instructions, labels and comments to the function
+    void emit(MipsOp op,
+              int    r0 = MipsInst::NoReg,
+              int    r1 = MipsInst::NoReg,
+              int    r2 = MipsInst::NoReg)
+    {
+        insts.push_back(MipsInst::make(op, r0, r1, r2));
+    }
+    void emitImm(MipsOp op, int r0, int r1, int64_t imm)
+    {
+        insts.push_back(MipsInst::makeImm(op, r0, r1, imm));
+    }
+    void emitImm(MipsOp op, int r0, int64_t imm)
+    {
+        insts.push_back(MipsInst::makeImm(op, r0, imm));
+    }
+    void emitMem(MipsOp op, int reg, int64_t offset, int base)
+    {
+        insts.push_back(MipsInst::makeMem(op, reg, offset, base));
+    }
+    void emitBranch(MipsOp    op,
+                    StringRef target,
+                    int       r0 = MipsInst::NoReg,
+                    int       r1 = MipsInst::NoReg)
+    {
+        insts.push_back(MipsInst::makeBranch(op, target, r0, r1));
+    }
+    void emitLabel(StringRef name) { insts.push_back(MipsInst::makeLabel(name)); }
+    void emitComment(StringRef text) { insts.push_back(MipsInst::makeComment(text)); }
+
+    // Memory operand of a load or store, "offset(base)" or, with a symbol,
+    // "%gp_rel(symbol+offset)($gp)"
+    struct MemOperand
+    {
+        int64_t     offset;
+        Mips32Reg   base;
+        std::string symbol;
+    };
+    void emitMem(MipsOp op, int reg, const MemOperand &address)
+    {
+        insts.push_back(
+            MipsInst::makeMem(op, reg, address.offset, address.base, address.symbol));
+    }
+
+    // Copy on a control flow edge from an incoming value to a PHI. Locations are
+    // register numbers, or StackLocation plus the offset of a stack slot.
+    static const int StackLocation = 64;
+    struct PhiCopy
+    {
+        int          dst, src;  // src is -1 for values materialized in place
+        const Value *value;
+    };
+    std::vector<PhiCopy> phiCopies(const BasicBlock *fromBB, const BasicBlock *toBB);
+
+    std::string         genFName(const Function *F);
+    std::string         genBBName(const BasicBlock *BB);
     void                genJump(const Instruction *I, const BasicBlock *toBB);
-    bool                genPhi(const BasicBlock *BB, const Value *cond);
-    friend raw_ostream &operator<<(raw_ostream &os, Mips32Reg reg)
+    std::string         genEdgeName(const BasicBlock *fromBB, const BasicBlock *toBB);
+    void                genCondBranch(const BranchInst *                     branchInst,
+                                      const std::function<MipsInst(bool)> &genBranch,
+                                      const BasicBlock *                     hoistedBB);
+    const BasicBlock *  hoistablePhiEdge(const BranchInst *branchInst);
+    void                genSwitch(const SwitchInst *switchInst);
+    void                genSwitchTree(const SwitchInst *  switchInst,
+                                      Mips32Reg           reg,
+                                      ArrayRef<CaseRange> ranges,
+                                      unsigned &          labels);
+    std::string         genSwitchTarget(const BasicBlock *BB, const BasicBlock *toBB);
+    void                genPhiCopies(const BasicBlock *fromBB, const BasicBlock *toBB);
+    void                genLocationMove(int dst, int src);
+    int                 phiLocation(const Value *value);
+    void                genArgumentMoves(const CallInst *callInst);
+    void                genIntrinsic(const IntrinsicInst *I);
+    Mips32Reg           genOperand(const Instruction *I,
+                                   const Value *      value,
+                                   Mips32Reg          scratch);
+    const Value *       foldAddress(const Value *     address,
+                                    int64_t &         offset,
+                                    const DataLayout &dataLayout);
+    void                genReload(Mips32Reg reg, const Value *value);
+    bool                isGpRelative(const Value *base, int64_t offset) const;
+    void                genAddress(const Instruction *I,
+                                   Mips32Reg          dst,
+                                   const Value *      address);
+    MemOperand          genMemOperand(const Instruction *I,
+                                      const Value *      address,
+                                      Mips32Reg          scratch);
+    void                genCompareBranch(const BranchInst *branchInst,
+                                         const ICmpInst *  icmpInst,
+                                         const BasicBlock *hoistedBB);
+    void                genMultiply(Mips32Reg dst,
+                                    Mips32Reg src,
+                                    int64_t   multiplier,
+                                    bool      isNeeded);
+    void                genDivision(const BinaryOperator *I,
+                                    Mips32Reg             dividend,
+                                    Mips32Reg             divisor,
+                                    const ConstantInt *   constDivisor);
+};
+
+struct MipsAssemblyGenPass : public ModulePass
+{
+    static char ID;
+    MipsAssemblyGenPass(const MipsAsmOptions &options = {}, raw_ostream *out = nullptr)
+        : ModulePass(ID), options(options), out(out), ss(assemblyText)
     {
-        const char *RegNames[32] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
-                                    "t0",   "t1", "t2", "t3", "t4", "t5", "t6", "t7",
-                                    "s0",   "s1", "s2", "s3", "s4", "s5", "s6", "s7",
-                                    "t8",   "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
-        os << '$' << RegNames[reg];
-        return os;
     }
+    bool runOnModule(Module &M) override;
+    void print(raw_ostream &O, const Module *M) const override { O << assemblyText; }
+
+private:
+    MipsAsmOptions     options;
+    raw_ostream *      out;           // streamed output, or null to keep assemblyText
+    std::string        assemblyText;  // the program, unless streamed
+    raw_string_ostream ss;
+
+    DenseMap<const Value *, int32_t> globalAlloc;  // offsets of small data from $gp
+    uint32_t                         globalTop;    // end of small data, from .sdata
+    std::vector<MipsData>            globalData;
+
+    void globalAllocate(const Module *M);
 };
 
 char MipsAssemblyGenPass::ID = 0;
 
-const MipsAssemblyGenPass::Mips32Reg MipsAssemblyGenPass::RegPool[20] = {
-    S0, S1, T0, T1, S2, S3, T2, T3, S4, S5, T4, T5, S6, S7, T6, T7, T8, T9, K0, K1};
+// Values live across a call prefer callee-saved registers, which are saved once in
+// the prologue instead of around every call
+const Mips32Reg MipsFunctionAsmGen::RegPool[20] = {
+    S0, S1, S2, S3, S4, S5, S6, S7, T0, T1, T2, T3, T4, T5, T6, T7, T8, T9, K0, K1};
 
-const MipsAssemblyGenPass::Mips32Reg MipsAssemblyGenPass::TempReg[12] =
-    {T0, T1, T2, T3, T4, T5, T6, T7, T8, T9, K0, K1};
+// Other values prefer temporaries, which need no save at all
+const Mips32Reg MipsFunctionAsmGen::TempFirstRegPool[20] = {
+    T0, T1, T2, T3, T4, T5, T6, T7, T8, T9, K0, K1, S0, S1, S2, S3, S4, S5, S6, S7};
 
 bool MipsAssemblyGenPass::runOnModule(Module &M)
 {
     assemblyText.clear();
-    globalAllocate(&M);
 
-    ss << "\n.text\n";
+    // Text is written out as soon as it is complete, unless kept for print() or
+    // encoded into an object, which is written at the end
+    MipsObjectWriter writer;
+    auto             emit = [&](StringRef text) {
+        if (out)
+            *out << text;
+        else
+            ss << text;
+    };
+
+    globalAllocate(&M);
 
-    auto funcMain = M.getFunction("main");
+    // Startup code calling main then exiting, and the system calls the runtime
+    // library provides
+    MipsInstList header;
+    auto         funcMain = M.getFunction("main");
     if (funcMain && !funcMain->isDeclaration()) {
-        ss << "\tjal ";
-        genFName(funcMain);
-        ss << "\n\taddiu " << V0 << ", " << ZERO << ", " << 10 << "\n\tsyscall\n\n";
-
-        ss << "F_write:\n"
-           << "\taddiu " << V0 << ", " << ZERO << ", " << 1 << '\n'
-           << "\tsyscall\n"
-           << "\tjr " << RA << "\n\n"
-           << "F_putchar:\n"
-           << "\taddiu " << V0 << ", " << ZERO << ", " << 11 << '\n'
-           << "\tsyscall\n"
-           << "\tjr " << RA << "\n\n";
+        auto genDelaySlot = [&]() {
+            if (options.schedule)
+                header.push_back(MipsInst::make(MipsOp::NOP));
+        };
+        auto genSyscall = [&](const char *name, int64_t code) {
+            header.push_back(MipsInst::makeLabel(name));
+            header.push_back(MipsInst::makeImm(MipsOp::ADDIU, V0, ZERO, code));
+            header.push_back(MipsInst::make(MipsOp::SYSCALL));
+            header.push_back(MipsInst::make(MipsOp::JR, RA));
+            genDelaySlot();
+            header.push_back(MipsInst::makeComment(""));
+        };
+
+        auto mainLabel = ("F_" + funcMain->getName()).str();
+        header.push_back(MipsInst::makeBranch(MipsOp::JAL, mainLabel));
+        genDelaySlot();
+        header.push_back(MipsInst::makeImm(MipsOp::ADDIU, V0, ZERO, 10));
+        header.push_back(MipsInst::make(MipsOp::SYSCALL));
+        header.push_back(MipsInst::makeComment(""));
+        genSyscall("F_write", 1);
+        genSyscall("F_putchar", 11);
+    }
+    compileStats.mipsLines += header.size();
 
-        genFunctionAsm(funcMain);
+    if (options.object) {
+        for (const auto &object : globalData)
+            writer.addData(object);
+        writer.setNoReorder(options.schedule);
+        writer.addText(header);
+    }
+    else {
+        std::string        headerText;
+        raw_string_ostream os(headerText);
+        printMipsData(os, globalData);
+        os << "\n.text\n";
+        if (options.schedule)
+            os << "\t.set noreorder\n";
+        printMipsAsm(os, header);
+        emit(os.str());
     }
 
+    // Functions are generated independently on a thread pool, main first, and
+    // written in this order so the output does not depend on scheduling
+    std::vector<const Function *> functions;
+    if (funcMain && !funcMain->isDeclaration())
+        functions.push_back(funcMain);
     for (const auto &F : M.functions()) {
         if (&F != funcMain && !F.isDeclaration())
-            genFunctionAsm(&F);
+            functions.push_back(&F);
+    }
+
+    auto emitFunction = [&](const MipsFunctionAsmGen &generator) {
+        compileStats.mipsLines += generator.stats.mipsLines;
+        if (options.object) {
+            writer.addText(generator.insts);
+            for (const auto &table : generator.data)
+                writer.addData(table);
+        }
+        else
+            emit(generator.assemblyText);
+        compileStats.livenessIterations += generator.stats.livenessIterations;
+        compileStats.peepholeRemoved += generator.stats.peepholeRemoved;
+        compileStats.delaySlotsFilled += generator.stats.delaySlotsFilled;
+    };
+
+    if (options.threads == 1 || functions.size() < 2) {
+        for (auto F : functions) {
+            MipsFunctionAsmGen generator(globalAlloc, options);
+            generator.genFunctionAsm(F);
+            emitFunction(generator);
+        }
+    }
+    else {
+        ThreadPool pool(hardware_concurrency(options.threads));
+        std::vector<std::unique_ptr<MipsFunctionAsmGen>> generators;
+        std::vector<std::shared_future<void>>            done;
+
+        for (auto F : functions) {
+            auto generator = new MipsFunctionAsmGen(globalAlloc, options);
+            generators.emplace_back(generator);
+            done.push_back(pool.async([=] { generator->genFunctionAsm(F); }));
+        }
+
+        // A function is written once it and all before it are done, and only
+        // the functions still waiting for an earlier one are held in memory
+        for (size_t i = 0; i < functions.size(); i++) {
+            done[i].wait();
+            emitFunction(*generators[i]);
+            generators[i].reset();
+        }
+    }
+
+    if (options.object) {
+        std::string error;
+        if (!writer.write(out ? *out : ss, error))
+            report_fatal_error(Twine("MIPS object emission failed: ") + error);
     }
 
     ss.flush();
     return false;
 }
 
-void MipsAssemblyGenPass::genFunctionAsm(const Function *F)
+void MipsFunctionAsmGen::genFunctionAsm(const Function *F)
 {
-    ss << "# function: " << F->getName() << '\n';
+    TraceRecorder::Scope trace("genFunctionAsm", F->getName().str());
+
+    insts.clear();
+    data.clear();
+    emitComment(("# function: " + F->getName()).str());
 
     analysisLiveness(F);
 
+    {
+        TraceRecorder::Scope trace("layoutBlocks", F->getName().str());
+        dominatorTree.recalculate(const_cast<Function &>(*F));
+        loopInfo.releaseMemory();
+        loopInfo.analyze(dominatorTree);
+        blockLayout = layoutBlocks(*F, loopInfo);
+    }
+    nextBlock.clear();
+    for (size_t i = 0; i + 1 < blockLayout.size(); i++)
+        nextBlock[blockLayout[i]] = blockLayout[i + 1];
+
     // Allocate stack storage value
     stackAllocate(F);
 
-    // Record argument register
+    // Record argument register. The first four arguments come in $a0-$a3, the
+    // others in the caller's outgoing argument area; arguments live across a call
+    // are moved elsewhere by the register allocator.
     regAlloc.clear();
-    int argIndex = 0;
     for (const auto &arg : F->args()) {
-        if (argIndex < 4)
-            regAlloc[&arg] = Mips32Reg(A0 + argIndex++);
-        else {
-            regAlloc[&arg] = ZERO;
-            ss << "# unsupported argcount > 4, assigning " << arg.getName() << " to $0\n";
+        if (arg.getArgNo() < 4)
+            regAlloc[&arg] = Mips32Reg(A0 + arg.getArgNo());
+        else
+            regAlloc[&arg] = V0;
+    }
+
+    // Leaf functions don't save $ra
+    isLeaf = true;
+    for (const_inst_iterator It = inst_begin(F), E = inst_end(F); It != E; It++) {
+        if (isCall(&*It)) {
+            isLeaf = false;
+            break;
         }
     }
 
-    // Allocate value into register using graph coloring algorithm
+    // Allocate value into register using linear scan over live intervals
     registerAllocate(F);
 
-    // Associate PHINode to its incoming BasicBlock
-    recordPhiBlock(F);
-
-    genFName(F);
-    ss << ":\n";
-
-    // Align to 4 bytes
-    stackTop         = (stackTop + 3) & ~3;
-    int saveRegCount = 2;
-    // Save Stack Frame, Reg
+    // Frame layout, from $sp upwards: outgoing arguments, caller-saved registers
+    // live across a call, stack slots, saved $s registers and $ra. Every slot has
+    // a static offset, so the frame is addressed from $sp and no frame pointer is
+    // set up; leaf functions keep $ra in place.
+    std::vector<Mips32Reg> savedRegs;
     for (int saveReg = S0; saveReg <= S7; saveReg++) {
         if (FRegs.find(Mips32Reg(saveReg)) != FRegs.end())
-            saveRegCount++;
+            savedRegs.push_back(Mips32Reg(saveReg));
     }
 
-    ss << "\taddiu " << SP << ", " << SP << ", -" << (4 * saveRegCount + stackTop)
-       << '\n';
-    ss << "\tsw " << RA << ", " << stackTop << '(' << SP << ")\n";
-    ss << "\tsw " << FP << ", " << stackTop + 4 << '(' << SP << ")\n";
-    for (int saveReg = S0; saveReg <= S7; saveReg++) {
-        if (FRegs.find(Mips32Reg(saveReg)) != FRegs.end()) {
-            ss << "\tsw " << Mips32Reg(saveReg) << ", "
-               << stackTop + 8 + 4 * (saveReg - S0) << '(' << SP << ")\n";
+    // As in O32, a function making calls always reserves the 16 byte home area of
+    // $a0-$a3, which the callee may store to; stack arguments follow it
+    outgoingSize          = isLeaf ? 0 : 16;
+    uint32_t callSaveSize = 0;
+    for (auto callInst : calls) {
+        uint32_t argCount = cast<CallInst>(callInst)->arg_size();
+        outgoingSize      = std::max(outgoingSize, 4 * argCount);
+        callSaveSize =
+            std::max(callSaveSize, 4 * (uint32_t)callSaveRegs[callInst].size());
+    }
+
+    // Slots are aligned to 4 bytes, the frame to the 8 bytes O32 keeps $sp aligned
+    // to, any padding going between the saved $s registers and $ra
+    stackTop  = (stackTop + 3) & ~3;
+    localBase = outgoingSize + callSaveSize;
+    frameSize = localBase + stackTop + 4 * savedRegs.size() + (isLeaf ? 0 : 4);
+    frameSize = alignTo(frameSize, 8);
+    uint32_t savedBase = localBase + stackTop;
+
+    emitLabel(genFName(F));
+
+    // Save Stack Frame, Reg
+    if (frameSize)
+        emitImm(MipsOp::ADDIU, SP, SP, -int64_t(frameSize));
+    if (!isLeaf)
+        emitMem(MipsOp::SW, RA, frameSize - 4, SP);
+    for (size_t i = 0; i < savedRegs.size(); i++)
+        emitMem(MipsOp::SW, savedRegs[i], savedBase + 4 * i, SP);
+
+    // Move arguments to where they were allocated
+    for (const auto &arg : F->args()) {
+        unsigned  argNo = arg.getArgNo();
+        Mips32Reg reg   = regAlloc[&arg];
+
+        if (argNo < 4) {
+            if (reg == V0)
+                emitMem(MipsOp::SW, A0 + argNo, frameOffset(stackAlloc[&arg]), SP);
+            else if (reg != A0 + argNo)
+                emit(MipsOp::MOVE, reg, Mips32Reg(A0 + argNo));
+        }
+        else {
+            // Spilled stack arguments are used in place, in the caller's frame
+            uint32_t home = frameSize + 4 * argNo;
+            if (reg == V0)
+                stackAlloc[&arg] = home - localBase;
+            else
+                emitMem(MipsOp::LW, reg, home, SP);
         }
     }
-    ss << "\tmove " << FP << ", " << SP << '\n';
 
-    for (const auto &BB : F->getBasicBlockList()) {
-        genBasicBlockAsm(&BB);
+    edgeBlocks.clear();
+    jumpTables.clear();
+    for (auto BB : blockLayout) {
+        genBasicBlockAsm(BB);
     }
 
-    ss << '_' << F->getName() << "_RET:\n";
+    emitLabel(("_" + F->getName() + "_RET").str());
 
     // Restore Stack Frame, Reg
-    ss << "\tmove " << SP << ", " << FP << '\n';
-    for (int saveReg = S0; saveReg <= S7; saveReg++) {
-        if (FRegs.find(Mips32Reg(saveReg)) != FRegs.end()) {
-            ss << "\tlw " << Mips32Reg(saveReg) << ", "
-               << stackTop + 8 + 4 * (saveReg - S0) << '(' << SP << ")\n";
-        }
+    for (size_t i = 0; i < savedRegs.size(); i++)
+        emitMem(MipsOp::LW, savedRegs[i], savedBase + 4 * i, SP);
+    if (!isLeaf)
+        emitMem(MipsOp::LW, RA, frameSize - 4, SP);
+    if (frameSize)
+        emitImm(MipsOp::ADDIU, SP, SP, frameSize);
+
+    emit(MipsOp::JR, RA);
+
+    // Jump tables first, as their entries may go to edge blocks
+    for (size_t i = 0; i < jumpTables.size(); i++) {
+        const auto &targets = jumpTables[i].targets;
+        MipsData    table;
+        table.section  = MipsData::ReadOnlyData;
+        table.label    = genBBName(jumpTables[i].BB) + ".table" + std::to_string(i);
+        table.isGlobal = false;
+        table.align    = 4;
+        table.bytes.assign(4 * targets.size(), 0);
+        for (size_t j = 0; j < targets.size(); j++)
+            table.addresses[4 * j] = {genSwitchTarget(jumpTables[i].BB, targets[j]), 0};
+        data.push_back(std::move(table));
     }
-    ss << "\tlw " << FP << ", " << stackTop + 4 << '(' << SP << ")\n";
-    ss << "\tlw " << RA << ", " << stackTop << '(' << SP << ")\n";
-    ss << "\taddiu " << SP << ", " << SP << ", " << (4 * saveRegCount + stackTop) << '\n';
 
-    ss << "\tjr " << RA << "\n\n";
-}  // namespace
+    for (auto edge : edgeBlocks) {
+        emitLabel(genEdgeName(edge.first, edge.second));
+        genPhiCopies(edge.first, edge.second);
+        emitBranch(MipsOp::J, genBBName(edge.second));
+    }
+
+    {
+        TraceRecorder::Scope trace("peephole", F->getName().str());
+        stats.peepholeRemoved += runMipsPeephole(insts);
+    }
+    if (schedule) {
+        TraceRecorder::Scope trace("schedule", F->getName().str());
+        stats.delaySlotsFilled += runMipsScheduler(insts);
+    }
+    stats.mipsLines = insts.size();
+
+    // Printed once optimized, unless encoded into an object
+    if (!object) {
+        raw_string_ostream os(assemblyText);
+        printMipsAsm(os, insts);
+        if (!data.empty()) {
+            printMipsData(os, data);
+            os << ".text\n";
+        }
+        os << '\n';
+        insts.clear();
+        data.clear();
+    }
+}
 
-void MipsAssemblyGenPass::genBasicBlockAsm(const BasicBlock *BB)
+void MipsFunctionAsmGen::genBasicBlockAsm(const BasicBlock *BB)
 {
-    genBBName(BB);
-    ss << ":\n";
+    emitLabel(genBBName(BB));
     for (const auto &I : BB->getInstList()) {
         genInstructionAsm(&I);
     }
 }
 
-void MipsAssemblyGenPass::genInstructionAsm(const Instruction *I)
+void MipsFunctionAsmGen::genInstructionAsm(const Instruction *I)
 {
     if (isa<AllocaInst>(I) || isa<PHINode>(I)) {
         // pass
         return;
     }
+    else if (isFoldedAddress(I) || regAlloc[I] == V0 && isRematerializable(I)) {
+        // Folded into the memory operands of its users, or recomputed at each use
+    }
     else if (auto GEPInst = dyn_cast<GetElementPtrInst>(I)) {
-        auto       address = GEPInst->getPointerOperand();
-        DataLayout dataLayout(I->getFunction()->getParent());
-        APInt      offset(32, 0, true);
-
-        if (GEPInst->accumulateConstantOffset(dataLayout, offset)) {
-            ss << "\t #constant offset GEP not supported\n";
-        }
-        else {
-            if (globalAlloc.find(address) != globalAlloc.end())
-                ss << "\taddiu " << regAlloc[I] << ", " << GP << ", "
-                   << globalAlloc[address] << '\n';
-            else if (!regAlloc[address])
-                ss << "\taddiu " << regAlloc[I] << ", " << FP << ", "
-                   << stackAlloc[address] << '\n';
-            else if (regAlloc[address] == V0)
-                ss << "\tlw " << regAlloc[I] << ", " << stackAlloc[address] << '(' << FP
-                   << ")\n";
-            else
-                ss << "\tmove " << regAlloc[I] << ", " << regAlloc[address] << '\n';
-
-            auto elemType = GEPInst->getSourceElementType();
-            for (auto indexIt = GEPInst->idx_begin();;) {
-                uint32_t  elemSize   = dataLayout.getTypeAllocSize(elemType);
-                Value *   indexValue = indexIt->get();
-                Mips32Reg regIndex;
-
-                if (auto constIdx = dyn_cast<ConstantInt>(indexValue)) {
-                    if (constIdx->getValue().isNullValue()) {
-                        goto next_index;
-                    }
-                    else {
-                        regIndex = V1;
-                        ss << "\taddiu " << regIndex << ", " << ZERO << ", "
-                           << constIdx->getSExtValue() << '\n';
-                    }
-                }
-                else {
-                    regIndex = regAlloc[indexValue];
-                    if (regIndex == V0) {
-                        regIndex = V1;
-                        ss << "\tlw " << regIndex << ", " << stackAlloc[indexValue] << '('
-                           << FP << ")\n";
-                    }
-                }
-
-                if (isPowerOf2(elemSize)) {
-                    uint32_t sizeShift = log2_32(elemSize);
-                    ss << "\tsll " << V1 << ", " << regIndex << ", " << sizeShift << '\n';
-                }
-                else {
-                    ss << "\taddiu " << AT << ", " << ZERO << ", " << elemSize << '\n';
-                    ss << "\tmul " << V1 << ", " << regIndex << ", " << AT << '\n';
-                }
-
-                ss << "\taddu " << regAlloc[I] << ", " << regAlloc[I] << ", " << V1
-                   << '\n';
-
-            next_index:
-                if (++indexIt == GEPInst->idx_end())
-                    break;
-
-                if (auto arrayType = dyn_cast<ArrayType>(elemType)) {
-                    elemType = arrayType->getArrayElementType();
+        DataLayout dataLayout(I->getModule());
+        auto       reg = regAlloc[I];
+        genAddress(I, reg, GEPInst->getPointerOperand());
+
+        // Constant indices and struct fields are summed up into one offset, the
+        // other indices are scaled and added
+        int64_t offset = 0;
+        auto    type   = GEPInst->getSourceElementType();
+        for (auto indexIt = GEPInst->idx_begin(); indexIt != GEPInst->idx_end();
+             indexIt++) {
+            auto indexValue = indexIt->get();
+
+            if (indexIt != GEPInst->idx_begin()) {
+                if (auto structType = dyn_cast<StructType>(type)) {
+                    auto field  = cast<ConstantInt>(indexValue)->getZExtValue();
+                    auto layout = dataLayout.getStructLayout(structType);
+                    offset += layout->getElementOffset(field);
+                    type = structType->getElementType(field);
+                    continue;
                 }
-                else {
-                    ss << "\t # unsupported type in GEP\n";
-                    elemType->print(ss);
-                    ss << '\n';
+                if (!isa<ArrayType>(type)) {
+                    emitComment("\t # unsupported type in GEP");
                     break;
                 }
+                type = type->getArrayElementType();
             }
-        }
-
-        if (regAlloc[I] == V0)
-            ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
-    }
-    else if (auto loadInst = dyn_cast<LoadInst>(I)) {
-        auto  address = loadInst->getOperand(0);
-        APInt offset(32, 0, true);
-
-        if (auto GEP = dyn_cast_or_null<GEPOperator>(dyn_cast<ConstantExpr>(address))) {
-            auto       GEPAddress = GEP->getPointerOperand();
-            DataLayout dataLayout(I->getFunction()->getParent());
 
-            if (globalAlloc.find(GEPAddress) == globalAlloc.end())
-                ss << "\t #wrong address operand\n";
-
-            if (!GEP->accumulateConstantOffset(dataLayout, offset))
-                ss << "\t #GEP not constant\n";
-
-            address = GEPAddress;
-        }
+            uint32_t elemSize = dataLayout.getTypeAllocSize(type);
+            if (auto constIdx = dyn_cast<ConstantInt>(indexValue)) {
+                offset += constIdx->getSExtValue() * elemSize;
+                continue;
+            }
 
-        // Is load from global variable?
-        if (globalAlloc.find(address) != globalAlloc.end()) {
-            ss << "\tlw " << regAlloc[I] << ", "
-               << offset.getSExtValue() + globalAlloc[address] << '(' << GP << ")\n";
+            auto regIndex = regAlloc[indexValue];
+            if (regIndex == V0) {
+                regIndex = V1;
+                genReload(regIndex, indexValue);
+            }
 
-            if (regAlloc[I] == V0)
-                ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
+            genMultiply(V1, regIndex, elemSize, !schedule);
+            emit(MipsOp::ADDU, reg, reg, V1);
         }
-        // Is load from address in register?
-        else if (regAlloc[address]) {
-            if (regAlloc[address] == V0)
-                ss << "\tlw " << V0 << ", " << stackAlloc[address] << '(' << FP << ")\n";
 
-            ss << "\tlw " << regAlloc[I] << ", 0(" << regAlloc[address] << ")\n";
+        if (offset)
+            emitImm(MipsOp::ADDIU, reg, reg, offset);
 
-            if (regAlloc[I] == V0)
-                ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
-        }
-        // Load from stack address
-        else {
-            if (stackAlloc.find(address) == stackAlloc.end())
-                ss << "\t# load address invalid\n";
+        if (reg == V0)
+            emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
+    }
+    else if (auto loadInst = dyn_cast<LoadInst>(I)) {
+        auto address = genMemOperand(I, loadInst->getPointerOperand(), V0);
+        emitMem(MipsOp::LW, regAlloc[I], address);
 
-            // Load destination spilled, delay load
-            if (regAlloc[I] == V0) {
-                stackAlloc[I] = stackAlloc[address];
-            }
-            else {
-                ss << "\tlw " << regAlloc[I] << ", " << stackAlloc[address] << '(' << FP
-                   << ")\n";
-            }
-        }
+        if (regAlloc[I] == V0)
+            emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
     }
     else if (auto storeInst = dyn_cast<StoreInst>(I)) {
-        auto  value   = storeInst->getOperand(0);
-        auto  address = storeInst->getOperand(1);
-        APInt offset(32, 0, true);
-
-        if (auto GEP = dyn_cast_or_null<GEPOperator>(dyn_cast<ConstantExpr>(address))) {
-            auto       GEPAddress = GEP->getPointerOperand();
-            DataLayout dataLayout(I->getFunction()->getParent());
-
-            if (globalAlloc.find(GEPAddress) == globalAlloc.end())
-                ss << "\t #wrong address operand\n";
-
-            if (!GEP->accumulateConstantOffset(dataLayout, offset))
-                ss << "\t #GEP not constant\n";
-
-            address = GEPAddress;
-        }
+        auto value   = storeInst->getValueOperand();
+        auto address = genMemOperand(I, storeInst->getPointerOperand(), V1);
 
         if (auto constant = dyn_cast<ConstantInt>(value)) {
-            ss << "\taddi " << V0 << ", " << ZERO << ", " << constant->getSExtValue()
-               << '\n';
-            ss << "\tsw " << V0 << ", ";
+            emitImm(MipsOp::ADDI, V0, ZERO, constant->getSExtValue());
+            emitMem(MipsOp::SW, V0, address);
         }
         else {
             if (regAlloc[value] == V0)
-                ss << "\tlw " << V0 << ", " << stackAlloc[value] << '(' << FP << ")\n";
-
-            ss << "\tsw " << regAlloc[value] << ", ";
-        }
+                genReload(V0, value);
 
-        if (globalAlloc.find(address) != globalAlloc.end())
-            ss << offset.getSExtValue() + globalAlloc[address] << '(' << GP << ")\n";
-        else if (!regAlloc[address])
-            ss << stackAlloc[address] << '(' << FP << ")\n";
-        else {
-            auto regAddr = regAlloc[address];
-            if (regAddr == V0) {
-                ss << "\tlw " << V1 << ", " << stackAlloc[address] << '(' << FP << ")\n";
-                regAddr = V1;
-            }
-
-            ss << "0(" << regAddr << ")\n";
+            emitMem(MipsOp::SW, regAlloc[value], address);
         }
     }
     else if (auto binaryOpInst = dyn_cast<BinaryOperator>(I)) {
@@ -425,7 +925,7 @@ void MipsAssemblyGenPass::genInstructionAsm(const Instruction *I)
         auto constant  = constant1 ? constant1 : constant2;
 
         if (constant1 && constant2) {
-            ss << "\t # unsupported binary instruction with two constant operand\n";
+            emitComment("\t # unsupported binary instruction with two constant operand");
         }
         else {
             auto reg1 = regAlloc[op1];
@@ -433,135 +933,138 @@ void MipsAssemblyGenPass::genInstructionAsm(const Instruction *I)
             auto reg  = constant1 ? reg2 : reg1;
 
             if (!constant1 && reg1 == V0)
-                ss << "\tlw " << reg1 << ", " << stackAlloc[op1] << '(' << FP << ")\n";
+                genReload(reg1, op1);
             if (!constant2 && reg2 == V1)
-                ss << "\tlw " << reg2 << ", " << stackAlloc[op2] << '(' << FP << ")\n";
+                genReload(reg2, op2);
 
             switch (binaryOp) {
             case Instruction::Add:
                 if (constant) {
-                    ss << "\taddiu " << regAlloc[I] << ", " << reg << ", "
-                       << constant->getSExtValue() << '\n';
+                    emitImm(MipsOp::ADDIU, regAlloc[I], reg, constant->getSExtValue());
                 }
                 else {
-                    ss << "\taddu " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emit(MipsOp::ADDU, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::Sub:
                 if (constant1) {
                     if (constant1->getValue().isNullValue()) {
-                        ss << "\tsubu " << regAlloc[I] << ", " << ZERO << ", " << reg2
-                           << '\n';
+                        emit(MipsOp::SUBU, regAlloc[I], ZERO, reg2);
                     }
                     else {
-                        ss << "\taddiu " << V0 << ", " << ZERO << ", -"
-                           << constant2->getSExtValue() << '\n';
-                        ss << "\tsubu " << regAlloc[I] << ", " << V0 << ", " << reg2
-                           << '\n';
+                        emitImm(MipsOp::ADDIU, V0, ZERO, constant1->getSExtValue());
+                        emit(MipsOp::SUBU, regAlloc[I], V0, reg2);
                     }
                 }
                 else if (constant2) {
-                    ss << "\taddu " << regAlloc[I] << ", " << reg1 << ", -"
-                       << constant2->getSExtValue() << '\n';
+                    emitImm(MipsOp::ADDIU, regAlloc[I], reg1, -constant2->getSExtValue());
                 }
                 else {
-                    ss << "\tsubu " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emit(MipsOp::SUBU, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::Mul:
+                if (constant)
+                    genMultiply(regAlloc[I], reg, constant->getSExtValue(),
+                                !schedule && isUsedSoon(I));
+                else
+                    emit(MipsOp::MUL, regAlloc[I], reg1, reg2);
+                break;
+            case Instruction::Shl:
                 if (constant1) {
                     reg1 = V0;
-                    ss << "\taddiu " << reg1 << ", " << ZERO << ", "
-                       << constant1->getSExtValue() << '\n';
+                    emitImm(MipsOp::ADDIU, reg1, ZERO, constant1->getSExtValue());
+                    emit(MipsOp::SLLV, regAlloc[I], reg1, reg2);
                 }
                 else if (constant2) {
-                    reg2 = V1;
-                    ss << "\taddiu " << reg2 << ", " << ZERO << ", "
-                       << constant2->getSExtValue() << '\n';
-                }
-
-                ss << "\tmul " << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
-                break;
-            case Instruction::Shl:
-                if (constant1) {
-                    reg1 = V0;
-                    ss << "\taddiu " << reg1 << ", " << ZERO << ", "
-                       << constant1->getSExtValue() << '\n';
-                    ss << "\tsllv " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
-                }
-                else if (constant2) {
-                    ss << "\tsll " << regAlloc[I] << ", " << reg1 << ", "
-                       << (constant2->getZExtValue() & 31) << '\n';
+                    emitImm(MipsOp::SLL, regAlloc[I], reg1,
+                            constant2->getZExtValue() & 31);
                 }
                 else {
-                    ss << "\tsllv " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emit(MipsOp::SLLV, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::LShr:
                 if (constant1) {
                     reg1 = V0;
-                    ss << "\taddiu " << reg1 << ", " << ZERO << ", "
-                       << constant1->getSExtValue() << '\n';
-                    ss << "\tsrlv " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emitImm(MipsOp::ADDIU, reg1, ZERO, constant1->getSExtValue());
+                    emit(MipsOp::SRLV, regAlloc[I], reg1, reg2);
                 }
                 else if (constant2) {
-                    ss << "\tsrl " << regAlloc[I] << ", " << reg1 << ", "
-                       << (constant2->getZExtValue() & 31) << '\n';
+                    emitImm(MipsOp::SRL, regAlloc[I], reg1,
+                            constant2->getZExtValue() & 31);
                 }
                 else {
-                    ss << "\tsrlv " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emit(MipsOp::SRLV, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::AShr:
                 if (constant1) {
                     reg1 = V0;
-                    ss << "\taddiu " << reg1 << ", " << ZERO << ", "
-                       << constant1->getSExtValue() << '\n';
-                    ss << "\tsrav " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emitImm(MipsOp::ADDIU, reg1, ZERO, constant1->getSExtValue());
+                    emit(MipsOp::SRAV, regAlloc[I], reg1, reg2);
                 }
                 else if (constant2) {
-                    ss << "\tsra " << regAlloc[I] << ", " << reg1 << ", "
-                       << (constant2->getZExtValue() & 31) << '\n';
+                    emitImm(MipsOp::SRA, regAlloc[I], reg1,
+                            constant2->getZExtValue() & 31);
                 }
                 else {
-                    ss << "\tsrav " << regAlloc[I] << ", " << reg1 << ", " << reg2
-                       << '\n';
+                    emit(MipsOp::SRAV, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::And:
                 if (constant) {
-                    ss << "\tandi " << regAlloc[I] << ", " << reg << ", "
-                       << constant->getSExtValue() << '\n';
+                    emitImm(MipsOp::ANDI, regAlloc[I], reg, constant->getSExtValue());
                 }
                 else {
-                    ss << "\tand " << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
+                    emit(MipsOp::AND, regAlloc[I], reg1, reg2);
                 }
                 break;
             case Instruction::Or:
                 if (constant) {
-                    ss << "\tori " << regAlloc[I] << ", " << reg << ", "
-                       << constant->getSExtValue() << '\n';
+                    emitImm(MipsOp::ORI, regAlloc[I], reg, constant->getSExtValue());
                 }
                 else {
-                    ss << "\tor " << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
+                    emit(MipsOp::OR, regAlloc[I], reg1, reg2);
+                }
+                break;
+            case Instruction::Xor:
+                if (constant) {
+                    // Booleans are kept as 0 or 1, and true flips the low bit only
+                    int64_t imm = constant->getBitWidth() == 1 ? constant->getZExtValue()
+                                                               : constant->getSExtValue();
+                    if (imm == -1)
+                        emit(MipsOp::NOR, regAlloc[I], reg, ZERO);
+                    else
+                        emitImm(MipsOp::XORI, regAlloc[I], reg, imm);
+                }
+                else {
+                    emit(MipsOp::XOR, regAlloc[I], reg1, reg2);
+                }
+                break;
+            case Instruction::SDiv:
+            case Instruction::UDiv:
+            case Instruction::SRem:
+            case Instruction::URem:
+                if (constant1) {
+                    reg1 = V0;
+                    emitImm(MipsOp::LI, reg1, constant1->getSExtValue());
                 }
+
+                genDivision(binaryOpInst, reg1, reg2, constant2);
                 break;
 
             default:
-                ss << "\t # unsupported binary instruction\n";
+                emitComment("\t # unsupported binary instruction");
             }
 
             if (regAlloc[I] == V0)
-                ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
+                emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
         }
     }
+    else if (isFusedCompare(I)) {
+        // Generated with the branch using it
+    }
     else if (auto icmpInst = dyn_cast<ICmpInst>(I)) {
         auto op1 = icmpInst->getOperand(0);
         auto op2 = icmpInst->getOperand(1);
@@ -570,8 +1073,8 @@ void MipsAssemblyGenPass::genInstructionAsm(const Instruction *I)
         auto constant2 = dyn_cast<ConstantInt>(op2);
 
         if (constant1 && constant2) {
-            ss << "\t # unsupported integer compare instruction with two constant "
-                  "operand\n";
+            emitComment("\t # unsupported integer compare instruction with two constant "
+                        "operand");
         }
         else {
             auto reg1 = regAlloc[op1];
@@ -579,419 +1082,911 @@ void MipsAssemblyGenPass::genInstructionAsm(const Instruction *I)
             auto reg  = constant1 ? reg2 : reg1;
 
             if (!constant1 && reg1 == V0)
-                ss << "\tlw " << reg1 << ", " << stackAlloc[op1] << '(' << FP << ")\n";
+                genReload(reg1, op1);
             if (!constant2 && reg2 == V1)
-                ss << "\tlw " << reg2 << ", " << stackAlloc[op2] << '(' << FP << ")\n";
+                genReload(reg2, op2);
 
             if (constant1) {
                 reg1 = V0;
-                ss << "\taddiu " << reg1 << ", " << ZERO << ", "
-                   << constant1->getSExtValue() << '\n';
+                emitImm(MipsOp::ADDIU, reg1, ZERO, constant1->getSExtValue());
             }
             else if (constant2) {
                 reg2 = V1;
-                ss << "\taddiu " << reg2 << ", " << ZERO << ", "
-                   << constant2->getSExtValue() << '\n';
+                emitImm(MipsOp::ADDIU, reg2, ZERO, constant2->getSExtValue());
             }
 
-            const char *relation;
+            MipsOp relation;
             switch (icmpInst->getPredicate()) {
             case ICmpInst::ICMP_SGT:
             case ICmpInst::ICMP_SGE:
             case ICmpInst::ICMP_SLT:
             case ICmpInst::ICMP_SLE:
-                relation = "\tslt ";
+                relation = MipsOp::SLT;
                 break;
             default:
-                relation = "\tsltu ";
+                relation = MipsOp::SLTU;
                 break;
             }
 
             switch (icmpInst->getPredicate()) {
             case ICmpInst::ICMP_EQ:
-                ss << "\tsub " << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
-                ss << "\tsltu " << regAlloc[I] << ", " << ZERO << ", " << regAlloc[I]
-                   << '\n';
-                ss << "\tnegu " << regAlloc[I] << ", " << regAlloc[I] << '\n';
-                ss << "\taddiu " << regAlloc[I] << ", " << regAlloc[I] << ", 1\n";
+                emit(MipsOp::XOR, regAlloc[I], reg1, reg2);
+                emitImm(MipsOp::SLTIU, regAlloc[I], regAlloc[I], 1);
                 break;
             case ICmpInst::ICMP_NE:
-                ss << "\tsub " << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
+                // The result may be extended and used as a number, so it must be 1
+                emit(MipsOp::XOR, regAlloc[I], reg1, reg2);
+                emit(MipsOp::SLTU, regAlloc[I], ZERO, regAlloc[I]);
                 break;
             case ICmpInst::ICMP_UGT:
             case ICmpInst::ICMP_SGT:
-                ss << relation << regAlloc[I] << ", " << reg2 << ", " << reg1 << '\n';
+                emit(relation, regAlloc[I], reg2, reg1);
                 break;
             case ICmpInst::ICMP_UGE:
             case ICmpInst::ICMP_SGE:
-                ss << relation << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
-                ss << "\tsltu " << regAlloc[I] << ", " << ZERO << ", " << regAlloc[I]
-                   << '\n';
-                ss << "\tnegu " << regAlloc[I] << ", " << regAlloc[I] << '\n';
-                ss << "\taddiu " << regAlloc[I] << ", " << regAlloc[I] << ", 1\n";
+                emit(relation, regAlloc[I], reg1, reg2);
+                emit(MipsOp::SLTU, regAlloc[I], ZERO, regAlloc[I]);
+                emit(MipsOp::NEGU, regAlloc[I], regAlloc[I]);
+                emitImm(MipsOp::ADDIU, regAlloc[I], regAlloc[I], 1);
                 break;
             case ICmpInst::ICMP_ULT:
             case ICmpInst::ICMP_SLT:
-                ss << relation << regAlloc[I] << ", " << reg1 << ", " << reg2 << '\n';
+                emit(relation, regAlloc[I], reg1, reg2);
                 break;
             case ICmpInst::ICMP_ULE:
             case ICmpInst::ICMP_SLE:
-                ss << relation << regAlloc[I] << ", " << reg2 << ", " << reg1 << '\n';
-                ss << "\tsltu " << regAlloc[I] << ", " << ZERO << ", " << regAlloc[I]
-                   << '\n';
-                ss << "\tnegu " << regAlloc[I] << ", " << regAlloc[I] << '\n';
-                ss << "\taddiu " << regAlloc[I] << ", " << regAlloc[I] << ", 1\n";
+                emit(relation, regAlloc[I], reg2, reg1);
+                emit(MipsOp::SLTU, regAlloc[I], ZERO, regAlloc[I]);
+                emit(MipsOp::NEGU, regAlloc[I], regAlloc[I]);
+                emitImm(MipsOp::ADDIU, regAlloc[I], regAlloc[I], 1);
                 break;
             default:
-                ss << "\t # unsupported integer compare instruction\n";
+                emitComment("\t # unsupported integer compare instruction");
             }
 
             if (regAlloc[I] == V0)
-                ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
+                emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
         }
     }
     else if (auto branchInst = dyn_cast<BranchInst>(I)) {
-        if (branchInst->isUnconditional()) {
-            genPhi(I->getParent(), nullptr);
+        auto BB = I->getParent();
+
+        if (branchInst->isUnconditional()
+            || branchInst->getSuccessor(0) == branchInst->getSuccessor(1)) {
+            genPhiCopies(BB, branchInst->getSuccessor(0));
             genJump(I, branchInst->getSuccessor(0));
         }
         else {
             auto condition = branchInst->getCondition();
+            auto hoistedBB = hoistablePhiEdge(branchInst);
 
             if (isa<ConstantInt>(condition)) {
-                ss << "\t # unsupported branch instruction with constant condition\n";
+                emitComment(
+                    "\t # unsupported branch instruction with constant condition");
             }
             else {
-                bool      condSaved = genPhi(I->getParent(), condition);
-                Mips32Reg condReg   = condSaved ? V0 : regAlloc[condition];
-
-                if (!condSaved && condReg == V0)
-                    ss << "\tlw " << V0 << ", " << stackAlloc[condition] << '(' << FP
-                       << ")\n";
-
-                if (branchInst->getSuccessor(0) == I->getParent()->getNextNode()) {
-                    ss << "\tbeq " << condReg << ", " << ZERO << ", ";
-                    genBBName(branchInst->getSuccessor(1));
-                    ss << '\n';
-                    genJump(I, branchInst->getSuccessor(0));
+                if (hoistedBB)
+                    genPhiCopies(BB, hoistedBB);
+
+                if (isFusedCompare(condition)) {
+                    genCompareBranch(branchInst, cast<ICmpInst>(condition), hoistedBB);
                 }
                 else {
-                    ss << "\tbne " << condReg << ", " << ZERO << ", ";
-                    genBBName(branchInst->getSuccessor(0));
-                    ss << '\n';
-                    genJump(I, branchInst->getSuccessor(1));
+                    Mips32Reg condReg = regAlloc[condition];
+                    if (condReg == V0)
+                        genReload(V0, condition);
+
+                    auto genBranch = [&](bool isInverse) {
+                        auto op = isInverse ? MipsOp::BEQ : MipsOp::BNE;
+                        return MipsInst::make(op, condReg, ZERO);
+                    };
+                    genCondBranch(branchInst, genBranch, hoistedBB);
                 }
             }
         }
     }
+    else if (auto switchInst = dyn_cast<SwitchInst>(I)) {
+        genSwitch(switchInst);
+    }
     else if (auto selectInst = dyn_cast<SelectInst>(I)) {
-        auto cond   = selectInst->getCondition();
-        auto tValue = selectInst->getTrueValue();
-        auto fValue = selectInst->getFalseValue();
-
-        if (auto tConstant = dyn_cast<ConstantInt>(tValue))
-            ss << "\taddiu " << regAlloc[I] << ", " << ZERO << ", "
-               << tConstant->getZExtValue() << '\n';
-        else if (regAlloc[tValue] == V0)
-            ss << "\tlw " << regAlloc[I] << ", " << stackAlloc[tValue] << '(' << FP
-               << ")\n";
-        else
-            ss << "\tmove " << regAlloc[I] << ", " << regAlloc[tValue] << '\n';
-
-        auto regCond = regAlloc[cond];
-        if (regCond == V0) {
-            regCond = AT;
-            ss << "\tlw " << regCond << ", " << stackAlloc[cond] << '(' << FP << ")\n";
-        }
-
-        // Jump to false branch if condition is zero
-        ss << "\tbeq " << regCond << ", " << ZERO << ", ";
-        genBBName(I->getParent());
-        ss << '_' << reinterpret_cast<uint64_t>(fValue) << "_\n";
-        // Jump to true branch
-        ss << "\tj ";
-        genBBName(I->getParent());
-        ss << '_' << reinterpret_cast<uint64_t>(tValue) << "_\n";
-
-        // False branch
-        genBBName(I->getParent());
-        ss << '_' << reinterpret_cast<uint64_t>(fValue) << "_:\n";
-
-        if (auto fConstant = dyn_cast<ConstantInt>(fValue))
-            ss << "\taddiu " << regAlloc[I] << ", " << ZERO << ", "
-               << fConstant->getZExtValue() << '\n';
-        else if (regAlloc[fValue] == V0)
-            ss << "\tlw " << regAlloc[I] << ", " << stackAlloc[fValue] << '(' << FP
-               << ")\n";
-        else
-            ss << "\tmove " << regAlloc[I] << ", " << regAlloc[fValue] << '\n';
+        // Without branches, as false ^ ((true ^ false) & -condition)
+        auto tReg    = genOperand(I, selectInst->getTrueValue(), V0);
+        auto fReg    = genOperand(I, selectInst->getFalseValue(), V1);
+        auto condReg = genOperand(I, selectInst->getCondition(), AT);
 
-        // True/merge branch
-        genBBName(I->getParent());
-        ss << '_' << reinterpret_cast<uint64_t>(tValue) << "_:\n";
+        emit(MipsOp::NEGU, AT, condReg);
+        emit(MipsOp::XOR, V0, tReg, fReg);
+        emit(MipsOp::AND, V0, V0, AT);
+        emit(MipsOp::XOR, regAlloc[I], fReg, V0);
 
         if (regAlloc[I] == V0)
-            ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
+            emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
     }
     else if (auto returnInst = dyn_cast<ReturnInst>(I)) {
         auto retValue = returnInst->getReturnValue();
         if (retValue) {
             if (auto constRV = dyn_cast<ConstantInt>(retValue)) {
-                ss << "\taddi " << V0 << ", " << ZERO << ", " << constRV->getSExtValue()
-                   << '\n';
+                emitImm(MipsOp::ADDI, V0, ZERO, constRV->getSExtValue());
             }
             else if (regAlloc[retValue] == V0) {
-                ss << "\tlw " << V0 << ", " << stackAlloc[retValue] << '(' << FP << ")\n";
+                genReload(V0, retValue);
             }
             else {
-                ss << "\tmove " << V0 << ", " << regAlloc[retValue] << '\n';
+                emit(MipsOp::MOVE, V0, regAlloc[retValue]);
             }
         }
         genJump(I, nullptr);
     }
+    else if (auto intrinsicInst = dyn_cast<IntrinsicInst>(I)) {
+        genIntrinsic(intrinsicInst);
+    }
     else if (auto callInst = dyn_cast<CallInst>(I)) {
-        if (callInst->arg_size() > 4) {
-            ss << "\t # unsupported function call with more than 4 arguments\n";
-        }
-        else {
-            int   callerArgcount = 0;
-            int   tempRegCount   = 0;
-            auto &BBRegs         = BBToRegs[I->getParent()];
-
-            // Save temp registers
-            for (auto tempReg : TempReg) {
-                if (!callInst->getCalledFunction()->getReturnType()->isVoidTy()
-                    && tempReg == regAlloc[I])
-                    continue;
-
-                if (BBRegs.find(tempReg) != BBRegs.end()) {
-                    ss << "\tsw " << tempReg << ", -" << ++tempRegCount * 4 << '(' << SP
-                       << ")\n";
-                }
-            }
-
-            // Save argument registers
-            for (int i = 0; i < callInst->getCaller()->arg_size(); i++) {
-                if (BBRegs.find(Mips32Reg(A0 + i)) != BBRegs.end()) {
-                    ss << "\tsw " << Mips32Reg(A0 + i) << ", -"
-                       << (++callerArgcount + tempRegCount) * 4 << "(" << SP << ")\n";
-                }
-            }
-
-            // Adjust stack
-            if (callerArgcount + tempRegCount > 0)
-                ss << "\taddiu " << SP << ", " << SP << ", -"
-                   << (callerArgcount + tempRegCount) * 4 << '\n';
-
-            // Set function arguments
-            for (int i = 0; i < callInst->arg_size(); i++) {
-                auto argOp = callInst->getArgOperand(i);
-                if (auto constArg = dyn_cast<ConstantInt>(argOp)) {
-                    ss << "\taddiu " << Mips32Reg(A0 + i) << ", " << ZERO << ", "
-                       << constArg->getSExtValue() << '\n';
-                }
-                else if (regAlloc[argOp] == V0) {
-                    ss << "\tlw " << Mips32Reg(A0 + i) << ", " << stackAlloc[argOp] << '('
-                       << FP << ")\n";
-                }
-                else {
-                    ss << "\tmove " << Mips32Reg(A0 + i) << ", " << regAlloc[argOp]
-                       << '\n';
-                }
-            }
+        auto &saveRegs = callSaveRegs[I];
+
+        // Save registers holding values live across the call
+        for (size_t i = 0; i < saveRegs.size(); i++)
+            emitMem(MipsOp::SW, saveRegs[i], outgoingSize + 4 * i, SP);
+
+        // Store arguments after the fourth, before $a0-$a3 are overwritten
+        for (unsigned i = 4; i < callInst->arg_size(); i++) {
+            auto      argOp = callInst->getArgOperand(i);
+            Mips32Reg reg   = V1;
+
+            if (auto constArg = dyn_cast<ConstantInt>(argOp))
+                emitImm(MipsOp::ADDIU, V1, ZERO, constArg->getSExtValue());
+            else if (regAlloc[argOp] == V0)
+                genReload(V1, argOp);
+            else if (!regAlloc[argOp])
+                genAddress(I, V1, argOp);
+            else
+                reg = regAlloc[argOp];
 
-            ss << "\tjal ";
-            genFName(callInst->getCalledFunction());
-            ss << '\n';
+            emitMem(MipsOp::SW, reg, 4 * i, SP);
+        }
 
-            // Restore stack
-            if (callerArgcount + tempRegCount > 0)
-                ss << "\taddiu " << SP << ", " << SP << ", "
-                   << (callerArgcount + tempRegCount) * 4 << '\n';
+        // Set function arguments
+        genArgumentMoves(callInst);
 
-            // Restore temp registers
-            tempRegCount = 0;
-            for (auto tempReg : TempReg) {
-                if (!callInst->getCalledFunction()->getReturnType()->isVoidTy()
-                    && tempReg == regAlloc[I])
-                    continue;
+        emitBranch(MipsOp::JAL, genFName(callInst->getCalledFunction()));
 
-                if (BBRegs.find(tempReg) != BBRegs.end()) {
-                    ss << "\tlw " << tempReg << ", -" << ++tempRegCount * 4 << '(' << SP
-                       << ")\n";
-                }
-            }
+        // Restore saved registers
+        for (size_t i = 0; i < saveRegs.size(); i++)
+            emitMem(MipsOp::LW, saveRegs[i], outgoingSize + 4 * i, SP);
 
-            // Restore argument registers
-            callerArgcount = 0;
-            for (int i = 0; i < callInst->getCaller()->arg_size(); i++) {
-                if (BBRegs.find(Mips32Reg(A0 + i)) != BBRegs.end()) {
-                    ss << "\tlw " << Mips32Reg(A0 + i) << ", -"
-                       << (++callerArgcount + tempRegCount) * 4 << "(" << SP << ")\n";
-                }
-            }
-
-            // Save function return value
-            if (!callInst->getCalledFunction()->getReturnType()->isVoidTy()) {
-                if (regAlloc[I] == V0)
-                    ss << "\tsw " << V0 << ", " << stackAlloc[I] << '(' << FP << ")\n";
-                else
-                    ss << "\tmove " << regAlloc[I] << ", " << V0 << '\n';
-            }
+        // Save function return value
+        if (!callInst->getCalledFunction()->getReturnType()->isVoidTy()) {
+            if (regAlloc[I] == V0)
+                emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
+            else
+                emit(MipsOp::MOVE, regAlloc[I], V0);
         }
     }
-    else if (isa<SExtInst>(I) || isa<ZExtInst>(I)) {
+    else if (isRegisterCopy(I)) {
         regAlloc[I]   = regAlloc[I->getOperand(0)];
         stackAlloc[I] = stackAlloc[I->getOperand(0)];
     }
     else {
-        ss << "\t # unsupported instruction\n";
+        emitComment("\t # unsupported instruction");
     }
 }
 
+// Lays out the bytes of a constant at offset into the bytes of object, recording
+// the words that hold the address of a global, plus an offset, in its addresses
+void layoutConstant(const Constant *  C,
+                    uint64_t          offset,
+                    const DataLayout &dataLayout,
+                    MipsData &        object)
+{
+    auto &bytes = object.bytes;
+
+    auto layoutInteger = [&](APInt value) {
+        value = value.zext(alignTo(value.getBitWidth(), 8));
+        for (unsigned i = 0; i < value.getBitWidth() / 8; i++)
+            bytes[offset + i] = value.extractBitsAsZExtValue(8, 8 * i);
+    };
+
+    if (C->isNullValue() || isa<UndefValue>(C))
+        return;
+
+    if (auto constInt = dyn_cast<ConstantInt>(C))
+        layoutInteger(constInt->getValue());
+    else if (auto constFP = dyn_cast<ConstantFP>(C))
+        layoutInteger(constFP->getValueAPF().bitcastToAPInt());
+    else if (auto sequential = dyn_cast<ConstantDataSequential>(C)) {
+        uint64_t elemSize = sequential->getElementByteSize();
+        for (unsigned i = 0; i < sequential->getNumElements(); i++)
+            layoutConstant(sequential->getElementAsConstant(i), offset + i * elemSize,
+                           dataLayout, object);
+    }
+    else if (auto constStruct = dyn_cast<ConstantStruct>(C)) {
+        auto structLayout = dataLayout.getStructLayout(constStruct->getType());
+        for (unsigned i = 0; i < constStruct->getNumOperands(); i++)
+            layoutConstant(constStruct->getOperand(i),
+                           offset + structLayout->getElementOffset(i), dataLayout,
+                           object);
+    }
+    else if (isa<ConstantArray>(C) || isa<ConstantVector>(C)) {
+        uint64_t elemSize = dataLayout.getTypeAllocSize(C->getOperand(0)->getType());
+        for (unsigned i = 0; i < C->getNumOperands(); i++)
+            layoutConstant(C->getAggregateElement(i), offset + i * elemSize, dataLayout,
+                           object);
+    }
+    else if (auto global = dyn_cast<GlobalValue>(C))
+        object.addresses[offset] = {globalLabel(global), 0};
+    else if (auto constExpr = dyn_cast<ConstantExpr>(C)) {
+        auto op = constExpr->getOperand(0);
+        if (constExpr->getOpcode() == Instruction::IntToPtr && isa<ConstantInt>(op))
+            layoutInteger(cast<ConstantInt>(op)->getValue().zextOrTrunc(
+                dataLayout.getPointerSizeInBits()));
+        else if (constExpr->getOpcode() == Instruction::BitCast)
+            layoutConstant(op, offset, dataLayout, object);
+        else {
+            APInt constOffset(dataLayout.getPointerSizeInBits(), 0);
+            auto  base = dyn_cast<GlobalValue>(
+                C->stripAndAccumulateConstantOffsets(dataLayout, constOffset, false));
+            if (!base)
+                report_fatal_error("MIPS: unsupported global initializer");
+            object.addresses[offset] = {globalLabel(base), constOffset.getSExtValue()};
+        }
+    }
+    else
+        report_fatal_error("MIPS: unsupported global initializer");
+}
+
+// Globals of at most this size are small data, addressed from $gp in one
+// instruction, as long as they fit in its reach. Others are addressed through
+// their label. As the GNU linker sets it, $gp points GpBias bytes past the start
+// of .sdata, so that its signed 16-bit offsets reach 64K of small data.
+const uint64_t SmallDataSize = 4096;
+const uint64_t GpBias        = 0x7ff0;
+const uint64_t GpReach       = GpBias + 0x8000;
+
 void MipsAssemblyGenPass::globalAllocate(const Module *M)
 {
     globalAlloc.clear();
+    globalData.clear();
     globalTop = 0;
 
     DataLayout dataLayout(M);
 
+    // Constants, of any size, go to .rodata. Other small data goes to .sdata, or
+    // .sbss when zero, at increasing offsets from $gp; other large globals go to
+    // .data, or .bss when zero.
+    auto largeSection = [](const GlobalVariable *global) {
+        return global->isConstant()                    ? MipsData::ReadOnlyData
+               : global->getInitializer()->isNullValue() ? MipsData::Bss
+                                                         : MipsData::Data;
+    };
+    auto alignment = [&](const GlobalVariable *global) {
+        return global->getAlign()
+            .getValueOr(dataLayout.getABITypeAlign(global->getValueType()))
+            .value();
+    };
+
+    std::vector<const GlobalVariable *> sectionGlobals[MipsData::SectionCount];
     for (const auto &global : M->getGlobalList()) {
         // Skip exteral variable
         if (global.isDeclaration())
             continue;
 
-        uint32_t size  = dataLayout.getTypeAllocSize(global.getType()->getElementType());
-        uint32_t align = global.getAlignment();
+        auto section = largeSection(&global);
+        bool isSmall =
+            dataLayout.getTypeAllocSize(global.getValueType()) <= SmallDataSize;
+        if (isSmall && section != MipsData::ReadOnlyData)
+            section = section == MipsData::Bss ? MipsData::SmallBss : MipsData::SmallData;
+        sectionGlobals[section].push_back(&global);
+    }
 
-        // Make global allocation aligned
-        globalTop            = (globalTop + align - 1) & ~(align - 1);
-        globalAlloc[&global] = globalTop;
-        globalTop += size;
+    // A section is as aligned as its most aligned global, so the offsets of .sbss,
+    // placed after .sdata, are those of its globals once linked. Small data out
+    // of the reach of $gp moves to the large sections, which come after.
+    for (int section = MipsData::SmallData; section <= MipsData::SmallBss; section++) {
+        uint64_t sectionAlign = 1;
+        for (auto global : sectionGlobals[section])
+            sectionAlign = std::max(sectionAlign, alignment(global));
+        globalTop = alignTo(globalTop, sectionAlign);
+
+        std::vector<const GlobalVariable *> smallGlobals;
+        for (auto global : sectionGlobals[section]) {
+            uint64_t size   = dataLayout.getTypeAllocSize(global->getValueType());
+            uint64_t offset = alignTo(globalTop, alignment(global));
+            if (offset + size > GpReach) {
+                sectionGlobals[largeSection(global)].push_back(global);
+                continue;
+            }
+            globalAlloc[global] = int32_t(offset - GpBias);
+            globalTop           = offset + size;
+            smallGlobals.push_back(global);
+        }
+        sectionGlobals[section] = smallGlobals;
+    }
 
-        ss << "# " << globalAlloc[&global] << ", size " << size << ", align " << align
-           << " : " << global.getName() << '\n';
+    for (int section = 0; section < MipsData::SectionCount; section++) {
+        for (auto global : sectionGlobals[section]) {
+            MipsData object;
+            object.section  = MipsData::Section(section);
+            object.label    = globalLabel(global);
+            object.isGlobal = !global->hasLocalLinkage();
+            object.align    = alignment(global);
+            object.bytes.assign(dataLayout.getTypeAllocSize(global->getValueType()), 0);
+            layoutConstant(global->getInitializer(), 0, dataLayout, object);
+
+            if (options.comments) {
+                raw_string_ostream os(object.comment);
+                if (globalAlloc.count(global))
+                    os << globalAlloc[global] << ", ";
+                os << "size " << object.bytes.size() << ", align " << object.align
+                   << " : " << global->getName();
+            }
+            globalData.push_back(std::move(object));
+        }
     }
 }
 
-void MipsAssemblyGenPass::stackAllocate(const Function *F)
+// Blocks where the object of an alloca may hold a value: those accessing it, and
+// those on a path between two accesses. Every block if its address escapes.
+BitVector allocaLiveBlocks(const AllocaInst *allocInst,
+                           const std::vector<const BasicBlock *> &blocks,
+                           DenseMap<const BasicBlock *, unsigned> &BBIndex)
+{
+    BitVector access(blocks.size());
+
+    std::vector<const Value *> worklist = {allocInst};
+    while (!worklist.empty()) {
+        auto address = worklist.back();
+        worklist.pop_back();
+
+        for (auto user : address->users()) {
+            auto storeInst = dyn_cast<StoreInst>(user);
+            bool isAccess  = isa<LoadInst>(user)
+                            || storeInst && storeInst->getPointerOperand() == address;
+            if (isAccess)
+                access.set(BBIndex[cast<Instruction>(user)->getParent()]);
+            else if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user))
+                worklist.push_back(user);
+            else if (!isa<CallInst>(user) || isCall(cast<Instruction>(user)))
+                return BitVector(blocks.size(), true);
+        }
+    }
+
+    auto reach = [&](bool forward) {
+        BitVector             seen = access;
+        std::vector<unsigned> worklist;
+        for (unsigned b : access.set_bits())
+            worklist.push_back(b);
+        while (!worklist.empty()) {
+            auto BB = blocks[worklist.back()];
+            worklist.pop_back();
+
+            auto visit = [&](const BasicBlock *nextBB) {
+                unsigned b = BBIndex[nextBB];
+                if (!seen.test(b)) {
+                    seen.set(b);
+                    worklist.push_back(b);
+                }
+            };
+            if (forward)
+                std::for_each(succ_begin(BB), succ_end(BB), visit);
+            else
+                std::for_each(pred_begin(BB), pred_end(BB), visit);
+        }
+        return seen;
+    };
+
+    BitVector live = reach(true);
+    live &= reach(false);
+    return live;
+}
+
+// Allocas which are never live in the same block share their stack storage
+void MipsFunctionAsmGen::stackAllocate(const Function *F)
 {
     stackAlloc.clear();
     stackTop = 0;
 
     DataLayout dataLayout(F->getParent());
 
+    std::vector<const BasicBlock *> blocks;
+    for (const auto &BB : F->getBasicBlockList())
+        blocks.push_back(&BB);
+
+    struct StackSlot
+    {
+        uint32_t  offset, size;
+        BitVector blocks;  // blocks where an object in the slot is live
+    };
+    std::vector<StackSlot> slots;
+
     for (const_inst_iterator It = inst_begin(F), E = inst_end(F); It != E; It++) {
         if (auto allocInst = dyn_cast<AllocaInst>(&*It)) {
-            uint32_t size  = dataLayout.getTypeAllocSize(allocInst->getAllocatedType());
-            uint32_t align = allocInst->getAlignment();
+            uint32_t  size  = dataLayout.getTypeAllocSize(allocInst->getAllocatedType());
+            uint32_t  align = allocInst->getAlignment();
+            BitVector live  = allocaLiveBlocks(allocInst, blocks, BBIndex);
+
+            auto fits = [&](const StackSlot &slot) {
+                return slot.size >= size && slot.offset % align == 0
+                       && !slot.blocks.anyCommon(live);
+            };
+            auto slot = std::find_if(slots.begin(), slots.end(), fits);
+            if (slot == slots.end()) {
+                // Make stack allocation aligned
+                stackTop = (stackTop + align - 1) & ~(align - 1);
+                slots.push_back({stackTop, size, BitVector(blocks.size())});
+                stackTop += size;
+                slot = slots.end() - 1;
+            }
 
-            // Make stack allocation aligned
-            stackTop              = (stackTop + align - 1) & ~(align - 1);
-            stackAlloc[allocInst] = stackTop;
-            stackTop += size;
+            slot->blocks |= live;
+            stackAlloc[allocInst] = slot->offset;
 
-            ss << "# " << stackAlloc[allocInst] << ", size " << size << ", align "
-               << align << " : " << allocInst->getName() << '\n';
+            if (comments) {
+                std::string        text;
+                raw_string_ostream os(text);
+                os << "# " << stackAlloc[allocInst] << ", size " << size << ", align "
+                   << align << " : " << allocInst->getName();
+                emitComment(os.str());
+            }
         }
     }
 }
 
-void MipsAssemblyGenPass::registerAllocate(const Function *F)
+void MipsFunctionAsmGen::registerAllocate(const Function *F)
 {
-    BBToRegs.clear();
-    int maxRegUseCount = 0;
-    int regSpillCount  = 0;
+    std::vector<LiveInterval>                           intervals;
+    DenseMap<const Value *, std::vector<const Value *>> coalesced;
+    numberInstructions(F);
+    buildLiveIntervals(F, intervals);
+    coalescePhis(intervals, coalesced);
+
+    calls.clear();
+    callPositions.clear();
+    for (const_inst_iterator It = inst_begin(F), E = inst_end(F); It != E; It++) {
+        if (isCall(&*It)) {
+            calls.push_back(&*It);
+            callPositions.push_back(instIndex[&*It]);
+        }
+    }
 
-    for (const auto &BB : F->getBasicBlockList()) {
-        int regUseCount = 0;
+    auto byStart = [](const LiveInterval &a, const LiveInterval &b) {
+        return a.start < b.start;
+    };
+    auto byEnd   = [](const LiveInterval *a, const LiveInterval *b) {
+        return a->end < b->end;
+    };
+    std::sort(intervals.begin(), intervals.end(), byStart);
 
-        auto &BBRegs = BBToRegs[&BB];
-        for (auto value : live[&BB]) {
-            if (regAlloc.find(value) != regAlloc.end() && regAlloc[value] != V0) {
-                BBRegs[regAlloc[value]] = value;
-                regUseCount++;
-            }
-            else if (auto arg = dyn_cast<Argument>(value)) {
-                if (arg->getArgNo() < 4) {
-                    BBRegs[Mips32Reg(A0 + arg->getArgNo())] = value;
-                    regUseCount++;
-                }
+    // Active intervals holding a register, ordered by increasing end point
+    std::vector<const LiveInterval *> active;
+    std::map<Mips32Reg, const Value *> regUse;
+    int                                maxRegUseCount = 0;
+    int                                regSpillCount  = 0;
+
+    auto insertActive = [&](const LiveInterval *interval) {
+        auto pos = std::upper_bound(active.begin(), active.end(), interval, byEnd);
+        active.insert(pos, interval);
+    };
+
+    for (const auto &interval : intervals) {
+        // Expire intervals which end before this one starts
+        auto live    = [&](const LiveInterval *a) { return a->end >= interval.start; };
+        auto expired = std::find_if(active.begin(), active.end(), live);
+        for (auto it = active.begin(); it != expired; it++)
+            regUse.erase(regAlloc[(*it)->value]);
+        active.erase(active.begin(), expired);
+
+        // Arguments not live across a call stay in their $a register
+        auto arg = dyn_cast<Argument>(interval.value);
+        if (arg && arg->getArgNo() < 4 && !crossesCall(interval))
+            continue;
+
+        Mips32Reg freeReg = ZERO;
+        for (Mips32Reg reg : crossesCall(interval) ? RegPool : TempFirstRegPool) {
+            if (regUse.find(reg) == regUse.end()) {
+                freeReg = reg;
+                break;
             }
         }
 
-        for (const auto &Inst : BB.getInstList()) {
-            auto I = &Inst;
+        if (freeReg) {
+            regAlloc[interval.value] = freeReg;
+            regUse[freeReg]          = interval.value;
+            insertActive(&interval);
+            maxRegUseCount = std::max(maxRegUseCount, (int)active.size());
+            continue;
+        }
+
+        // No register left, spill the interval with the lowest spill cost
+        auto cheaper  = [](const LiveInterval *a, const LiveInterval *b) {
+            return a->spillWeight < b->spillWeight
+                   || a->spillWeight == b->spillWeight && a->end > b->end;
+        };
+        auto cheapest = std::min_element(active.begin(), active.end(), cheaper);
+
+        regSpillCount++;
+        if ((*cheapest)->spillWeight < interval.spillWeight) {
+            auto victim              = *cheapest;
+            auto reg                 = regAlloc[victim->value];
+            regAlloc[interval.value] = reg;
+            regUse[reg]              = interval.value;
+            active.erase(cheapest);
+            insertActive(&interval);
+            spillValue(victim->value);
+        }
+        else {
+            spillValue(interval.value);
+        }
+    }
+    assignSpillSlots(intervals);
+
+    // Coalesced values share the register or stack slot of their interval
+    for (const auto &entry : coalesced) {
+        for (auto member : entry.second) {
+            regAlloc[member] = regAlloc[entry.first];
+            if (regAlloc[member] == V0)
+                stackAlloc[member] = stackAlloc[entry.first];
+        }
+    }
+
+    // Registers used by the function
+    FRegs.clear();
+    for (const auto &interval : intervals) {
+        auto reg = regAlloc[interval.value];
+        if (reg != V0)
+            FRegs[reg] = interval.value;
+    }
+
+    // Caller-saved registers are saved around the calls their value lives across
+    callSaveRegs.clear();
+    for (const auto &interval : intervals) {
+        auto reg = regAlloc[interval.value];
+        if (reg == V0 || reg >= S0 && reg <= S7)
+            continue;
+
+        auto it =
+            std::upper_bound(callPositions.begin(), callPositions.end(), interval.start);
+        for (; it != callPositions.end() && *it < interval.end; it++)
+            callSaveRegs[calls[it - callPositions.begin()]].push_back(reg);
+    }
+
+    if (!comments)
+        return;
+
+    for (const auto &BB : F->getBasicBlockList()) {
+        unsigned  b     = BBIndex[&BB];
+        BitVector alive = liveIn[b];
+
+        alive |= liveOut[b];
+        alive |= useSet[b];
+        alive |= defSet[b];
+
+        emitComment(("# BB <" + BB.getName() + "> alive value:").str());
+        for (unsigned v : alive.set_bits()) {
+            std::string        text;
+            raw_string_ostream os(text);
+            os << "#\t" << regAlloc[liveValues[v]] << ", ";
+            liveValues[v]->print(os);
+            emitComment(os.str());
+        }
+    }
+
+    emitComment("# max register used: " + std::to_string(maxRegUseCount)
+                + ", register spill: " + std::to_string(regSpillCount));
+}
+
+void MipsFunctionAsmGen::numberInstructions(const Function *F)
+{
+    instIndex.clear();
+    BBRange.clear();
+
+    // Instructions are numbered in layout order. Even numbers leave room between
+    // instructions, and arguments are defined at 0.
+    uint32_t index = 2;
+    for (auto BB : blockLayout) {
+        uint32_t first = index;
+        for (const auto &I : *BB) {
+            instIndex[&I] = index;
+            index += 2;
+        }
+        BBRange[BB] = {first, index - 2};
+    }
+}
 
-            if (!needRegister(I))
+void MipsFunctionAsmGen::buildLiveIntervals(const Function *             F,
+                                             std::vector<LiveInterval> &intervals)
+{
+    auto blockWeight = [&](const BasicBlock *BB) {
+        float weight = 1;
+        for (unsigned depth = loopInfo.getLoopDepth(BB); depth > 0; depth--)
+            weight *= 10;
+        return weight;
+    };
+
+    std::vector<int> intervalIndex(liveValues.size(), -1);
+    for (const auto &arg : F->args()) {
+        if (arg.use_empty())
+            continue;
+
+        intervalIndex[valueIndex[&arg]] = intervals.size();
+        intervals.push_back({&arg, 0, 0, blockWeight(&F->getEntryBlock())});
+    }
+
+    for (const auto &BB : F->getBasicBlockList()) {
+        for (const auto &I : BB) {
+            if (!needRegister(&I))
                 continue;
 
-            for (Mips32Reg reg : RegPool) {
-                if (BBRegs.find(reg) == BBRegs.end()) {
-                    regAlloc[I] = reg;
-                    BBRegs[reg] = I;
-                    regUseCount++;
-                    break;
-                }
-            }
+            uint32_t def = instIndex[&I];
+            intervalIndex[valueIndex[&I]] = intervals.size();
+            intervals.push_back({&I, def, def, blockWeight(&BB)});
+        }
+    }
+
+    auto extend = [&](LiveInterval &interval, uint32_t from, uint32_t to) {
+        interval.start = std::min(interval.start, from);
+        interval.end   = std::max(interval.end, to);
+    };
 
-            if (regAlloc[I])
+    // Cover the blocks where a value is live in, and the rest of its defining
+    // block when it is live out of it
+    for (const auto &BB : F->getBasicBlockList()) {
+        auto     range = BBRange[&BB];
+        unsigned b     = BBIndex[&BB];
+
+        for (unsigned v : liveIn[b].set_bits()) {
+            if (intervalIndex[v] >= 0)
+                extend(intervals[intervalIndex[v]], range.first, range.second);
+        }
+
+        for (unsigned v : liveOut[b].set_bits()) {
+            if (intervalIndex[v] < 0)
                 continue;
 
-            // Allocate value on stack
-            regAlloc[I] = V0;
-            regSpillCount++;
+            if (defSet[b].test(v))
+                extend(intervals[intervalIndex[v]], range.second, range.second);
+            else
+                extend(intervals[intervalIndex[v]], range.first, range.second);
+        }
+    }
+
+    // Extend to every use, looking through extensions and casts which share the
+    // register of their operand and GEPs folded into the address of their users. A PHI
+    // operand is used, and the PHI is defined, at the end of the incoming block.
+    std::function<void(LiveInterval &, const Value *)> addUses =
+        [&](LiveInterval &interval, const Value *value) {
+            for (auto user : value->users()) {
+                auto userInst = cast<Instruction>(user);
 
-            // Load instruction of constant address can be delayed
-            if (auto loadInst = dyn_cast<LoadInst>(I)) {
-                auto address = loadInst->getOperand(0);
-                if (!regAlloc[address])
+                if (isRegisterCopy(userInst) || isFoldedAddress(userInst)) {
+                    addUses(interval, userInst);
                     continue;
+                }
+
+                if (auto PHIInst = dyn_cast<PHINode>(userInst)) {
+                    for (unsigned i = 0; i < PHIInst->getNumIncomingValues(); i++) {
+                        if (PHIInst->getIncomingValue(i) != value)
+                            continue;
+
+                        auto incomeBB = PHIInst->getIncomingBlock(i);
+                        auto end      = BBRange[incomeBB].second;
+                        extend(interval, end, end);
+                        interval.spillWeight += blockWeight(incomeBB);
+                    }
+                }
+                else {
+                    // Operands of a fused comparison are read by the branch
+                    if (isFusedCompare(userInst))
+                        userInst = cast<Instruction>(userInst->user_back());
+
+                    auto pos = instIndex[userInst];
+                    extend(interval, pos, pos);
+                    interval.spillWeight += blockWeight(userInst->getParent());
+                }
             }
+        };
+
+    for (auto &interval : intervals) {
+        addUses(interval, interval.value);
 
+        if (auto PHIInst = dyn_cast<PHINode>(interval.value)) {
+            for (auto incomeBB : PHIInst->blocks()) {
+                auto end = BBRange[incomeBB].second;
+                extend(interval, end, end);
+                interval.spillWeight += blockWeight(incomeBB);
+            }
+        }
+
+        // A recomputed address costs an addiu per use, and no load or store
+        if (isRematerializable(interval.value))
+            interval.spillWeight /= 2;
+    }
+}
+
+void MipsFunctionAsmGen::spillValue(const Value *value)
+{
+    // Stack slots are assigned once every interval is allocated
+    regAlloc[value] = V0;
+}
+
+// Spilled values with disjoint live intervals share a stack slot. Arguments
+// passed on the stack already have a slot in the caller's frame, and addresses
+// are recomputed instead.
+void MipsFunctionAsmGen::assignSpillSlots(const std::vector<LiveInterval> &intervals)
+{
+    struct SpillSlot
+    {
+        uint32_t offset;
+        uint32_t end;  // end of the last interval in the slot
+    };
+    std::vector<SpillSlot> slots;
+
+    // Intervals are sorted by start
+    for (const auto &interval : intervals) {
+        auto value = interval.value;
+        auto arg   = dyn_cast<Argument>(value);
+        if (regAlloc[value] != V0 || arg && arg->getArgNo() >= 4
+            || isRematerializable(value))
+            continue;
+
+        auto isFree = [&](const SpillSlot &slot) { return slot.end < interval.start; };
+        auto slot   = std::find_if(slots.begin(), slots.end(), isFree);
+        if (slot == slots.end()) {
             // Make stack allocation aligned
             uint32_t size = 4, align = 4;
-            stackTop      = (stackTop + align - 1) & ~(align - 1);
-            stackAlloc[I] = stackTop;
+            stackTop = (stackTop + align - 1) & ~(align - 1);
+            slots.push_back({stackTop, 0});
             stackTop += size;
+            slot = slots.end() - 1;
         }
 
-        // Merge basicblock registers uses into function registers
-        for (auto regKV : BBRegs) {
-            FRegs[regKV.first] = regKV.second;
-        }
+        stackAlloc[value] = slot->offset;
+        slot->end         = interval.end;
+    }
+}
 
-        maxRegUseCount = std::max(maxRegUseCount, regUseCount);
+// Merges the interval of a PHI with those of its incoming values when they never
+// hold different values at the same time, so the copies between them vanish. The
+// merged interval spans all of them, and lists the others in coalesced.
+void MipsFunctionAsmGen::coalescePhis(
+    std::vector<LiveInterval> &                          intervals,
+    DenseMap<const Value *, std::vector<const Value *>> &coalesced)
+{
+    DenseMap<const Value *, unsigned>       intervalOf;
+    std::vector<unsigned>                   leader(intervals.size());
+    std::vector<std::vector<const Value *>> members(intervals.size());
+    for (unsigned i = 0; i < intervals.size(); i++) {
+        intervalOf[intervals[i].value] = i;
+        leader[i]                      = i;
+        members[i].push_back(intervals[i].value);
+    }
 
-        ss << "# BB <" << BB.getName() << "> alive value:\n";
-        for (auto value : live[&BB]) {
-            ss << "#\t" << regAlloc[value] << ", ";
-            value->print(ss);
-            ss << '\n';
+    auto find = [&](unsigned i) {
+        while (leader[i] != i)
+            i = leader[i];
+        return i;
+    };
+
+    for (unsigned i = 0; i < intervals.size(); i++) {
+        auto PHIInst = dyn_cast<PHINode>(intervals[i].value);
+        if (!PHIInst)
+            continue;
+
+        for (const auto &incoming : PHIInst->incoming_values()) {
+            // Arguments keep their own home, and addresses are recomputed
+            auto it = intervalOf.find(incoming.get());
+            if (it == intervalOf.end() || isa<Argument>(incoming.get())
+                || isRematerializable(incoming.get()))
+                continue;
+
+            unsigned a = find(i), b = find(it->second);
+            if (a == b)
+                continue;
+
+            bool interferes = false;
+            for (auto u : members[a]) {
+                for (auto v : members[b])
+                    interferes |= isLiveAt(u, v) || isLiveAt(v, u);
+            }
+            if (interferes)
+                continue;
+
+            leader[b]               = a;
+            intervals[a].start      = std::min(intervals[a].start, intervals[b].start);
+            intervals[a].end        = std::max(intervals[a].end, intervals[b].end);
+            intervals[a].spillWeight += intervals[b].spillWeight;
+            members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+            members[b].clear();
         }
     }
 
-    ss << "# max register used: " << maxRegUseCount
-       << ", register spill: " << regSpillCount << '\n';
+    std::vector<LiveInterval> merged;
+    for (unsigned i = 0; i < intervals.size(); i++) {
+        if (leader[i] != i)
+            continue;
+
+        merged.push_back(intervals[i]);
+        if (members[i].size() > 1) {
+            auto &others = coalesced[intervals[i].value];
+            others.assign(members[i].begin() + 1, members[i].end());
+        }
+    }
+    intervals.swap(merged);
 }
 
-void MipsAssemblyGenPass::recordPhiBlock(const Function *F)
+// Whether value has to be kept while def writes its result: it is read after def,
+// or by def itself when def may write its result before reading all operands. In
+// SSA form two values interfere when either one is live at the other's definition.
+bool MipsFunctionAsmGen::isLiveAt(const Value *value, const Value *def)
 {
-    phiBlocks.clear();
-    for (const_inst_iterator It = inst_begin(F), E = inst_end(F); It != E; It++) {
-        if (auto PHIInst = dyn_cast<PHINode>(&*It)) {
-            for (BasicBlock *inBlock : PHIInst->blocks()) {
-                phiBlocks.insert({inBlock, PHIInst});
+    // Arguments are all defined on entry
+    if (isa<Argument>(def))
+        return isa<Argument>(value);
+
+    auto     defInst   = cast<Instruction>(def);
+    auto     valueInst = dyn_cast<Instruction>(value);
+    auto     BB        = defInst->getParent();
+    unsigned b         = BBIndex[BB];
+    unsigned v         = valueIndex[value];
+
+    // The PHIs of a block are written together, on its incoming edges
+    if (isa<PHINode>(defInst))
+        return liveIn[b].test(v) || isa<PHINode>(value) && valueInst->getParent() == BB;
+
+    // Defined later in the block, live at def only when it is carried around a loop
+    uint32_t pos = instIndex[defInst];
+    if (valueInst && valueInst->getParent() == BB && !isa<PHINode>(valueInst)
+        && instIndex[valueInst] > pos)
+        return liveIn[b].test(v);
+
+    if (liveOut[b].test(v))
+        return true;
+
+    // Read later in the block, also through casts and folded addresses, or
+    // by a PHI copy at its end
+    std::function<bool(const Value *)> isReadAfter = [&](const Value *value) {
+        for (auto user : value->users()) {
+            auto userInst = cast<Instruction>(user);
+
+            if (isRegisterCopy(userInst) || isFoldedAddress(userInst)) {
+                if (isReadAfter(userInst))
+                    return true;
+                continue;
+            }
+
+            if (auto PHIInst = dyn_cast<PHINode>(userInst)) {
+                for (unsigned i = 0; i < PHIInst->getNumIncomingValues(); i++) {
+                    if (PHIInst->getIncomingValue(i) == value
+                        && PHIInst->getIncomingBlock(i) == BB)
+                        return true;
+                }
+                continue;
             }
+
+            if (isFusedCompare(userInst))
+                userInst = cast<Instruction>(userInst->user_back());
+            if (userInst->getParent() != BB)
+                continue;
+
+            if (instIndex[userInst] > pos
+                || userInst == defInst && !writesResultLast(defInst))
+                return true;
         }
-    }
+        return false;
+    };
+    return isReadAfter(value);
+}
+
+bool MipsFunctionAsmGen::crossesCall(const LiveInterval &interval) const
+{
+    auto it =
+        std::upper_bound(callPositions.begin(), callPositions.end(), interval.start);
+    return it != callPositions.end() && *it < interval.end;
 }
 
-bool MipsAssemblyGenPass::needRegister(const Instruction *I)
+bool MipsFunctionAsmGen::needRegister(const Instruction *I)
 {
     // Skip instruction which returns void
     if (isa<AllocaInst>(I) || isa<StoreInst>(I) || isa<BranchInst>(I)
-        || isa<ReturnInst>(I) || isa<SExtInst>(I) || isa<ZExtInst>(I))
+        || isa<SwitchInst>(I) || isa<ReturnInst>(I) || isRegisterCopy(I))
         return false;
 
     // Skip call insturction of a function returning void
@@ -1000,241 +1995,1053 @@ bool MipsAssemblyGenPass::needRegister(const Instruction *I)
             return false;
     }
 
-    // Skip constant GEP instruction
-    if (auto GEPInst = dyn_cast<GetElementPtrInst>(I)) {
-        // Constant GEP instruction result can be computed directly
-        if (GEPInst->hasAllConstantIndices() && !regAlloc[GEPInst->getPointerOperand()])
-            return false;
-    }
+    // Skip comparison generated with its branch
+    if (isFusedCompare(I))
+        return false;
+
+    // Skip GEP folded into the address of its users
+    if (isFoldedAddress(I))
+        return false;
 
     return true;
 }
 
-void MipsAssemblyGenPass::genFName(const Function *F)
+std::string MipsFunctionAsmGen::genFName(const Function *F)
 {
-    ss << "F_" << F->getName();
+    return ("F_" + F->getName()).str();
 }
 
-void MipsAssemblyGenPass::genBBName(const BasicBlock *BB)
+std::string MipsFunctionAsmGen::genBBName(const BasicBlock *BB)
 {
-    ss << '_' << BB->getParent()->getName() << "_BB_";
+    std::string name = ("_" + BB->getParent()->getName() + "_BB_").str();
+
+    // Blocks left unnamed by the optimizer are told apart by their index, after
+    // a dot which no named block produces
+    if (!BB->hasName())
+        return name + '.' + std::to_string(BBIndex.lookup(BB));
+
     for (char c : BB->getName()) {
         if (c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z' || c >= '0' && c <= '9'
             || c == '_')
-            ss << c;
+            name += c;
         else if (c == '.')
-            ss << "__";
+            name += "__";
         else
-            ss << '_' << (int)c;
+            name += '_' + std::to_string((int)c);
     }
+    return name;
 }
 
-void MipsAssemblyGenPass::genJump(const Instruction *I, const BasicBlock *toBB)
+void MipsFunctionAsmGen::genJump(const Instruction *I, const BasicBlock *toBB)
 {
     if (toBB) {
-        if (I->getParent()->getNextNode() != toBB) {
-            ss << "\tj ";
-            genBBName(toBB);
-            ss << '\n';
+        if (nextBlock.lookup(I->getParent()) != toBB)
+            emitBranch(MipsOp::J, genBBName(toBB));
+    }
+    else {
+        if (!nextBlock.lookup(I->getParent()))
+            return;
+        // Nothing to restore, return in place
+        if (!frameSize)
+            emit(MipsOp::JR, RA);
+        else
+            emitBranch(MipsOp::J, ("_" + I->getFunction()->getName() + "_RET").str());
+    }
+}
+
+std::string MipsFunctionAsmGen::genEdgeName(const BasicBlock *fromBB,
+                                            const BasicBlock *toBB)
+{
+    return genBBName(toBB) + ".from" + std::to_string(BBIndex[fromBB]);
+}
+
+// Ends a block with a conditional branch, genBranch(isInverse) giving the branch
+// to the true successor, or with isInverse the one to the false successor. PHI
+// copies not hoisted above the branch run on their edge only: on the fall-through
+// path, or in an edge block when both edges have copies.
+void MipsFunctionAsmGen::genCondBranch(const BranchInst *                     branchInst,
+                                        const std::function<MipsInst(bool)> &genBranch,
+                                        const BasicBlock *                     hoistedBB)
+{
+    auto BB        = branchInst->getParent();
+    auto hasCopies = [&](const BasicBlock *toBB) {
+        return toBB != hoistedBB && !phiCopies(BB, toBB).empty();
+    };
+
+    // Branch away from the next block, or to the successor without copies
+    auto takenBB = branchInst->getSuccessor(0);
+    auto otherBB = branchInst->getSuccessor(1);
+    if (takenBB == nextBlock.lookup(BB))
+        std::swap(takenBB, otherBB);
+    if (hasCopies(takenBB) && !hasCopies(otherBB))
+        std::swap(takenBB, otherBB);
+
+    auto branch = genBranch(takenBB != branchInst->getSuccessor(0));
+    if (hasCopies(takenBB)) {
+        branch.symbol = genEdgeName(BB, takenBB);
+        edgeBlocks.push_back({BB, takenBB});
+    }
+    else {
+        branch.symbol = genBBName(takenBB);
+    }
+    insts.push_back(std::move(branch));
+
+    genPhiCopies(BB, otherBB);
+    genJump(branchInst, otherBB);
+}
+
+// A successor whose PHI copies may run before the conditional branch, as they
+// overwrite nothing the branch or the other successor reads. Copies on the edge
+// to the next block are left after the branch, where they cost no jump.
+const BasicBlock *MipsFunctionAsmGen::hoistablePhiEdge(const BranchInst *branchInst)
+{
+    auto BB        = branchInst->getParent();
+    auto condition = branchInst->getCondition();
+
+    std::vector<const Value *> branchReads = {condition};
+    if (isFusedCompare(condition)) {
+        auto icmpInst = cast<ICmpInst>(condition);
+        branchReads   = {icmpInst->getOperand(0), icmpInst->getOperand(1)};
+    }
+
+    for (unsigned i = 0; i < 2; i++) {
+        auto toBB    = branchInst->getSuccessor(i);
+        auto otherBB = branchInst->getSuccessor(1 - i);
+        auto copies  = phiCopies(BB, toBB);
+        if (copies.empty() || toBB == nextBlock.lookup(BB))
+            continue;
+
+        // Copies of the less likely edge would slow down the other one
+        double probability = trueProbability(branchInst, loopInfo);
+        if ((i == 0 ? probability : 1 - probability) < 0.5)
+            continue;
+
+        auto isWritten = [&](const Value *value) {
+            int  location = phiLocation(value);
+            auto writes   = [&](const PhiCopy &copy) { return copy.dst == location; };
+            return location >= 0 && std::any_of(copies.begin(), copies.end(), writes);
+        };
+
+        bool isClobbered = std::any_of(branchReads.begin(), branchReads.end(), isWritten);
+        for (unsigned v : liveIn[BBIndex[otherBB]].set_bits())
+            isClobbered |= isWritten(liveValues[v]);
+        for (const auto &PHIInst : otherBB->phis())
+            isClobbered |= isWritten(PHIInst.getIncomingValueForBlock(BB));
+
+        if (!isClobbered)
+            return toBB;
+    }
+    return nullptr;
+}
+
+// Switches with at least this many cases may use a jump table, if at least this
+// share of its entries are cases. Up to MaxCaseChain ranges of cases are compared
+// one after another.
+const unsigned MinJumpTableCases   = 4;
+const double   MinJumpTableDensity = 0.4;
+const unsigned MaxCaseChain        = 3;
+
+// Ends a block with a switch. Its cases are grouped into ranges of consecutive
+// values going to the same successor, which are dispatched by genSwitchTree.
+void MipsFunctionAsmGen::genSwitch(const SwitchInst *switchInst)
+{
+    auto BB        = switchInst->getParent();
+    auto condition = switchInst->getCondition();
+
+    if (auto constant = dyn_cast<ConstantInt>(condition)) {
+        auto toBB = switchInst->findCaseValue(constant)->getCaseSuccessor();
+        genPhiCopies(BB, toBB);
+        genJump(switchInst, toBB);
+        return;
+    }
+
+    std::vector<CaseRange> cases;
+    for (const auto &caseHandle : switchInst->cases()) {
+        int64_t value = caseHandle.getCaseValue()->getSExtValue();
+        cases.push_back({value, value, caseHandle.getCaseSuccessor()});
+    }
+    std::sort(cases.begin(), cases.end(), [](const CaseRange &a, const CaseRange &b) {
+        return a.low < b.low;
+    });
+
+    std::vector<CaseRange> ranges;
+    for (const auto &range : cases) {
+        if (!ranges.empty() && ranges.back().high + 1 == range.low
+            && ranges.back().toBB == range.toBB)
+            ranges.back().high = range.high;
+        else
+            ranges.push_back(range);
+    }
+
+    auto reg = regAlloc[condition];
+    if (reg == V0)
+        genReload(V0, condition);
+
+    unsigned labels = 0;
+    if (ranges.empty())
+        emitBranch(MipsOp::J, genSwitchTarget(BB, switchInst->getDefaultDest()));
+    else
+        genSwitchTree(switchInst, reg, ranges, labels);
+}
+
+// Dispatches the value of reg among sorted ranges of cases, or to the default.
+// A few ranges are compared in turn, dense cases index a jump table, and others
+// are split in halves by a comparison with the middle range, recursively.
+void MipsFunctionAsmGen::genSwitchTree(const SwitchInst *  switchInst,
+                                        Mips32Reg           reg,
+                                        ArrayRef<CaseRange> ranges,
+                                        unsigned &          labels)
+{
+    auto BB        = switchInst->getParent();
+    auto defaultBB = switchInst->getDefaultDest();
+
+    // Sets $at to whether low <= reg < low + count, leaving reg - low in $v1
+    auto genInRange = [&](int64_t low, uint64_t count) {
+        auto index = reg;
+        if (low) {
+            index = V1;
+            emitImm(MipsOp::ADDIU, V1, reg, int32_t(-low));
         }
+        if (count <= 32767)
+            emitImm(MipsOp::SLTIU, AT, index, count);
+        else {
+            emitImm(MipsOp::LI, AT, count);
+            emit(MipsOp::SLTU, AT, index, AT);
+        }
+        return index;
+    };
+
+    uint64_t cases = 0;
+    for (const auto &range : ranges)
+        cases += range.high - range.low + 1;
+    uint64_t span = ranges.back().high - ranges.front().low + 1;
+
+    if (ranges.size() <= MaxCaseChain) {
+        for (const auto &range : ranges) {
+            auto target = genSwitchTarget(BB, range.toBB);
+            if (range.low != range.high) {
+                genInRange(range.low, range.high - range.low + 1);
+                emitBranch(MipsOp::BNE, target, AT, ZERO);
+            }
+            else if (range.low == 0)
+                emitBranch(MipsOp::BEQ, target, reg, ZERO);
+            else {
+                emitImm(MipsOp::LI, V1, range.low);
+                emitBranch(MipsOp::BEQ, target, reg, V1);
+            }
+        }
+        emitBranch(MipsOp::J, genSwitchTarget(BB, defaultBB));
+    }
+    else if (cases >= MinJumpTableCases && cases >= MinJumpTableDensity * span) {
+        JumpTable table = {BB, std::vector<const BasicBlock *>(span, defaultBB)};
+        for (const auto &range : ranges) {
+            for (int64_t value = range.low; value <= range.high; value++)
+                table.targets[value - ranges.front().low] = range.toBB;
+        }
+
+        auto index = genInRange(ranges.front().low, span);
+        emitBranch(MipsOp::BEQ, genSwitchTarget(BB, defaultBB), AT, ZERO);
+        emitImm(MipsOp::SLL, V1, index, 2);
+        insts.push_back(MipsInst::makeAddress(
+            AT, genBBName(BB) + ".table" + std::to_string(jumpTables.size()), 0));
+        emit(MipsOp::ADDU, AT, AT, V1);
+        emitMem(MipsOp::LW, AT, 0, AT);
+        emit(MipsOp::JR, AT);
+        jumpTables.push_back(std::move(table));
     }
     else {
-        if (I->getParent()->getNextNode() != toBB) {
-            ss << "\tj _" << I->getFunction()->getName() << "_RET\n";
+        auto    middle = ranges.size() / 2;
+        int64_t pivot  = ranges[middle].low;
+        if (isInt<16>(pivot))
+            emitImm(MipsOp::SLTI, AT, reg, pivot);
+        else {
+            emitImm(MipsOp::LI, V1, pivot);
+            emit(MipsOp::SLT, AT, reg, V1);
         }
+
+        auto label = genBBName(BB) + ".case" + std::to_string(labels++);
+        emitBranch(MipsOp::BEQ, label, AT, ZERO);
+        genSwitchTree(switchInst, reg, ranges.take_front(middle), labels);
+        emitLabel(label);
+        genSwitchTree(switchInst, reg, ranges.drop_front(middle), labels);
     }
 }
 
-bool MipsAssemblyGenPass::genPhi(const BasicBlock *BB, const Value *cond)
+// Label a switch in BB goes to for toBB: the block itself, or an edge block
+// running the PHI copies of the edge
+std::string MipsFunctionAsmGen::genSwitchTarget(const BasicBlock *BB,
+                                                const BasicBlock *toBB)
 {
-    auto pbRange   = phiBlocks.equal_range(BB);
-    bool condSaved = false;
+    if (phiCopies(BB, toBB).empty())
+        return genBBName(toBB);
+
+    auto edge = std::make_pair(BB, toBB);
+    if (std::find(edgeBlocks.begin(), edgeBlocks.end(), edge) == edgeBlocks.end())
+        edgeBlocks.push_back(edge);
+    return genEdgeName(BB, toBB);
+}
 
-    SmallPtrSet<const Value *, 32>     phiValues;
-    DenseMap<const Value *, Mips32Reg> collideRegs;
-    DenseMap<const Value *, int>       collideStack;
-    int                                stackTop = 4;
+// Where a PHI or an incoming value is kept, or -1 for constants and addresses
+// which are materialized instead
+int MipsFunctionAsmGen::phiLocation(const Value *value)
+{
+    while (isRegisterCopy(value))
+        value = cast<Instruction>(value)->getOperand(0);
+
+    auto it = regAlloc.find(value);
+    if (isa<Constant>(value) || it == regAlloc.end() || it->second == ZERO)
+        return -1;
+    if (it->second != V0)
+        return it->second;
+    return isRematerializable(value) ? -1 : StackLocation + stackAlloc[value];
+}
 
-    for (auto pbIt = pbRange.first; pbIt != pbRange.second; pbIt++) {
-        phiValues.insert(pbIt->second);
+std::vector<MipsFunctionAsmGen::PhiCopy>
+MipsFunctionAsmGen::phiCopies(const BasicBlock *fromBB, const BasicBlock *toBB)
+{
+    std::vector<PhiCopy> copies;
+    for (const auto &PHIInst : toBB->phis()) {
+        auto value = PHIInst.getIncomingValueForBlock(fromBB);
+        int  dst   = phiLocation(&PHIInst);
+        int  src   = phiLocation(value);
+
+        // Coalesced values need no copy
+        if (dst >= 0 && src != dst && !isa<UndefValue>(value))
+            copies.push_back({dst, src, value});
     }
+    return copies;
+}
 
-    for (auto pbIt = pbRange.first; pbIt != pbRange.second; pbIt++) {
-        auto PHIInst    = pbIt->second;
-        auto blockValue = PHIInst->getIncomingValueForBlock(BB);
+void MipsFunctionAsmGen::genLocationMove(int dst, int src)
+{
+    if (dst < StackLocation && src < StackLocation) {
+        emit(MipsOp::MOVE, Mips32Reg(dst), Mips32Reg(src));
+        return;
+    }
 
-        if (phiValues.find(blockValue) == phiValues.end())
-            continue;
+    Mips32Reg reg = dst < StackLocation ? Mips32Reg(dst) : V0;
+    if (src >= StackLocation)
+        emitMem(MipsOp::LW, reg, frameOffset(src - StackLocation), SP);
+    else
+        reg = Mips32Reg(src);
+
+    if (dst >= StackLocation)
+        emitMem(MipsOp::SW, reg, frameOffset(dst - StackLocation), SP);
+}
 
-        if (regAlloc[PHIInst] == V0)
+// The copies of an edge form a parallel copy, where every source is read before
+// any PHI is written. A copy is emitted once no other copy reads its destination;
+// when only cycles are left, one destination is saved in $at first, so a cycle of
+// n copies takes n + 1 moves. Constants and addresses are materialized last.
+void MipsFunctionAsmGen::genPhiCopies(const BasicBlock *fromBB, const BasicBlock *toBB)
+{
+    std::vector<PhiCopy> pending, materialized;
+    for (const auto &copy : phiCopies(fromBB, toBB))
+        (copy.src < 0 ? materialized : pending).push_back(copy);
+
+    while (!pending.empty()) {
+        auto isUnread = [&](const PhiCopy &copy) {
+            auto readsDst = [&](const PhiCopy &other) { return other.src == copy.dst; };
+            return std::none_of(pending.begin(), pending.end(), readsDst);
+        };
+        auto ready = std::find_if(pending.begin(), pending.end(), isUnread);
+
+        if (ready == pending.end()) {
+            int saved = pending.front().dst;
+            genLocationMove(AT, saved);
+            for (auto &copy : pending) {
+                if (copy.src == saved)
+                    copy.src = AT;
+            }
             continue;
+        }
 
-        auto &BBRegs = BBToRegs[BB];
-        for (Mips32Reg reg : RegPool) {
-            if (BBRegs.find(reg) == BBRegs.end()) {
-                collideRegs[PHIInst] = reg;
-                BBRegs[reg]          = PHIInst;
-                break;
+        genLocationMove(ready->dst, ready->src);
+        pending.erase(ready);
+    }
+
+    for (const auto &copy : materialized) {
+        Mips32Reg reg = copy.dst < StackLocation ? Mips32Reg(copy.dst) : V0;
+
+        if (auto constant = dyn_cast<ConstantInt>(copy.value)) {
+            int64_t imm = constant->getBitWidth() == 1 ? constant->getZExtValue()
+                                                       : constant->getSExtValue();
+            emitImm(MipsOp::LI, reg, imm);
+        }
+        else if (isa<ConstantPointerNull>(copy.value))
+            emit(MipsOp::MOVE, reg, ZERO);
+        else if (isRematerializable(copy.value))
+            genReload(reg, copy.value);
+        else
+            genAddress(fromBB->getTerminator(), reg, copy.value);
+
+        if (reg == V0)
+            emitMem(MipsOp::SW, V0, frameOffset(copy.dst - StackLocation), SP);
+    }
+}
+
+void MipsFunctionAsmGen::genArgumentMoves(const CallInst *callInst)
+{
+    struct ArgumentMove
+    {
+        Mips32Reg    dst, src;
+        const Value *value;
+    };
+    std::vector<ArgumentMove> moves, loads;
+
+    for (unsigned i = 0; i < std::min(callInst->arg_size(), 4u); i++) {
+        auto argOp = callInst->getArgOperand(i);
+        auto dst   = Mips32Reg(A0 + i);
+
+        if (isa<ConstantInt>(argOp) || regAlloc[argOp] == V0 || !regAlloc[argOp])
+            loads.push_back({dst, ZERO, argOp});
+        else if (regAlloc[argOp] != dst)
+            moves.push_back({dst, regAlloc[argOp], argOp});
+    }
+
+    // Register moves form a parallel copy: a move is emitted once no pending move
+    // reads its destination, and a cycle is broken by copying through $v1
+    auto isRead = [&](Mips32Reg reg) {
+        for (const auto &m : moves) {
+            if (m.src == reg)
+                return true;
+        }
+        return false;
+    };
+    auto isReady = [&](const ArgumentMove &m) { return !isRead(m.dst); };
+
+    while (!moves.empty()) {
+        auto ready = std::find_if(moves.begin(), moves.end(), isReady);
+
+        if (ready == moves.end()) {
+            Mips32Reg reg = moves.front().dst;
+            emit(MipsOp::MOVE, V1, reg);
+            for (auto &m : moves) {
+                if (m.src == reg)
+                    m.src = V1;
             }
+            continue;
         }
 
-        if (!collideRegs[PHIInst]) {
-            collideRegs[PHIInst] = V0;
-            // Make stack allocation aligned
-            uint32_t size = 4, align = 4;
-            stackTop              = (stackTop + align - 1) & ~(align - 1);
-            collideStack[PHIInst] = stackTop;
-            stackTop += size;
+        emit(MipsOp::MOVE, ready->dst, ready->src);
+        moves.erase(ready);
+    }
+
+    // Constants, addresses and spilled values read no argument register, so they
+    // come last
+    for (const auto &load : loads) {
+        if (auto constArg = dyn_cast<ConstantInt>(load.value))
+            emitImm(MipsOp::ADDIU, load.dst, ZERO, constArg->getSExtValue());
+        else if (regAlloc[load.value] == V0)
+            genReload(load.dst, load.value);
+        else
+            genAddress(callInst, load.dst, load.value);
+    }
+}
+
+// Intrinsics left by the optimizer: markers produce no code, the integer minimum,
+// maximum and absolute value are computed without branches
+void MipsFunctionAsmGen::genIntrinsic(const IntrinsicInst *I)
+{
+    if (I->isAssumeLikeIntrinsic())
+        return;
+
+    auto reg = regAlloc[I];
+
+    switch (I->getIntrinsicID()) {
+    case Intrinsic::smax:
+    case Intrinsic::smin:
+    case Intrinsic::umax:
+    case Intrinsic::umin: {
+        auto reg1 = genOperand(I, I->getArgOperand(0), V0);
+        auto reg2 = genOperand(I, I->getArgOperand(1), V1);
+
+        // $at is set when the second operand is the result
+        auto id = I->getIntrinsicID();
+        auto slt = id == Intrinsic::smax || id == Intrinsic::smin ? MipsOp::SLT
+                                                                  : MipsOp::SLTU;
+        if (id == Intrinsic::smax || id == Intrinsic::umax)
+            emit(slt, AT, reg1, reg2);
+        else
+            emit(slt, AT, reg2, reg1);
+
+        emit(MipsOp::NEGU, AT, AT);
+        emit(MipsOp::XOR, V1, reg1, reg2);
+        emit(MipsOp::AND, AT, AT, V1);
+        emit(MipsOp::XOR, reg, reg1, AT);
+        break;
+    }
+    case Intrinsic::abs: {
+        auto reg1 = genOperand(I, I->getArgOperand(0), V0);
+        emitImm(MipsOp::SRA, AT, reg1, 31);
+        emit(MipsOp::XOR, V1, reg1, AT);
+        emit(MipsOp::SUBU, reg, V1, AT);
+        break;
+    }
+    default:
+        auto name = I->getCalledFunction()->getName();
+        emitComment(("\t # unsupported intrinsic " + name).str());
+        return;
+    }
+
+    if (reg == V0)
+        emitMem(MipsOp::SW, V0, frameOffset(stackAlloc[I]), SP);
+}
+
+// Register holding an operand, constants, addresses and spilled values being put
+// into scratch
+Mips32Reg MipsFunctionAsmGen::genOperand(const Instruction *I,
+                                         const Value *      value,
+                                         Mips32Reg          scratch)
+{
+    if (auto constant = dyn_cast<ConstantInt>(value)) {
+        int64_t imm = constant->getBitWidth() == 1 ? constant->getZExtValue()
+                                                   : constant->getSExtValue();
+        if (!imm)
+            return ZERO;
+        emitImm(MipsOp::LI, scratch, imm);
+    }
+    else if (isa<ConstantPointerNull>(value) || isa<UndefValue>(value))
+        return ZERO;
+    else if (regAlloc[value] == V0)
+        genReload(scratch, value);
+    else if (!regAlloc[value])
+        genAddress(I, scratch, value);
+    else
+        return regAlloc[value];
+
+    return scratch;
+}
+
+// Loads a spilled value into reg, recomputing addresses instead
+void MipsFunctionAsmGen::genReload(Mips32Reg reg, const Value *value)
+{
+    if (isRematerializable(value))
+        genAddress(cast<Instruction>(value), reg, value);
+    else
+        emitMem(MipsOp::LW, reg, frameOffset(stackAlloc[value]), SP);
+}
+
+// Base of an address, with the offsets of the GEPs folded into it summed up
+const Value *MipsFunctionAsmGen::foldAddress(const Value *      address,
+                                              int64_t &          offset,
+                                              const DataLayout &dataLayout)
+{
+    offset = 0;
+    for (;;) {
+        // Pointer casts, instructions or constant expressions, leave the address as is
+        if (isa<BitCastOperator>(address)) {
+            address = cast<Operator>(address)->getOperand(0);
+            continue;
         }
 
-        if (auto constant = dyn_cast<ConstantInt>(blockValue)) {
-            ss << "\taddiu " << collideRegs[PHIInst] << ", " << ZERO << ", "
-               << constant->getSExtValue() << '\n';
+        auto  GEP = dyn_cast<GEPOperator>(address);
+        APInt GEPOffset(dataLayout.getIndexSizeInBits(0), 0, true);
+
+        bool isFoldable = isa<ConstantExpr>(address) || isFoldedAddress(address)
+                          || isRematerializable(address);
+        if (!GEP || !isFoldable || !GEP->accumulateConstantOffset(dataLayout, GEPOffset))
+            return address;
+
+        offset += GEPOffset.getSExtValue();
+        address = GEP->getPointerOperand();
+    }
+}
 
-            if (collideRegs[PHIInst] == V0)
-                ss << "\tsw " << V0 << ", " << collideStack[PHIInst] << '(' << FP
-                   << ")\n";
+// Whether an address is in small data, and within the reach of $gp
+bool MipsFunctionAsmGen::isGpRelative(const Value *base, int64_t offset) const
+{
+    auto it = globalAlloc.find(base);
+    return it != globalAlloc.end() && isInt<16>(it->second + offset);
+}
+
+// Computes an address into dst
+void MipsFunctionAsmGen::genAddress(const Instruction *I,
+                                     Mips32Reg          dst,
+                                     const Value *      address)
+{
+    DataLayout dataLayout(I->getModule());
+    int64_t    offset;
+    auto       base = foldAddress(address, offset, dataLayout);
+
+    if (isGpRelative(base, offset))
+        insts.push_back(
+            MipsInst::makeGpAddress(dst, globalLabel(cast<GlobalValue>(base)), offset));
+    else if (auto global = dyn_cast<GlobalVariable>(base))
+        insts.push_back(MipsInst::makeAddress(dst, globalLabel(global), offset));
+    else if (!regAlloc[base] && stackAlloc.find(base) != stackAlloc.end())
+        emitImm(MipsOp::ADDIU, dst, SP, frameOffset(stackAlloc[base]) + offset);
+    else if (regAlloc[base] == V0) {
+        emitMem(MipsOp::LW, dst, frameOffset(stackAlloc[base]), SP);
+        if (offset)
+            emitImm(MipsOp::ADDIU, dst, dst, offset);
+    }
+    else if (offset)
+        emitImm(MipsOp::ADDIU, dst, regAlloc[base], offset);
+    else
+        emit(MipsOp::MOVE, dst, regAlloc[base]);
+}
+
+// Memory operand "offset($base)" of an address, a spilled base register being
+// loaded into scratch first, and the address of a global outside small data into $at.
+// Small data is addressed as %gp_rel(label+offset)($gp).
+MipsFunctionAsmGen::MemOperand
+MipsFunctionAsmGen::genMemOperand(const Instruction *I,
+                                  const Value *      address,
+                                  Mips32Reg          scratch)
+{
+    DataLayout dataLayout(I->getModule());
+    int64_t    offset;
+    auto       base = foldAddress(address, offset, dataLayout);
+
+    if (isGpRelative(base, offset))
+        return {offset, GP, globalLabel(cast<GlobalValue>(base))};
+
+    if (auto global = dyn_cast<GlobalVariable>(base)) {
+        // The offset goes into the address when it does not fit the instruction
+        int64_t folded = isInt<16>(offset) ? offset : 0;
+        insts.push_back(MipsInst::makeAddress(AT, globalLabel(global), offset - folded));
+        return {folded, AT};
+    }
+
+    if (!regAlloc[base]) {
+        if (stackAlloc.find(base) == stackAlloc.end())
+            emitComment("\t# memory address invalid");
+        return {frameOffset(stackAlloc[base]) + offset, SP};
+    }
+
+    auto reg = regAlloc[base];
+    if (reg == V0) {
+        reg = scratch;
+        emitMem(MipsOp::LW, reg, frameOffset(stackAlloc[base]), SP);
+    }
+    return {offset, reg};
+}
+
+// Conditional branch on a comparison, without materializing the comparison.
+// Comparisons with zero use the branches comparing a register with zero, the
+// others set $at with slt or slti and branch on it.
+void MipsFunctionAsmGen::genCompareBranch(const BranchInst *branchInst,
+                                           const ICmpInst *  icmpInst,
+                                           const BasicBlock *hoistedBB)
+{
+    auto predicate = icmpInst->getPredicate();
+    auto op1       = icmpInst->getOperand(0);
+    auto op2       = icmpInst->getOperand(1);
+
+    // Keep a constant operand second
+    if (isa<ConstantInt>(op1)) {
+        std::swap(op1, op2);
+        predicate = ICmpInst::getSwappedPredicate(predicate);
+    }
+
+    auto reg1     = regAlloc[op1];
+    auto reg2     = ZERO;
+    auto constant = dyn_cast<ConstantInt>(op2);
+    if (reg1 == V0)
+        genReload(V0, op1);
+    if (!constant) {
+        reg2 = regAlloc[op2];
+        if (reg2 == V0) {
+            reg2 = V1;
+            genReload(V1, op2);
+        }
+    }
+
+    // Branches taken when the comparison holds and when it does not, comparing
+    // reg1 with reg2 or, without hasReg2, with zero
+    MipsOp branch, inverse;
+    bool   hasReg2 = true;
+    bool   isZero  = constant && constant->isZero();
+
+    if (isZero && ICmpInst::isSigned(predicate)) {
+        hasReg2 = false;
+        switch (predicate) {
+        case ICmpInst::ICMP_SLT:
+            branch = MipsOp::BLTZ, inverse = MipsOp::BGEZ;
+            break;
+        case ICmpInst::ICMP_SGE:
+            branch = MipsOp::BGEZ, inverse = MipsOp::BLTZ;
+            break;
+        case ICmpInst::ICMP_SGT:
+            branch = MipsOp::BGTZ, inverse = MipsOp::BLEZ;
+            break;
+        default:
+            branch = MipsOp::BLEZ, inverse = MipsOp::BGTZ;
+            break;
+        }
+    }
+    else if (predicate == ICmpInst::ICMP_EQ || predicate == ICmpInst::ICMP_NE
+             || isZero && predicate == ICmpInst::ICMP_ULE
+             || isZero && predicate == ICmpInst::ICMP_UGT) {
+        // x <= 0 and x > 0 unsigned are x == 0 and x != 0
+        bool isEqual = predicate == ICmpInst::ICMP_EQ || predicate == ICmpInst::ICMP_ULE;
+        branch       = isEqual ? MipsOp::BEQ : MipsOp::BNE;
+        inverse      = isEqual ? MipsOp::BNE : MipsOp::BEQ;
+        if (constant && !isZero) {
+            reg2 = V1;
+            emitImm(MipsOp::LI, V1, constant->getSExtValue());
+        }
+    }
+    else {
+        bool isSigned   = ICmpInst::isSigned(predicate);
+        auto lessThan   = isSigned ? ICmpInst::ICMP_SLT : ICmpInst::ICMP_ULT;
+        auto greaterEq  = isSigned ? ICmpInst::ICMP_SGE : ICmpInst::ICMP_UGE;
+        auto greater    = isSigned ? ICmpInst::ICMP_SGT : ICmpInst::ICMP_UGT;
+        bool isLessForm = predicate == lessThan || predicate == greaterEq;
+        bool holdsIfSet = predicate == lessThan || predicate == greater;
+
+        // x > c is the negation of x < c + 1, which may fit an immediate operand
+        int64_t imm    = 0;
+        bool    useImm = false;
+        if (constant) {
+            imm    = isSigned ? constant->getSExtValue() : constant->getZExtValue();
+            imm    = isLessForm ? imm : imm + 1;
+            useImm = imm >= (isSigned ? -32768 : 0) && imm <= 32767;
         }
-        else {
-            if (regAlloc[blockValue] == V0)
-                ss << "\tlw " << V0 << ", " << stackAlloc[blockValue] << '(' << FP
-                   << ")\n";
 
-            if (collideRegs[PHIInst] == V0)
-                ss << "\tsw " << regAlloc[blockValue] << ", " << collideStack[PHIInst]
-                   << '(' << FP << ")\n";
+        auto slt = isSigned ? MipsOp::SLT : MipsOp::SLTU;
+        if (useImm) {
+            emitImm(isSigned ? MipsOp::SLTI : MipsOp::SLTIU, AT, reg1, imm);
+            holdsIfSet ^= !isLessForm;
+        }
+        else {
+            if (constant) {
+                reg2 = V1;
+                emitImm(MipsOp::LI, V1, constant->getSExtValue());
+            }
+            if (isLessForm)
+                emit(slt, AT, reg1, reg2);
             else
-                ss << "\tmove " << collideRegs[PHIInst] << ", " << regAlloc[blockValue]
-                   << '\n';
+                emit(slt, AT, reg2, reg1);
         }
+
+        reg1    = AT;
+        reg2    = ZERO;
+        branch  = holdsIfSet ? MipsOp::BNE : MipsOp::BEQ;
+        inverse = holdsIfSet ? MipsOp::BEQ : MipsOp::BNE;
     }
 
-    for (auto pbIt = pbRange.first; pbIt != pbRange.second; pbIt++) {
-        auto PHIInst    = pbIt->second;
-        auto blockValue = PHIInst->getIncomingValueForBlock(BB);
+    auto genBranch = [&](bool isInverse) {
+        return MipsInst::make(isInverse ? inverse : branch, reg1,
+                              hasReg2 ? reg2 : MipsInst::NoReg);
+    };
+    genCondBranch(branchInst, genBranch, hoistedBB);
+}
 
-        // Save condition to temporary register when PHI collides with condition
-        if (!condSaved && cond && regAlloc[cond] != V0
-            && regAlloc[PHIInst] == regAlloc[cond]) {
-            ss << "\tmove " << V0 << ", " << regAlloc[cond] << '\n';
-            condSaved = true;
+// Multiplying by a constant with mul takes two instructions, loading the
+// multiplier and mul, and the product is ready MulCost cycles after the first
+const unsigned MulInsts = 2;
+const unsigned MulCost  = 5;
+
+// Multiplication by a constant. The multiplier is written in non-adjacent form,
+// the fewest powers of two added or subtracted, and evaluated from the highest
+// power by shifting and adding or subtracting src. This chain replaces mul when
+// it takes no more instructions, or when the product isNeeded by the next
+// instruction and the chain is done before mul would be. Intermediate values are
+// kept in $at and only the last instruction writes dst, which may be src.
+void MipsFunctionAsmGen::genMultiply(Mips32Reg dst,
+                                      Mips32Reg src,
+                                      int64_t   multiplier,
+                                      bool      isNeeded)
+{
+    int32_t  value     = int32_t(multiplier);
+    uint64_t magnitude = value < 0 ? -int64_t(value) : value;
+
+    struct Term
+    {
+        int  shift;
+        bool isNegative;
+    };
+    std::vector<Term> terms;
+    for (int shift = 0; magnitude; shift++, magnitude >>= 1) {
+        if (magnitude & 1) {
+            bool isNegative = (magnitude & 3) == 3;
+            terms.push_back({shift, isNegative});
+            magnitude = isNegative ? magnitude + 1 : magnitude - 1;
         }
+    }
+    std::reverse(terms.begin(), terms.end());
 
-        if (collideRegs[PHIInst]) {
-            if (collideRegs[PHIInst] == V0)
-                ss << "\tlw " << V0 << ", " << collideStack[blockValue] << '(' << FP
-                   << ")\n";
+    if (terms.empty()) {
+        emit(MipsOp::MOVE, dst, ZERO);
+        return;
+    }
 
-            if (regAlloc[PHIInst] == V0)
-                ss << "\tsw " << collideRegs[PHIInst] << ", " << stackAlloc[PHIInst]
-                   << '(' << FP << ")\n";
-            else
-                ss << "\tmove " << regAlloc[PHIInst] << ", " << collideRegs[PHIInst]
-                   << '\n';
+    unsigned count = 2 * (terms.size() - 1) + (terms.back().shift > 0) + (value < 0);
+    if (count > MulInsts && (!isNeeded || count >= MulCost)) {
+        if (isInt<16>(value))
+            emitImm(MipsOp::ADDIU, AT, ZERO, value);
+        else
+            emitImm(MipsOp::LI, AT, value);
+        emit(MipsOp::MUL, dst, src, AT);
+        return;
+    }
+    if (!count) {
+        emit(MipsOp::MOVE, dst, src);
+        return;
+    }
+
+    auto target = [&]() { return --count ? AT : dst; };
+    auto result = src;
+    for (size_t i = 1; i < terms.size(); i++) {
+        auto shifted = target();
+        emitImm(MipsOp::SLL, shifted, result, terms[i - 1].shift - terms[i].shift);
+        result = target();
+        emit(terms[i].isNegative ? MipsOp::SUBU : MipsOp::ADDU, result, shifted, src);
+    }
+    if (terms.back().shift > 0) {
+        auto shifted = target();
+        emitImm(MipsOp::SLL, shifted, result, terms.back().shift);
+        result = shifted;
+    }
+    if (value < 0)
+        emit(MipsOp::SUBU, target(), ZERO, result);
+}
+
+// Division and remainder. Constant divisors are replaced by shifts for powers
+// of two and by a multiplication with a magic number otherwise, the quotient
+// being built in $at with $v1 as scratch.
+void MipsFunctionAsmGen::genDivision(const BinaryOperator *I,
+                                      Mips32Reg             dividend,
+                                      Mips32Reg             divisor,
+                                      const ConstantInt *   constDivisor)
+{
+    auto opcode   = I->getOpcode();
+    bool isSigned = opcode == Instruction::SDiv || opcode == Instruction::SRem;
+    bool isRem    = opcode == Instruction::SRem || opcode == Instruction::URem;
+    auto dest     = regAlloc[I];
+    auto quotient = isRem ? AT : dest;
+
+    if (!constDivisor || constDivisor->getBitWidth() != 32 || constDivisor->isZero()) {
+        if (constDivisor) {
+            divisor = V1;
+            emitImm(MipsOp::LI, divisor, constDivisor->getSExtValue());
         }
-        else {
-            if (auto constant = dyn_cast<ConstantInt>(blockValue)) {
-                ss << "\taddiu " << regAlloc[PHIInst] << ", " << ZERO << ", "
-                   << constant->getSExtValue() << '\n';
+        emit(isSigned ? MipsOp::DIV : MipsOp::DIVU, dividend, divisor);
+        emit(isRem ? MipsOp::MFHI : MipsOp::MFLO, dest);
+        return;
+    }
 
-                if (regAlloc[PHIInst] == V0)
-                    ss << "\tsw " << V0 << ", " << stackAlloc[PHIInst] << '(' << FP
-                       << ")\n";
-            }
-            else {
-                if (regAlloc[blockValue] == V0)
-                    ss << "\tlw " << V0 << ", " << stackAlloc[blockValue] << '(' << FP
-                       << ")\n";
+    int32_t  d  = constDivisor->getSExtValue();
+    uint32_t ud = constDivisor->getZExtValue();
+    uint32_t ad = isSigned && d < 0 ? 0u - ud : ud;
 
-                if (regAlloc[PHIInst] == V0)
-                    ss << "\tsw " << regAlloc[blockValue] << ", " << stackAlloc[PHIInst]
-                       << '(' << FP << ")\n";
-                else
-                    ss << "\tmove " << regAlloc[PHIInst] << ", " << regAlloc[blockValue]
-                       << '\n';
+    if (ad == 1) {
+        if (isRem)
+            emit(MipsOp::MOVE, dest, ZERO);
+        else if (isSigned && d < 0)
+            emit(MipsOp::SUBU, dest, ZERO, dividend);
+        else
+            emit(MipsOp::MOVE, dest, dividend);
+        return;
+    }
+
+    if (isPowerOf2(ad)) {
+        int k = log2_32(ad);
+
+        if (!isSigned) {
+            if (!isRem)
+                emitImm(MipsOp::SRL, dest, dividend, k);
+            else if (ad <= 0x10000)
+                emitImm(MipsOp::ANDI, dest, dividend, ad - 1);
+            else {
+                emitImm(MipsOp::SLL, dest, dividend, 32 - k);
+                emitImm(MipsOp::SRL, dest, dest, 32 - k);
             }
+            return;
         }
+
+        // Negative dividends are biased by ad - 1 to round towards zero
+        if (k == 1)
+            emitImm(MipsOp::SRL, AT, dividend, 31);
+        else {
+            emitImm(MipsOp::SRA, AT, dividend, 31);
+            emitImm(MipsOp::SRL, AT, AT, 32 - k);
+        }
+        emit(MipsOp::ADDU, AT, dividend, AT);
+
+        if (isRem) {
+            emitImm(MipsOp::SRL, AT, AT, k);
+            emitImm(MipsOp::SLL, AT, AT, k);
+            emit(MipsOp::SUBU, dest, dividend, AT);
+        }
+        else if (d < 0) {
+            emitImm(MipsOp::SRA, AT, AT, k);
+            emit(MipsOp::SUBU, dest, ZERO, AT);
+        }
+        else
+            emitImm(MipsOp::SRA, dest, AT, k);
+        return;
+    }
+
+    if (isSigned) {
+        auto magic = signedMagic(d);
+
+        emitImm(MipsOp::LI, V1, magic.multiplier);
+        emit(MipsOp::MULT, dividend, V1);
+        emit(MipsOp::MFHI, AT);
+        if (d > 0 && magic.multiplier < 0)
+            emit(MipsOp::ADDU, AT, AT, dividend);
+        else if (d < 0 && magic.multiplier > 0)
+            emit(MipsOp::SUBU, AT, AT, dividend);
+        if (magic.shift)
+            emitImm(MipsOp::SRA, AT, AT, magic.shift);
+
+        // Round a negative quotient towards zero
+        emitImm(MipsOp::SRL, V1, AT, 31);
+        emit(MipsOp::ADDU, quotient, AT, V1);
+    }
+    else {
+        auto magic = unsignedMagic(ud);
+        int  shift = magic.needAdd ? magic.shift - 1 : magic.shift;
+
+        emitImm(MipsOp::LI, V1, (int32_t)magic.multiplier);
+        emit(MipsOp::MULTU, dividend, V1);
+        emit(MipsOp::MFHI, (magic.needAdd || shift ? AT : quotient));
+        if (magic.needAdd) {
+            emit(MipsOp::SUBU, V1, dividend, AT);
+            emitImm(MipsOp::SRL, V1, V1, 1);
+            emit(MipsOp::ADDU, (shift ? AT : quotient), V1, AT);
+        }
+        if (shift)
+            emitImm(MipsOp::SRL, quotient, AT, shift);
     }
 
-    return condSaved;
+    if (isRem) {
+        emitImm(MipsOp::LI, V1, d);
+        emit(MipsOp::MUL, AT, AT, V1);
+        emit(MipsOp::SUBU, dest, dividend, AT);
+    }
 }
 
-void MipsAssemblyGenPass::analysisLiveness(const Function *F)
+void MipsFunctionAsmGen::analysisLiveness(const Function *F)
 {
-    live.clear();
-    defs.clear();
+    TraceRecorder::Scope trace("analysisLiveness", F->getName().str());
+
+    // Number values which need a register, and basic blocks
+    liveValues.clear();
+    valueIndex.clear();
+    BBIndex.clear();
 
-    // Function argument def-use chains
     for (const auto &arg : F->args()) {
-        for (auto user : arg.users())
-            addLiveInToUserBlock(&arg, user);
+        valueIndex[&arg] = liveValues.size();
+        liveValues.push_back(&arg);
     }
 
-    // Instruction result def-use chains
+    std::vector<const BasicBlock *> blocks;
     for (const auto &BB : F->getBasicBlockList()) {
+        BBIndex[&BB] = blocks.size();
+        blocks.push_back(&BB);
+
         for (const auto &I : BB) {
             if (!needRegister(&I))
                 continue;
 
-            defs[&BB].insert(&I);
+            valueIndex[&I] = liveValues.size();
+            liveValues.push_back(&I);
+        }
+    }
+
+    unsigned valueCount = liveValues.size();
+    liveIn.assign(blocks.size(), BitVector(valueCount));
+    liveOut.assign(blocks.size(), BitVector(valueCount));
+    useSet.assign(blocks.size(), BitVector(valueCount));
+    defSet.assign(blocks.size(), BitVector(valueCount));
+
+    // Local definitions and upward-exposed uses. A PHI operand is used at the end
+    // of its incoming block, which may come after the PHI in layout order, so all
+    // definitions are collected first. Arguments are defined by the entry block.
+    for (const auto &arg : F->args())
+        defSet[0].set(valueIndex[&arg]);
 
-            for (auto user : I.users())
-                addLiveInToUserBlock(&I, user);
+    for (const auto &BB : F->getBasicBlockList()) {
+        for (const auto &I : BB) {
+            auto it = valueIndex.find(&I);
+            if (it != valueIndex.end())
+                defSet[BBIndex[&BB]].set(it->second);
         }
     }
 
-    // Back propagate variable live set until stable
-    do {
-        BBStatus.clear();
-    } while (dfsCFGLiveSet(&F->getEntryBlock()));
-}
+    for (const auto &BB : F->getBasicBlockList()) {
+        unsigned b = BBIndex[&BB];
 
-void MipsAssemblyGenPass::addLiveInToUserBlock(const Value *value, const User *user)
-{
-    if (auto PHIInst = dyn_cast<PHINode>(user)) {
-        for (const auto &incomeValue : PHIInst->incoming_values()) {
-            if (value == incomeValue) {
-                auto incomeBB = PHIInst->getIncomingBlock(incomeValue);
-                // if (auto Inst = dyn_cast<Instruction>(value)) {
-                //     if (Inst->getParent() == incomeBB)
-                //         return;
-                // }
-                live[incomeBB].insert(value);
+        for (const auto &I : BB) {
+            if (auto PHIInst = dyn_cast<PHINode>(&I)) {
+                for (unsigned i = 0; i < PHIInst->getNumIncomingValues(); i++) {
+                    int v = liveValueIndex(PHIInst->getIncomingValue(i));
+                    if (v < 0)
+                        continue;
+
+                    unsigned p = BBIndex[PHIInst->getIncomingBlock(i)];
+                    if (!defSet[p].test(v))
+                        useSet[p].set(v);
+                }
+            }
+            else {
+                for (const auto &op : I.operands()) {
+                    int v = liveValueIndex(op.get());
+                    if (v >= 0 && !defSet[b].test(v))
+                        useSet[b].set(v);
+                }
             }
         }
     }
-    else {
-        auto userInst = cast<Instruction>(user);
-        // if (auto Inst = dyn_cast<Instruction>(value)) {
-        //     if (Inst->getParent() == userInst->getParent())
-        //         return;
-        // }
-        live[userInst->getParent()].insert(value);
+
+    // Solve LiveIn(B) = Use(B) + (LiveOut(B) - Def(B)), LiveOut(B) = union LiveIn(S)
+    // for S in succ(B). The worklist starts in post order, so that successors are
+    // mostly visited before their predecessors.
+    std::deque<unsigned> worklist;
+    std::vector<bool>    inWorklist(blocks.size(), false);
+
+    for (auto BB : post_order(&F->getEntryBlock())) {
+        worklist.push_back(BBIndex[BB]);
+        inWorklist[BBIndex[BB]] = true;
+    }
+    for (unsigned b = 0; b < blocks.size(); b++) {
+        if (!inWorklist[b]) {
+            worklist.push_back(b);
+            inWorklist[b] = true;
+        }
     }
-}
 
-bool MipsAssemblyGenPass::dfsCFGLiveSet(const BasicBlock *BB)
-{
-    BBStatus[BB] = VISITED;
+    BitVector newLiveIn(valueCount);
+    while (!worklist.empty()) {
+        unsigned b = worklist.front();
+        worklist.pop_front();
+        inWorklist[b] = false;
+        stats.livenessIterations++;
 
-    bool changed = false;
-    for (auto SuccBB : successors(BB)) {
-        // Avoid processing back edge
-        if (BBStatus[SuccBB] != UNVISITED)
+        for (auto succBB : successors(blocks[b]))
+            liveOut[b] |= liveIn[BBIndex[succBB]];
+
+        newLiveIn = liveOut[b];
+        newLiveIn.reset(defSet[b]);
+        newLiveIn |= useSet[b];
+
+        if (newLiveIn == liveIn[b])
             continue;
 
-        changed |= dfsCFGLiveSet(SuccBB);
+        liveIn[b] = newLiveIn;
+        for (auto predBB : predecessors(blocks[b])) {
+            unsigned p = BBIndex[predBB];
+            if (!inWorklist[p]) {
+                worklist.push_back(p);
+                inWorklist[p] = true;
+            }
+        }
     }
+}
 
-    // Compute live for this BB using formula:
-    // Live(BB) = union(Live(S) - Defs(S)) for S in succ(BB) + Defs(BB)
-    for (auto SuccBB : successors(BB)) {
-        changed |= set_union(live[BB], set_difference(live[SuccBB], defs[SuccBB]));
-    }
+int MipsFunctionAsmGen::liveValueIndex(const Value *value)
+{
+    // Extensions and casts share the register of their operand, and folded GEPs
+    // use the register of their base
+    while (isRegisterCopy(value) || isFoldedAddress(value))
+        value = cast<Instruction>(value)->getOperand(0);
 
-    changed |= set_union(live[BB], defs[BB]);
-    BBStatus[BB] = PROCESSED;
-    return changed;
+    auto it = valueIndex.find(value);
+    return it != valueIndex.end() ? it->second : -1;
 }
 
 static RegisterPass<MipsAssemblyGenPass>
@@ -1242,7 +3049,8 @@ static RegisterPass<MipsAssemblyGenPass>
 
 }  // namespace
 
-llvm::ModulePass *createMipsAssemblyGenPass()
+llvm::ModulePass *createMipsAssemblyGenPass(const MipsAsmOptions &options,
+                                            llvm::raw_ostream *   out)
 {
-    return new MipsAssemblyGenPass;
+    return new MipsAssemblyGenPass(options, out);
 }
\ No newline at end of file
@@ -2,4 +2,30 @@
 
 #include "../../llvm.h"
 
-llvm::ModulePass *createMipsAssemblyGenPass();
\ No newline at end of file
+struct MipsAsmOptions
+{
+    // Schedule for the pipeline and fill delay slots, under ".set noreorder"
+    bool schedule = false;
+
+    // Functions generated in parallel, 0 meaning one thread per core. The output
+    // is the same for any number.
+    unsigned threads = 0;
+
+    // Annotate the output with the layout of globals and stack objects, and the
+    // registers of the values live in each basic block
+    bool comments = false;
+
+    // Encode a relocatable MIPS32 ELF object instead of writing assembly. The
+    // object is written once all functions are generated.
+    bool object = false;
+};
+
+// Layout of the data the generated code works on: little-endian MIPS32, with
+// 32-bit pointers and no integer type narrower than a register being native.
+// Optimizing under it keeps to the types the pass supports.
+const char *const MipsDataLayout = "e-m:m-p:32:32-i8:8:32-i16:16:32-i64:64-n32-S64";
+
+// Given out, each function is written to it as soon as it is generated, instead
+// of the whole program being kept for print()
+llvm::ModulePass *createMipsAssemblyGenPass(const MipsAsmOptions &options = {},
+                                            llvm::raw_ostream *   out     = nullptr);
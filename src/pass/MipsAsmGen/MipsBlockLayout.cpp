@@ -0,0 +1,129 @@
+#include "MipsBlockLayout.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+
+// Loops are assumed to iterate about ten times, as in the spill weights of the
+// register allocator
+const double LoopExitProbability = 0.1;
+
+// Integers are rarely equal
+const double EqualProbability = 0.375;
+
+struct Edge
+{
+    const BasicBlock *from, *to;
+    double            weight;  // estimated executions
+};
+
+}  // namespace
+
+double trueProbability(const BranchInst *branchInst, const LoopInfo &loopInfo)
+{
+    auto trueBB  = branchInst->getSuccessor(0);
+    auto falseBB = branchInst->getSuccessor(1);
+
+    // Leaving a loop is unlikely, and entering a deeper one likely
+    auto loop       = loopInfo.getLoopFor(branchInst->getParent());
+    bool trueExits  = loop && !loop->contains(trueBB);
+    bool falseExits = loop && !loop->contains(falseBB);
+    if (trueExits != falseExits)
+        return trueExits ? LoopExitProbability : 1 - LoopExitProbability;
+
+    unsigned trueDepth  = loopInfo.getLoopDepth(trueBB);
+    unsigned falseDepth = loopInfo.getLoopDepth(falseBB);
+    if (trueDepth != falseDepth)
+        return trueDepth > falseDepth ? 1 - LoopExitProbability : LoopExitProbability;
+
+    if (auto icmpInst = dyn_cast<ICmpInst>(branchInst->getCondition())) {
+        if (icmpInst->getPredicate() == ICmpInst::ICMP_EQ)
+            return EqualProbability;
+        if (icmpInst->getPredicate() == ICmpInst::ICMP_NE)
+            return 1 - EqualProbability;
+    }
+    return 0.5;
+}
+
+std::vector<const BasicBlock *> layoutBlocks(const Function &F, const LoopInfo &loopInfo)
+{
+    auto entryBB   = &F.getEntryBlock();
+    auto frequency = [&](const BasicBlock *BB) {
+        double weight = 1;
+        for (unsigned depth = loopInfo.getLoopDepth(BB); depth > 0; depth--)
+            weight *= 1 / LoopExitProbability;
+        return weight;
+    };
+
+    // Every block starts as a chain of its own, numbered in function order
+    DenseMap<const BasicBlock *, unsigned>          chainOf;
+    std::vector<std::vector<const BasicBlock *>>    chains;
+    std::vector<Edge>                               edges;
+    DenseMap<const BasicBlock *, std::vector<Edge>> outEdges;
+
+    for (const auto &BB : F.getBasicBlockList()) {
+        chainOf[&BB] = chains.size();
+        chains.push_back({&BB});
+
+        auto terminator = BB.getTerminator();
+        auto branchInst = dyn_cast<BranchInst>(terminator);
+        for (unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
+            double probability = 1.0 / terminator->getNumSuccessors();
+            if (branchInst && branchInst->isConditional()) {
+                probability = trueProbability(branchInst, loopInfo);
+                probability = i == 0 ? probability : 1 - probability;
+            }
+
+            Edge edge = {&BB, terminator->getSuccessor(i), frequency(&BB) * probability};
+            outEdges[&BB].push_back(edge);
+            if (edge.to != &BB && edge.to != entryBB)
+                edges.push_back(edge);
+        }
+    }
+
+    // Join chains along the heaviest edges from the tail of one chain to the head
+    // of another
+    auto heavier = [](const Edge &a, const Edge &b) { return a.weight > b.weight; };
+    std::stable_sort(edges.begin(), edges.end(), heavier);
+
+    for (const auto &edge : edges) {
+        unsigned from = chainOf[edge.from], to = chainOf[edge.to];
+        if (from == to || chains[from].back() != edge.from
+            || chains[to].front() != edge.to)
+            continue;
+
+        for (auto BB : chains[to]) {
+            chainOf[BB] = from;
+            chains[from].push_back(BB);
+        }
+        chains[to].clear();
+    }
+
+    // Place the entry chain, then repeatedly the chain most often entered from
+    // the blocks already placed, keeping loops together
+    std::vector<const BasicBlock *> layout;
+    std::vector<double>             enterWeight(chains.size(), 0);
+    std::vector<bool>               isPlaced(chains.size(), false);
+
+    for (unsigned chain = chainOf[entryBB]; chain < chains.size();) {
+        isPlaced[chain] = true;
+        for (auto BB : chains[chain]) {
+            layout.push_back(BB);
+            for (const auto &edge : outEdges[BB])
+                enterWeight[chainOf[edge.to]] += edge.weight;
+        }
+
+        unsigned next = chains.size();
+        for (unsigned c = 0; c < chains.size(); c++) {
+            if (isPlaced[c] || chains[c].empty())
+                continue;
+            if (next == chains.size() || enterWeight[c] > enterWeight[next])
+                next = c;
+        }
+        chain = next;
+    }
+
+    return layout;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "../../llvm.h"
+
+#include <vector>
+
+// Orders the basic blocks of a function for fall-through, the entry block first.
+// Edge frequencies are estimated from loop depth and static branch heuristics,
+// and blocks are chained greedily along the heaviest edges. Loops are rotated
+// this way: the latch falls into the header, and the branch back to the body is
+// the only taken branch of an iteration.
+std::vector<const llvm::BasicBlock *> layoutBlocks(const llvm::Function &F,
+                                                   const llvm::LoopInfo &loopInfo);
+
+// Static estimate of the probability that a conditional branch goes to its true
+// successor: loops are assumed to iterate, and integers to rarely be equal
+double trueProbability(const llvm::BranchInst *branchInst,
+                       const llvm::LoopInfo   &loopInfo);
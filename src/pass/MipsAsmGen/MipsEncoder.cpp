@@ -0,0 +1,681 @@
+#include "MipsEncoder.h"
+
+#include <algorithm>
+#include <tuple>
+
+using namespace llvm;
+
+namespace {
+
+const int ZERO = 0;
+const int AT   = 1;
+const int RA   = 31;
+
+// Primary opcodes
+enum {
+    SPECIAL  = 0x00,
+    REGIMM   = 0x01,
+    J        = 0x02,
+    JAL      = 0x03,
+    BEQ      = 0x04,
+    BNE      = 0x05,
+    BLEZ     = 0x06,
+    BGTZ     = 0x07,
+    ADDI     = 0x08,
+    ADDIU    = 0x09,
+    SLTI     = 0x0a,
+    SLTIU    = 0x0b,
+    ANDI     = 0x0c,
+    ORI      = 0x0d,
+    XORI     = 0x0e,
+    LUI      = 0x0f,
+    SPECIAL2 = 0x1c,
+    LB       = 0x20,
+    LH       = 0x21,
+    LW       = 0x23,
+    LBU      = 0x24,
+    LHU      = 0x25,
+    SB       = 0x28,
+    SH       = 0x29,
+    SW       = 0x2b
+};
+
+// SPECIAL function codes
+enum {
+    SLL     = 0x00,
+    SRL     = 0x02,
+    SRA     = 0x03,
+    SLLV    = 0x04,
+    SRLV    = 0x06,
+    SRAV    = 0x07,
+    JR      = 0x08,
+    JALR    = 0x09,
+    SYSCALL = 0x0c,
+    MFHI    = 0x10,
+    MFLO    = 0x12,
+    MULT    = 0x18,
+    MULTU   = 0x19,
+    DIV     = 0x1a,
+    DIVU    = 0x1b,
+    ADD     = 0x20,
+    ADDU    = 0x21,
+    SUB     = 0x22,
+    SUBU    = 0x23,
+    AND     = 0x24,
+    OR      = 0x25,
+    XOR     = 0x26,
+    NOR     = 0x27,
+    SLT     = 0x2a,
+    SLTU    = 0x2b
+};
+
+uint32_t rType(int rs, int rt, int rd, int shamt, int funct)
+{
+    return rs << 21 | rt << 16 | rd << 11 | shamt << 6 | funct;
+}
+
+uint32_t iType(int opcode, int rs, int rt, uint32_t imm)
+{
+    return opcode << 26 | rs << 21 | rt << 16 | (imm & 0xffff);
+}
+
+// Immediate forms, and the register form used when the immediate does not fit
+struct ImmediateOp
+{
+    int  primary;
+    bool isSigned;
+    int  funct;
+};
+
+bool immediateOp(MipsOp opcode, ImmediateOp &op)
+{
+    switch (opcode) {
+    case MipsOp::ADDIU: op = {ADDIU, true, ADDU}; return true;
+    case MipsOp::ADDI: op = {ADDI, true, ADD}; return true;
+    case MipsOp::SLTI: op = {SLTI, true, SLT}; return true;
+    case MipsOp::SLTIU: op = {SLTIU, true, SLTU}; return true;
+    case MipsOp::ANDI: op = {ANDI, false, AND}; return true;
+    case MipsOp::ORI: op = {ORI, false, OR}; return true;
+    case MipsOp::XORI: op = {XORI, false, XOR}; return true;
+    default: return false;
+    }
+}
+
+// Function code of instructions "op rd, rs, rt", and of the variable shifts
+// "op rd, rt, rs"
+int threeRegFunct(MipsOp opcode)
+{
+    switch (opcode) {
+    case MipsOp::ADDU: return ADDU;
+    case MipsOp::ADD: return ADD;
+    case MipsOp::SUBU: return SUBU;
+    case MipsOp::SUB: return SUB;
+    case MipsOp::AND: return AND;
+    case MipsOp::OR: return OR;
+    case MipsOp::XOR: return XOR;
+    case MipsOp::NOR: return NOR;
+    case MipsOp::SLT: return SLT;
+    case MipsOp::SLTU: return SLTU;
+    case MipsOp::SLLV: return SLLV;
+    case MipsOp::SRLV: return SRLV;
+    case MipsOp::SRAV: return SRAV;
+    default: return -1;
+    }
+}
+
+int memoryOpcode(MipsOp opcode)
+{
+    switch (opcode) {
+    case MipsOp::LB: return LB;
+    case MipsOp::LH: return LH;
+    case MipsOp::LW: return LW;
+    case MipsOp::LBU: return LBU;
+    case MipsOp::LHU: return LHU;
+    case MipsOp::SB: return SB;
+    case MipsOp::SH: return SH;
+    case MipsOp::SW: return SW;
+    default: return -1;
+    }
+}
+
+}  // namespace
+
+bool MipsObjectWriter::encode(const MipsInst &        inst,
+                              std::vector<uint32_t> &words,
+                              std::vector<Fixup> &   fixups)
+{
+    int     r0 = inst.regs[0], r1 = inst.regs[1], r2 = inst.regs[2];
+    int64_t value = inst.imm;
+
+    auto emit  = [&](uint32_t word) { words.push_back(word); };
+    auto refer = [&](FixupKind kind) {
+        fixups.push_back({uint32_t(words.size()), kind, inst.symbol, inst.imm});
+    };
+
+    auto loadImmediate = [&](int rd, int64_t value) {
+        uint32_t word = value;
+        if (isInt<16>(value))
+            emit(iType(ADDIU, ZERO, rd, word));
+        else if (isUInt<16>(value))
+            emit(iType(ORI, ZERO, rd, word));
+        else {
+            emit(iType(LUI, ZERO, rd, word >> 16));
+            if (word & 0xffff)
+                emit(iType(ORI, rd, rd, word));
+        }
+    };
+
+    if (!isInt<32>(value) && !isUInt<32>(value))
+        return false;
+
+    int funct = threeRegFunct(inst.opcode);
+    if (funct >= 0) {
+        bool isShift = funct == SLLV || funct == SRLV || funct == SRAV;
+        emit(isShift ? rType(r2, r1, r0, 0, funct) : rType(r1, r2, r0, 0, funct));
+        return true;
+    }
+
+    // %gp_rel(label+offset) operands are left to the linker
+    bool isGpRel = !inst.symbol.empty();
+
+    ImmediateOp immOp;
+    if (immediateOp(inst.opcode, immOp)) {
+        if (isGpRel) {
+            if (immOp.primary != ADDIU || !isInt<16>(value))
+                return false;
+            refer(GpRel16);
+            emit(iType(ADDIU, r1, r0, 0));
+        }
+        else if (immOp.isSigned ? isInt<16>(value) : isUInt<16>(value))
+            emit(iType(immOp.primary, r1, r0, value));
+        else if (r1 == ZERO && immOp.funct != AND && immOp.funct < SLT)
+            loadImmediate(r0, value);
+        else if (r1 == AT)
+            return false;
+        else {
+            loadImmediate(AT, value);
+            emit(rType(r1, AT, r0, 0, immOp.funct));
+        }
+        return true;
+    }
+
+    int memOpcode = memoryOpcode(inst.opcode);
+    if (memOpcode >= 0) {
+        int base = r1;
+        if (isGpRel) {
+            if (!isInt<16>(value))
+                return false;
+            refer(GpRel16);
+            emit(iType(memOpcode, base, r0, 0));
+        }
+        else if (isInt<16>(value))
+            emit(iType(memOpcode, base, r0, value));
+        else if (base == AT)
+            return false;
+        else {
+            emit(iType(LUI, ZERO, AT, (value + 0x8000) >> 16));
+            emit(rType(AT, base, AT, 0, ADDU));
+            emit(iType(memOpcode, AT, r0, value));
+        }
+        return true;
+    }
+
+    switch (inst.opcode) {
+    case MipsOp::SLL: emit(rType(ZERO, r1, r0, value & 31, SLL)); break;
+    case MipsOp::SRL: emit(rType(ZERO, r1, r0, value & 31, SRL)); break;
+    case MipsOp::SRA: emit(rType(ZERO, r1, r0, value & 31, SRA)); break;
+    case MipsOp::MUL: emit(SPECIAL2 << 26 | rType(r1, r2, r0, 0, 0x02)); break;
+    case MipsOp::MOVE: emit(rType(r1, ZERO, r0, 0, ADDU)); break;
+    case MipsOp::NOT: emit(rType(r1, ZERO, r0, 0, NOR)); break;
+    case MipsOp::NEGU: emit(rType(ZERO, r1, r0, 0, SUBU)); break;
+    case MipsOp::LUI: emit(iType(LUI, ZERO, r0, value)); break;
+    case MipsOp::LI: loadImmediate(r0, value); break;
+    case MipsOp::LA:
+        refer(Hi16);
+        emit(iType(LUI, ZERO, r0, 0));
+        refer(Lo16);
+        emit(iType(ADDIU, r0, r0, 0));
+        break;
+    case MipsOp::BEQ:
+    case MipsOp::BNE:
+        refer(Branch16);
+        emit(iType(inst.opcode == MipsOp::BEQ ? BEQ : BNE, r0, r1, 0));
+        break;
+    case MipsOp::BLEZ:
+    case MipsOp::BGTZ:
+        refer(Branch16);
+        emit(iType(inst.opcode == MipsOp::BLEZ ? BLEZ : BGTZ, r0, ZERO, 0));
+        break;
+    case MipsOp::BLTZ:
+    case MipsOp::BGEZ:
+        refer(Branch16);
+        emit(iType(REGIMM, r0, inst.opcode == MipsOp::BLTZ ? 0x00 : 0x01, 0));
+        break;
+    case MipsOp::J:
+    case MipsOp::JAL:
+        refer(Jump26);
+        emit((inst.opcode == MipsOp::J ? J : JAL) << 26);
+        break;
+    case MipsOp::JR: emit(rType(r0, ZERO, ZERO, 0, JR)); break;
+    case MipsOp::JALR: emit(rType(r0, ZERO, RA, 0, JALR)); break;
+    case MipsOp::MULT: emit(rType(r0, r1, ZERO, 0, MULT)); break;
+    case MipsOp::MULTU: emit(rType(r0, r1, ZERO, 0, MULTU)); break;
+    case MipsOp::DIV: emit(rType(r0, r1, ZERO, 0, DIV)); break;
+    case MipsOp::DIVU: emit(rType(r0, r1, ZERO, 0, DIVU)); break;
+    case MipsOp::MFHI: emit(rType(ZERO, ZERO, r0, 0, MFHI)); break;
+    case MipsOp::MFLO: emit(rType(ZERO, ZERO, r0, 0, MFLO)); break;
+    case MipsOp::SYSCALL: emit(rType(ZERO, ZERO, ZERO, 0, SYSCALL)); break;
+    case MipsOp::NOP: emit(0); break;
+    default: return false;
+    }
+    return true;
+}
+
+unsigned encodedWords(const MipsInst &inst)
+{
+    if (!inst.isInstruction())
+        return 0;
+
+    std::vector<uint32_t>                 words;
+    std::vector<MipsObjectWriter::Fixup> fixups;
+    MipsObjectWriter::encode(inst, words, fixups);
+    return words.size();
+}
+
+void MipsObjectWriter::addText(const MipsInstList &insts)
+{
+    auto &                section = sections[MipsData::Text];
+    std::vector<uint32_t> words;
+    std::vector<Fixup>    instFixups;
+
+    auto append = [&](uint32_t word) {
+        for (unsigned i = 0; i < 4; i++)
+            section.bytes.push_back(uint8_t(word >> 8 * i));
+        section.size += 4;
+    };
+
+    for (const auto &inst : insts) {
+        if (inst.kind == MipsInst::Label) {
+            labels[inst.symbol] = {MipsData::Text, section.size, 0};
+            continue;
+        }
+        if (!inst.isInstruction())
+            continue;
+
+        words.clear();
+        instFixups.clear();
+        if (!encode(inst, words, instFixups)) {
+            std::string        line;
+            raw_string_ostream os(line);
+            inst.print(os);
+            errors.push_back("cannot encode instruction: "
+                             + StringRef(os.str()).trim().str());
+            continue;
+        }
+
+        for (auto &fixup : instFixups) {
+            fixup.offset = section.size + 4 * fixup.offset;
+            section.fixups.push_back(std::move(fixup));
+        }
+        for (uint32_t word : words)
+            append(word);
+
+        // Without ".set noreorder" the delay slot is the assembler's to fill
+        bool hasDelaySlot = inst.isBranch() || inst.isJump()
+                            || inst.opcode == MipsOp::JAL || inst.opcode == MipsOp::JALR;
+        if (hasDelaySlot && !noReorder)
+            append(0);
+    }
+}
+
+void MipsObjectWriter::addData(const MipsData &object)
+{
+    auto &section = sections[object.section];
+    auto  size    = uint32_t(object.bytes.size());
+    bool  isBss   = object.section == MipsData::SmallBss
+                  || object.section == MipsData::Bss;
+
+    section.align = std::max<uint32_t>(section.align, object.align);
+    section.size  = alignTo(section.size, object.align);
+    if (!isBss)
+        section.bytes.resize(section.size);
+
+    labels[object.label] = {object.section, section.size, size};
+    if (object.isGlobal)
+        exported.insert(object.label);
+
+    for (const auto &address : object.addresses)
+        section.fixups.push_back({uint32_t(section.size + address.first), Word32,
+                                  address.second.label, address.second.addend});
+
+    if (!isBss)
+        section.bytes.insert(section.bytes.end(), object.bytes.begin(),
+                             object.bytes.end());
+    else if (!object.addresses.empty()
+             || std::any_of(object.bytes.begin(), object.bytes.end(),
+                            [](uint8_t byte) { return byte != 0; }))
+        errors.push_back("initialized data in a .bss section: " + object.label);
+    section.size += size;
+}
+
+bool MipsObjectWriter::write(raw_ostream &os, std::string &error)
+{
+    using namespace ELF;
+
+    if (!errors.empty()) {
+        error = errors.front();
+        return false;
+    }
+
+    struct SectionInfo
+    {
+        const char *name;
+        uint32_t    type, flags;
+    };
+    const SectionInfo Infos[MipsData::SectionCount] = {
+        {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR},
+        {".sdata", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE | SHF_MIPS_GPREL},
+        {".sbss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE | SHF_MIPS_GPREL},
+        {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE},
+        {".rodata", SHT_PROGBITS, SHF_ALLOC},
+        {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE}};
+
+    struct SectionHeader
+    {
+        uint32_t    name, type, flags, addr, offset, size, link, info, addralign, entsize;
+        std::string contents;
+    };
+    std::vector<SectionHeader> headers(1);
+    std::string                shstrtab(1, '\0');
+
+    auto addSection = [&](StringRef name, uint32_t type, uint32_t flags, uint32_t size,
+                          uint32_t align) {
+        SectionHeader header = {};
+        header.name          = shstrtab.size();
+        header.type          = type;
+        header.flags         = flags;
+        header.size          = size;
+        header.addralign     = align;
+        shstrtab += name.str() + '\0';
+        headers.push_back(std::move(header));
+        return headers.size() - 1;
+    };
+
+    // Sections with contents, .text always
+    sections[MipsData::Text].align = 4;
+    unsigned sectionIndex[MipsData::SectionCount] = {};
+    for (int kind = MipsData::Text; kind < MipsData::SectionCount; kind++) {
+        const auto &section = sections[kind];
+        if (kind != MipsData::Text && !section.size)
+            continue;
+        sectionIndex[kind] = addSection(Infos[kind].name, Infos[kind].type,
+                                        Infos[kind].flags, section.size, section.align);
+    }
+
+    struct Symbol
+    {
+        uint32_t name, value, size;
+        uint8_t  info;
+        uint16_t section;
+    };
+    std::vector<Symbol> symbols;
+    std::string         strtab(1, '\0');
+    StringMap<unsigned> symbolIndex;
+
+    auto addSymbol = [&](StringRef name, uint32_t value, uint32_t size, uint8_t binding,
+                         uint8_t type, uint16_t section) {
+        uint32_t nameOffset = 0;
+        if (!name.empty()) {
+            nameOffset = strtab.size();
+            strtab += name.str() + '\0';
+            symbolIndex[name] = symbols.size();
+        }
+        symbols.push_back(
+            {nameOffset, value, size, uint8_t(binding << 4 | type), section});
+    };
+
+    // Data objects have the size they were added with, functions extend to the
+    // next function in .text, or to its end
+    struct Definition
+    {
+        SectionKind section;
+        uint32_t    offset;
+        StringRef   name;
+        uint32_t    size;
+        bool        isGlobal;
+
+        bool operator<(const Definition &other) const
+        {
+            return std::tie(section, offset, name)
+                   < std::tie(other.section, other.offset, other.name);
+        }
+    };
+    std::vector<Definition> definitions;
+    for (const auto &label : labels) {
+        const auto &value    = label.getValue();
+        bool        isObject = value.section != MipsData::Text;
+        if (isObject || label.getKey().startswith("F_"))
+            definitions.push_back({value.section, value.offset, label.getKey(),
+                                   value.size,
+                                   !isObject || exported.count(label.getKey())});
+    }
+    std::sort(definitions.begin(), definitions.end());
+    for (size_t i = 0; i < definitions.size(); i++) {
+        auto &definition = definitions[i];
+        if (definition.section != MipsData::Text)
+            continue;
+
+        bool isLast = i + 1 == definitions.size()
+                      || definitions[i + 1].section != definition.section;
+        definition.size = (isLast ? sections[definition.section].size
+                                  : definitions[i + 1].offset)
+                          - definition.offset;
+    }
+
+    // Local symbols come first: the sections, then local objects
+    unsigned sectionSymbol[MipsData::SectionCount] = {};
+    addSymbol("", 0, 0, STB_LOCAL, STT_NOTYPE, SHN_UNDEF);
+    for (int kind = MipsData::Text; kind < MipsData::SectionCount; kind++) {
+        if (sectionIndex[kind]) {
+            sectionSymbol[kind] = symbols.size();
+            addSymbol("", 0, 0, STB_LOCAL, STT_SECTION, sectionIndex[kind]);
+        }
+    }
+    for (bool isGlobal : {false, true}) {
+        for (const auto &definition : definitions) {
+            if (definition.isGlobal == isGlobal)
+                addSymbol(definition.name, definition.offset, definition.size,
+                          isGlobal ? STB_GLOBAL : STB_LOCAL,
+                          definition.section == MipsData::Text ? STT_FUNC : STT_OBJECT,
+                          sectionIndex[definition.section]);
+        }
+    }
+    unsigned firstGlobal = symbols.size();
+    for (const auto &definition : definitions)
+        firstGlobal -= definition.isGlobal;
+
+    // Branches are resolved here, other references become relocations. Calls to
+    // functions refer to their symbol, other labels to their section with the
+    // offset of the label as addend. $gp-relative references refer to the symbol
+    // of their object, whose offset from $gp only the linker knows.
+    for (int kind = MipsData::Text; kind < MipsData::SectionCount; kind++) {
+        auto &                                     section = sections[kind];
+        std::vector<std::pair<uint32_t, uint32_t>> relocations;  // offset, info
+
+        for (const auto &fixup : section.fixups) {
+            uint8_t *place = section.bytes.data() + fixup.offset;
+            uint32_t word  = support::endian::read32le(place);
+
+            StringRef name   = fixup.label;
+            int64_t   addend = fixup.addend;
+
+            auto label   = labels.find(name);
+            bool isLabel = label != labels.end();
+            bool isCall  = name.startswith("F_") && addend == 0
+                          && (fixup.kind == Jump26 || fixup.kind == Word32);
+            if (!isLabel && !isCall) {
+                error = "undefined label " + name.str();
+                return false;
+            }
+
+            unsigned symbol = 0;
+            uint32_t value  = 0;
+            if (isCall) {
+                if (!symbolIndex.count(name))
+                    addSymbol(name, 0, 0, STB_GLOBAL, STT_NOTYPE, SHN_UNDEF);
+                symbol = symbolIndex[name];
+            }
+            else if (isLabel) {
+                symbol = sectionSymbol[label->getValue().section];
+                value  = label->getValue().offset + addend;
+            }
+
+            unsigned type = R_MIPS_NONE;
+            switch (fixup.kind) {
+            case Branch16: {
+                int64_t delta = (int64_t(value) - fixup.offset - 4) / 4;
+                if (label->getValue().section != MipsData::Text || !isInt<16>(delta)) {
+                    error = "branch target out of range: " + fixup.label;
+                    return false;
+                }
+                word |= delta & 0xffff;
+                break;
+            }
+            case Jump26:
+                type = R_MIPS_26;
+                word |= (value >> 2) & 0x3ffffff;
+                break;
+            case Hi16:
+                type = R_MIPS_HI16;
+                word |= ((value + 0x8000) >> 16) & 0xffff;
+                break;
+            case Lo16:
+                type = R_MIPS_LO16;
+                word |= value & 0xffff;
+                break;
+            case Word32:
+                type = R_MIPS_32;
+                word = value;
+                break;
+            case GpRel16: {
+                auto target = label->getValue().section;
+                if (target != MipsData::SmallData && target != MipsData::SmallBss) {
+                    error = "$gp-relative reference outside small data: " + fixup.label;
+                    return false;
+                }
+                type   = R_MIPS_GPREL16;
+                symbol = symbolIndex[name];
+                word   = (word & 0xffff0000) | (addend & 0xffff);
+                break;
+            }
+            }
+
+            support::endian::write32le(place, word);
+            if (type != R_MIPS_NONE)
+                relocations.push_back({fixup.offset, symbol << 8 | type});
+        }
+
+        if (sectionIndex[kind])
+            headers[sectionIndex[kind]].contents.assign(section.bytes.begin(),
+                                                        section.bytes.end());
+        if (relocations.empty())
+            continue;
+
+        addSection((".rel" + Twine(Infos[kind].name)).str(), SHT_REL, SHF_INFO_LINK,
+                   8 * relocations.size(), 4);
+        headers.back().info    = sectionIndex[kind];
+        headers.back().entsize = 8;
+
+        raw_string_ostream      contents(headers.back().contents);
+        support::endian::Writer out(contents, support::little);
+        for (const auto &relocation : relocations) {
+            out.write<uint32_t>(relocation.first);
+            out.write<uint32_t>(relocation.second);
+        }
+    }
+
+    unsigned symtabIndex = addSection(".symtab", SHT_SYMTAB, 0, 16 * symbols.size(), 4);
+    unsigned strtabIndex = addSection(".strtab", SHT_STRTAB, 0, strtab.size(), 1);
+    headers[symtabIndex].info    = firstGlobal;
+    headers[symtabIndex].entsize = 16;
+    headers[symtabIndex].link    = strtabIndex;
+    headers[strtabIndex].contents = strtab;
+    for (auto &header : headers) {
+        if (header.type == SHT_REL)
+            header.link = symtabIndex;
+    }
+    {
+        raw_string_ostream      contents(headers[symtabIndex].contents);
+        support::endian::Writer out(contents, support::little);
+        for (const auto &symbol : symbols) {
+            out.write<uint32_t>(symbol.name);
+            out.write<uint32_t>(symbol.value);
+            out.write<uint32_t>(symbol.size);
+            out.write<uint8_t>(symbol.info);
+            out.write<uint8_t>(STV_DEFAULT);
+            out.write<uint16_t>(symbol.section);
+        }
+    }
+
+    // The name of .shstrtab is part of its contents
+    unsigned shstrtabIndex = addSection(".shstrtab", SHT_STRTAB, 0, 0, 1);
+    headers[shstrtabIndex].size     = shstrtab.size();
+    headers[shstrtabIndex].contents = shstrtab;
+
+    uint32_t offset = sizeof(Elf32_Ehdr);
+    for (auto &header : headers) {
+        if (!header.addralign)
+            continue;
+        offset        = alignTo(offset, header.addralign);
+        header.offset = offset;
+        if (header.type != SHT_NOBITS)
+            offset += header.size;
+    }
+    uint32_t sectionHeaderOffset = alignTo(offset, 4);
+
+    support::endian::Writer out(os, support::little);
+
+    os << "\x7f" "ELF";
+    out.write<uint8_t>(ELFCLASS32);
+    out.write<uint8_t>(ELFDATA2LSB);
+    out.write<uint8_t>(EV_CURRENT);
+    os.write_zeros(EI_NIDENT - EI_OSABI);
+    out.write<uint16_t>(ET_REL);
+    out.write<uint16_t>(EM_MIPS);
+    out.write<uint32_t>(EV_CURRENT);
+    out.write<uint32_t>(0);  // entry
+    out.write<uint32_t>(0);  // program headers
+    out.write<uint32_t>(sectionHeaderOffset);
+    out.write<uint32_t>(EF_MIPS_ARCH_32 | EF_MIPS_ABI_O32
+                        | (noReorder ? EF_MIPS_NOREORDER : 0));
+    out.write<uint16_t>(sizeof(Elf32_Ehdr));
+    out.write<uint16_t>(0);  // program header size
+    out.write<uint16_t>(0);  // program header count
+    out.write<uint16_t>(sizeof(Elf32_Shdr));
+    out.write<uint16_t>(headers.size());
+    out.write<uint16_t>(shstrtabIndex);
+
+    uint64_t written = sizeof(Elf32_Ehdr);
+    for (const auto &header : headers) {
+        if (header.type == SHT_NULL || header.type == SHT_NOBITS)
+            continue;
+        os.write_zeros(header.offset - written);
+        os << header.contents;
+        written = header.offset + header.contents.size();
+    }
+    os.write_zeros(sectionHeaderOffset - written);
+
+    for (const auto &header : headers) {
+        out.write<uint32_t>(header.name);
+        out.write<uint32_t>(header.type);
+        out.write<uint32_t>(header.flags);
+        out.write<uint32_t>(header.addr);
+        out.write<uint32_t>(header.offset);
+        out.write<uint32_t>(header.size);
+        out.write<uint32_t>(header.link);
+        out.write<uint32_t>(header.info);
+        out.write<uint32_t>(header.addralign);
+        out.write<uint32_t>(header.entsize);
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "MipsInst.h"
+
+// Machine words an instruction assembles to: 0 for labels and comments, more
+// than one for pseudo instructions and for immediates or offsets not fitting
+// their field, which are expanded through $at as an assembler does
+unsigned encodedWords(const MipsInst &inst);
+
+// Encoder of a program into a relocatable little-endian MIPS32 ELF object, from
+// its instruction lists and data objects. Labels are resolved across all text
+// added: branches are encoded PC-relative, jumps and label addresses get
+// relocations against their section, and references to functions not defined in
+// the object remain undefined symbols. Small data lives in .sdata and .sbss and
+// is addressed from $gp, through R_MIPS_GPREL16 relocations against its objects,
+// wherever the linker places $gp. Unless the text is scheduled, a nop fills the
+// delay slot of every branch, jump and call.
+class MipsObjectWriter
+{
+public:
+    // Whether the text added fills its own delay slots, as under ".set noreorder"
+    void setNoReorder(bool value) { noReorder = value; }
+
+    // Appends instructions to .text. "F_" labels become function symbols, and
+    // comments are skipped.
+    void addText(const MipsInstList &insts);
+
+    // Appends a data object to its section, its label becoming an object symbol of
+    // its size
+    void addData(const MipsData &object);
+
+    // Writes the object, or returns false and describes the first problem in
+    // error: instructions with bad operands, undefined labels and unreachable
+    // branch targets
+    bool write(llvm::raw_ostream &os, std::string &error);
+
+private:
+    typedef MipsData::Section SectionKind;
+
+    enum FixupKind { Branch16, Jump26, Hi16, Lo16, GpRel16, Word32 };
+
+    struct Fixup
+    {
+        uint32_t    offset;  // of the instruction or word in its section
+        FixupKind   kind;
+        std::string label;
+        int64_t     addend;
+    };
+
+    struct Section
+    {
+        std::vector<uint8_t> bytes;  // contents, except for .sbss and .bss
+        uint32_t             size  = 0;
+        uint32_t             align = 1;
+        std::vector<Fixup>   fixups;
+    };
+
+    struct Label
+    {
+        SectionKind section;
+        uint32_t    offset;
+        uint32_t    size;  // of a data object, 0 for text labels
+    };
+
+    Section                  sections[MipsData::SectionCount];
+    llvm::StringMap<Label>   labels;
+    llvm::StringSet<>        exported;  // global data objects
+    bool                     noReorder = false;
+    std::vector<std::string> errors;
+
+    // Words and fixups of one instruction, fixup offsets counting words. Returns
+    // false for operands not fitting the instruction.
+    static bool encode(const MipsInst &        inst,
+                       std::vector<uint32_t> &words,
+                       std::vector<Fixup> &   fixups);
+
+    friend unsigned encodedWords(const MipsInst &inst);
+};
@@ -0,0 +1,375 @@
+#include "MipsInst.h"
+
+using namespace llvm;
+
+namespace {
+
+const char *RegNames[32] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+                            "t0",   "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+                            "s0",   "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+                            "t8",   "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
+
+const uint64_t CallerSavedRegs = 0x0f00fffe;  // at, v0-v1, a0-a3, t0-t9, k0-k1
+
+struct OpcodeInfo
+{
+    const char *mnemonic;
+    const char *roles;
+};
+
+// Indexed by MipsOp
+const OpcodeInfo Opcodes[] = {
+    {"addu", "duu"},  {"subu", "duu"},  {"add", "duu"},   {"sub", "duu"},
+    {"and", "duu"},   {"or", "duu"},    {"xor", "duu"},   {"nor", "duu"},
+    {"slt", "duu"},   {"sltu", "duu"},  {"mul", "duu"},   {"sllv", "duu"},
+    {"srlv", "duu"},  {"srav", "duu"},  {"addiu", "dui"}, {"addi", "dui"},
+    {"andi", "dui"},  {"ori", "dui"},   {"xori", "dui"},  {"slti", "dui"},
+    {"sltiu", "dui"}, {"sll", "dui"},   {"srl", "dui"},   {"sra", "dui"},
+    {"move", "du"},   {"negu", "du"},   {"not", "du"},    {"lui", "di"},
+    {"li", "di"},     {"la", "dl"},     {"lw", "dm"},     {"lh", "dm"},
+    {"lhu", "dm"},    {"lb", "dm"},     {"lbu", "dm"},    {"sw", "um"},
+    {"sh", "um"},     {"sb", "um"},     {"beq", "uul"},   {"bne", "uul"},
+    {"blez", "ul"},   {"bgtz", "ul"},   {"bltz", "ul"},   {"bgez", "ul"},
+    {"j", "l"},       {"jr", "u"},      {"jal", "l"},     {"jalr", "u"},
+    {"mult", "uu"},   {"multu", "uu"},  {"div", "uu"},    {"divu", "uu"},
+    {"mfhi", "d"},    {"mflo", "d"},    {"syscall", ""},  {"nop", ""}};
+
+static_assert(sizeof(Opcodes) / sizeof(Opcodes[0]) == size_t(MipsOp::NOP) + 1,
+              "every opcode has a mnemonic and roles");
+
+}  // namespace
+
+MipsInst MipsInst::make(MipsOp opcode, int r0, int r1, int r2)
+{
+    MipsInst inst;
+    inst.opcode  = opcode;
+    inst.regs[0] = r0;
+    inst.regs[1] = r1;
+    inst.regs[2] = r2;
+    return inst;
+}
+
+MipsInst MipsInst::makeImm(MipsOp opcode, int r0, int r1, int64_t imm)
+{
+    MipsInst inst = make(opcode, r0, r1);
+    inst.imm      = imm;
+    return inst;
+}
+
+MipsInst MipsInst::makeImm(MipsOp opcode, int r0, int64_t imm)
+{
+    MipsInst inst = make(opcode, r0);
+    inst.imm      = imm;
+    return inst;
+}
+
+MipsInst MipsInst::makeMem(MipsOp    opcode,
+                           int       reg,
+                           int64_t   offset,
+                           int       base,
+                           StringRef symbol)
+{
+    MipsInst inst = make(opcode, reg, base);
+    inst.imm      = offset;
+    inst.symbol   = symbol.str();
+    return inst;
+}
+
+MipsInst MipsInst::makeBranch(MipsOp opcode, StringRef target, int r0, int r1)
+{
+    MipsInst inst = make(opcode, r0, r1);
+    inst.symbol   = target.str();
+    return inst;
+}
+
+MipsInst MipsInst::makeAddress(int reg, StringRef label, int64_t offset)
+{
+    MipsInst inst = makeBranch(MipsOp::LA, label, reg);
+    inst.imm      = offset;
+    return inst;
+}
+
+MipsInst MipsInst::makeGpAddress(int reg, StringRef label, int64_t offset)
+{
+    MipsInst inst = makeImm(MipsOp::ADDIU, reg, 28, offset);  // $gp
+    inst.symbol   = label.str();
+    return inst;
+}
+
+MipsInst MipsInst::makeLabel(StringRef name)
+{
+    MipsInst inst;
+    inst.kind   = Label;
+    inst.symbol = name.str();
+    return inst;
+}
+
+MipsInst MipsInst::makeComment(StringRef text)
+{
+    MipsInst inst;
+    inst.kind   = Comment;
+    inst.symbol = text.str();
+    return inst;
+}
+
+void MipsInst::print(raw_ostream &os) const
+{
+    switch (kind) {
+    case Label: os << symbol << ":\n"; return;
+    case Comment: os << symbol << '\n'; return;
+    case Instruction: break;
+    }
+
+    auto printLabel = [&]() {
+        os << symbol;
+        if (imm > 0)
+            os << '+';
+        if (imm)
+            os << imm;
+    };
+    auto printImm = [&]() {
+        if (symbol.empty()) {
+            os << imm;
+            return;
+        }
+        os << "%gp_rel(";
+        printLabel();
+        os << ')';
+    };
+
+    auto r = roles();
+    os << '\t' << Opcodes[size_t(opcode)].mnemonic;
+    for (size_t i = 0; r[i]; i++) {
+        os << (i ? ", " : " ");
+        switch (r[i]) {
+        case 'd':
+        case 'u': os << '$' << RegNames[regs[i]]; break;
+        case 'i': printImm(); break;
+        case 'm':
+            printImm();
+            os << "($" << RegNames[regs[i]] << ')';
+            break;
+        case 'l': printLabel(); break;
+        }
+    }
+    os << '\n';
+}
+
+const char *MipsInst::regName(int reg)
+{
+    return RegNames[reg];
+}
+
+const char *MipsInst::roles() const
+{
+    return kind == Instruction ? Opcodes[size_t(opcode)].roles : nullptr;
+}
+
+bool MipsInst::isBranch() const
+{
+    return kind == Instruction && opcode >= MipsOp::BEQ && opcode <= MipsOp::BGEZ;
+}
+
+bool MipsInst::isJump() const
+{
+    return kind == Instruction && (opcode == MipsOp::J || opcode == MipsOp::JR);
+}
+
+bool MipsInst::isReturn() const
+{
+    return kind == Instruction && opcode == MipsOp::JR && regs[0] == 31;  // $ra
+}
+
+bool MipsInst::isCall() const
+{
+    return kind == Instruction
+           && (opcode == MipsOp::JAL || opcode == MipsOp::JALR
+               || opcode == MipsOp::SYSCALL);
+}
+
+bool MipsInst::isLoad() const
+{
+    return kind == Instruction && opcode >= MipsOp::LW && opcode <= MipsOp::LBU;
+}
+
+bool MipsInst::isStore() const
+{
+    return kind == Instruction && opcode >= MipsOp::SW && opcode <= MipsOp::SB;
+}
+
+bool MipsInst::hasSideEffects() const
+{
+    auto r = roles();
+    return !r || r[0] != 'd' || isCall();
+}
+
+StringRef MipsInst::target() const
+{
+    if (!isBranch() && opcode != MipsOp::J)
+        return StringRef();
+    return symbol;
+}
+
+uint64_t MipsInst::uses() const
+{
+    auto r = roles();
+    if (!r)
+        return 0;
+
+    uint64_t mask = 0;
+    for (size_t i = 0; r[i]; i++) {
+        if ((r[i] == 'u' || r[i] == 'm') && regs[i] > 0)
+            mask |= 1ULL << regs[i];
+    }
+
+    switch (opcode) {
+    case MipsOp::JAL:
+    case MipsOp::JALR: mask |= 0xf0ULL | 1ULL << 29; break;  // a0-a3, sp
+    case MipsOp::SYSCALL: mask |= 0x34ULL; break;            // v0, a0, a1
+    case MipsOp::MFHI: mask |= 1ULL << HI; break;
+    case MipsOp::MFLO: mask |= 1ULL << LO; break;
+    default: break;
+    }
+    return mask;
+}
+
+uint64_t MipsInst::defs() const
+{
+    auto r = roles();
+    if (!r)
+        return 0;
+
+    uint64_t mask = 0;
+    if (r[0] == 'd' && regs[0] > 0)
+        mask |= 1ULL << regs[0];
+
+    switch (opcode) {
+    case MipsOp::JAL:
+    case MipsOp::JALR:
+        mask |= CallerSavedRegs | 1ULL << 31 | 1ULL << HI | 1ULL << LO;
+        break;
+    case MipsOp::SYSCALL: mask |= 1ULL << 2; break;
+    case MipsOp::MULT:
+    case MipsOp::MULTU:
+    case MipsOp::DIV:
+    case MipsOp::DIVU: mask |= 1ULL << HI | 1ULL << LO; break;
+    default: break;
+    }
+    return mask;
+}
+
+bool MipsInst::replaceUse(int from, int to)
+{
+    auto r = roles();
+    if (!r)
+        return false;
+
+    bool replaced = false;
+    for (size_t i = 0; r[i]; i++) {
+        if ((r[i] == 'u' || r[i] == 'm') && regs[i] == from) {
+            regs[i]  = to;
+            replaced = true;
+        }
+    }
+    return replaced;
+}
+
+void printMipsAsm(raw_ostream &os, const MipsInstList &insts)
+{
+    for (const auto &inst : insts)
+        inst.print(os);
+}
+
+const char *MipsData::sectionName(Section section)
+{
+    static const char *Names[SectionCount] = {".text", ".sdata",  ".sbss",
+                                              ".data", ".rodata", ".bss"};
+    return Names[section];
+}
+
+namespace {
+
+// Data directives for the bytes of an object: lines of words, halves or bytes
+// as its alignment allows, .word for addresses and .space for runs of zeros
+void printBytes(raw_ostream &os, const MipsData &object)
+{
+    static const char *Directives[] = {nullptr, ".byte", ".half", nullptr, ".word"};
+
+    const auto &bytes     = object.bytes;
+    const auto &addresses = object.addresses;
+    uint64_t    size      = bytes.size();
+    uint64_t    align     = object.align;
+    unsigned unit = align >= 4 && size % 4 == 0 ? 4 : align >= 2 && size % 2 == 0 ? 2 : 1;
+    unsigned lineItems = 0;
+    auto     endLine   = [&]() {
+        if (lineItems)
+            os << '\n';
+        lineItems = 0;
+    };
+
+    for (uint64_t i = 0; i < size;) {
+        auto address = addresses.find(i);
+        if (address != addresses.end()) {
+            endLine();
+            int64_t addend = address->second.addend;
+            os << "\t.word " << address->second.label;
+            if (addend > 0)
+                os << '+';
+            if (addend)
+                os << addend;
+            os << '\n';
+            i += 4;
+            continue;
+        }
+
+        uint64_t zeros = 0;
+        while (i + zeros < size && !bytes[i + zeros] && !addresses.count(i + zeros))
+            zeros++;
+        zeros -= zeros % unit;
+        if (zeros >= 16 || i + zeros == size && zeros) {
+            endLine();
+            os << "\t.space " << zeros << '\n';
+            i += zeros;
+            continue;
+        }
+
+        int32_t value = 0;
+        for (unsigned j = 0; j < unit; j++)
+            value |= bytes[i + j] << 8 * j;
+        value = SignExtend32(value, 8 * unit);
+
+        if (lineItems)
+            os << ", " << value;
+        else
+            os << '\t' << Directives[unit] << ' ' << value;
+        if (++lineItems == 8)
+            endLine();
+        i += unit;
+    }
+    endLine();
+}
+
+}  // namespace
+
+void printMipsData(raw_ostream &os, const std::vector<MipsData> &objects)
+{
+    for (size_t i = 0; i < objects.size(); i++) {
+        const auto &object = objects[i];
+
+        if (!i || objects[i - 1].section != object.section) {
+            uint64_t sectionAlign = 1;
+            for (size_t j = i; j < objects.size() && objects[j].section == object.section;
+                 j++)
+                sectionAlign = std::max(sectionAlign, objects[j].align);
+            os << MipsData::sectionName(object.section) << "\n\t.align "
+               << Log2_64(sectionAlign) << '\n';
+        }
+
+        if (!object.comment.empty())
+            os << "# " << object.comment << '\n';
+        if (object.isGlobal)
+            os << "\t.globl " << object.label << '\n';
+        os << "\t.align " << Log2_64(object.align) << '\n' << object.label << ":\n";
+        printBytes(os, object);
+    }
+}
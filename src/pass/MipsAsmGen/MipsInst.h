@@ -0,0 +1,171 @@
+#pragma once
+
+#include "../../llvm.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Opcodes of the MIPS32 instructions and pseudo instructions the generator emits.
+// The format of each, the roles of its operands, is given by MipsInst::roles().
+enum class MipsOp : uint8_t {
+    ADDU,
+    SUBU,
+    ADD,
+    SUB,
+    AND,
+    OR,
+    XOR,
+    NOR,
+    SLT,
+    SLTU,
+    MUL,
+    SLLV,
+    SRLV,
+    SRAV,
+    ADDIU,
+    ADDI,
+    ANDI,
+    ORI,
+    XORI,
+    SLTI,
+    SLTIU,
+    SLL,
+    SRL,
+    SRA,
+    MOVE,
+    NEGU,
+    NOT,
+    LUI,
+    LI,
+    LA,
+    LW,
+    LH,
+    LHU,
+    LB,
+    LBU,
+    SW,
+    SH,
+    SB,
+    BEQ,
+    BNE,
+    BLEZ,
+    BGTZ,
+    BLTZ,
+    BGEZ,
+    J,
+    JR,
+    JAL,
+    JALR,
+    MULT,
+    MULTU,
+    DIV,
+    DIVU,
+    MFHI,
+    MFLO,
+    SYSCALL,
+    NOP
+};
+
+// One line of the assembly of a function: an instruction, a label or a comment.
+// Operands are held by role: registers by number in regs, in operand order, the
+// base register of a memory operand in the slot of the operand; immediates and
+// memory offsets in imm; label operands in symbol, plus imm as addend. An
+// immediate or memory offset with a symbol is %gp_rel(symbol+imm), the offset of
+// the label from $gp.
+struct MipsInst
+{
+    enum Kind { Instruction, Label, Comment };
+
+    static const int NoReg = -1;
+
+    // Pseudo register numbers of HI and LO in register masks
+    static const int HI = 32;
+    static const int LO = 33;
+
+    Kind        kind    = Instruction;
+    MipsOp      opcode  = MipsOp::NOP;
+    int8_t      regs[3] = {NoReg, NoReg, NoReg};
+    int64_t     imm     = 0;
+    std::string symbol;  // label operand, name of a label or text of a comment
+
+    // Instructions by the form of their operands, in assembly order: registers
+    // only, registers and a last immediate, "reg, offset(base)", and registers
+    // followed by a label
+    static MipsInst make(MipsOp opcode, int r0 = NoReg, int r1 = NoReg, int r2 = NoReg);
+    static MipsInst makeImm(MipsOp opcode, int r0, int r1, int64_t imm);
+    static MipsInst makeImm(MipsOp opcode, int r0, int64_t imm);
+    static MipsInst makeMem(MipsOp          opcode,
+                            int             reg,
+                            int64_t         offset,
+                            int             base,
+                            llvm::StringRef symbol = llvm::StringRef());
+    static MipsInst makeBranch(MipsOp          opcode,
+                               llvm::StringRef target,
+                               int             r0 = NoReg,
+                               int             r1 = NoReg);
+    // "la reg, label+offset"
+    static MipsInst makeAddress(int reg, llvm::StringRef label, int64_t offset);
+    // "addiu reg, $gp, %gp_rel(label+offset)"
+    static MipsInst makeGpAddress(int reg, llvm::StringRef label, int64_t offset);
+    static MipsInst makeLabel(llvm::StringRef name);
+    static MipsInst makeComment(llvm::StringRef text);
+
+    void print(llvm::raw_ostream &os) const;
+
+    static const char *regName(int reg);
+
+    bool isInstruction() const { return kind == Instruction; }
+    bool isBranch() const;  // conditional branch
+    bool isJump() const;    // j or jr, control does not fall through
+    bool isCall() const;    // jal, jalr and syscall
+    bool isReturn() const;  // jr $ra, other jr being jumps through a jump table
+    bool isLoad() const;
+    bool isStore() const;
+    bool hasSideEffects() const;
+
+    // Label operand of a branch or j
+    llvm::StringRef target() const;
+
+    // Registers read and written, as masks of (1 << reg)
+    uint64_t uses() const;
+    uint64_t defs() const;
+
+    // Replaces reads of register from by register to, returns whether any was found
+    bool replaceUse(int from, int to);
+
+    // Role of each operand: 'd' written register, 'u' read register,
+    // 'm' memory with read base register, 'i' immediate, 'l' label
+    const char *roles() const;
+};
+
+typedef std::vector<MipsInst> MipsInstList;
+
+void printMipsAsm(llvm::raw_ostream &os, const MipsInstList &insts);
+
+// A data object: its bytes, some of which are words holding the address of a
+// label plus an addend, in one of the data sections
+struct MipsData
+{
+    enum Section { Text, SmallData, SmallBss, Data, ReadOnlyData, Bss, SectionCount };
+
+    struct Address
+    {
+        std::string label;
+        int64_t     addend;
+    };
+
+    Section                     section;
+    std::string                 label;
+    bool                        isGlobal;
+    uint64_t                    align;
+    std::vector<uint8_t>        bytes;      // all zero in .sbss and .bss
+    std::map<uint64_t, Address> addresses;  // by offset of the word
+    std::string                 comment;    // annotation of the assembly, if any
+
+    static const char *sectionName(Section section);
+};
+
+// Data directives of objects, each preceded by its section when it differs from
+// that of the previous one. Sections are aligned to their most aligned object.
+void printMipsData(llvm::raw_ostream &os, const std::vector<MipsData> &objects);
@@ -0,0 +1,386 @@
+#include "MipsPeephole.h"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+using namespace llvm;
+
+namespace {
+
+const int ZERO = 0;
+const int V0   = 2;
+const int GP   = 28;
+const int SP   = 29;
+
+const int RegCount = 34;  // general purpose registers, HI and LO
+
+// Registers live when a function returns: $v0, $s0-$s7, $gp, $sp, $fp and $ra
+const uint64_t ReturnLiveRegs = 1ULL << V0 | 0x00ff0000ULL | 0xf0000000ULL;
+
+// Recognizes "addiu $x, $zero, c" and its equivalents, which load a constant
+bool isConstantLoad(const MipsInst &inst, int &reg, int64_t &value)
+{
+    if (!inst.isInstruction())
+        return false;
+
+    auto op = inst.opcode;
+    if ((op == MipsOp::ADDIU || op == MipsOp::ADDI || op == MipsOp::ORI)
+        && inst.regs[1] == ZERO || op == MipsOp::LI) {
+        reg   = inst.regs[0];
+        value = inst.imm;
+        return reg > 0;
+    }
+    return false;
+}
+
+// Whether two instructions load the same label address
+bool isSameAddress(const MipsInst *a, const MipsInst &b)
+{
+    return a && a->symbol == b.symbol && a->imm == b.imm;
+}
+
+// A word of memory, as offset from a base register, the offset of a global from
+// $gp being its label plus a constant
+struct Address
+{
+    int         base;
+    std::string symbol;
+    int64_t     offset;
+
+    explicit Address(const MipsInst &inst)
+        : base(inst.regs[1]), symbol(inst.symbol), offset(inst.imm)
+    {
+    }
+
+    bool operator<(const Address &other) const
+    {
+        return std::tie(base, symbol, offset)
+               < std::tie(other.base, other.symbol, other.offset);
+    }
+    bool operator==(const Address &other) const
+    {
+        return base == other.base && symbol == other.symbol && offset == other.offset;
+    }
+};
+
+// What is known about registers and stack words at a point of a basic block
+class LocalState
+{
+public:
+    LocalState() { clear(); }
+
+    void clear()
+    {
+        std::fill(copyOf, copyOf + RegCount, -1);
+        std::fill(isConstant, isConstant + RegCount, false);
+        std::fill(addressOf, addressOf + RegCount, nullptr);
+        memory.clear();
+    }
+
+    // Forgets every fact depending on the value of reg
+    void kill(int reg)
+    {
+        copyOf[reg]     = -1;
+        isConstant[reg] = false;
+        addressOf[reg]  = nullptr;
+        for (int r = 0; r < RegCount; r++) {
+            if (copyOf[r] == reg)
+                copyOf[r] = -1;
+        }
+        for (auto it = memory.begin(); it != memory.end();) {
+            if (it->second == reg || it->first.base == reg)
+                it = memory.erase(it);
+            else
+                it++;
+        }
+    }
+
+    // A word is stored to address. Stack and global words have distinct
+    // addresses for distinct operands, anything else may alias them all.
+    void store(const Address &address, int reg)
+    {
+        if (address.base != SP && address.base != GP) {
+            memory.clear();
+        }
+        else {
+            for (auto it = memory.begin(); it != memory.end();) {
+                int otherBase = it->first.base;
+                if (it->first == address || otherBase != SP && otherBase != GP)
+                    it = memory.erase(it);
+                else
+                    it++;
+            }
+        }
+
+        if (reg >= 0)
+            memory[address] = reg;
+    }
+
+    int             copyOf[RegCount];      // register holding the same value, or -1
+    bool            isConstant[RegCount];  // register holds constant[reg]
+    int64_t         constant[RegCount];
+    const MipsInst *addressOf[RegCount];   // la of the address the register holds
+
+    std::map<Address, int> memory;  // register holding the word at an address
+};
+
+// Copy propagation, store-to-load forwarding and removal of redundant constant
+// and address loads inside basic blocks
+bool propagateLocal(MipsInstList &insts, std::vector<bool> &removed)
+{
+    LocalState state;
+    bool       changed = false;
+
+    for (size_t i = 0; i < insts.size(); i++) {
+        auto &inst = insts[i];
+
+        if (inst.kind == MipsInst::Label) {
+            state.clear();
+            continue;
+        }
+        if (!inst.isInstruction())
+            continue;
+
+        // Read the source of a copy instead of the copy
+        uint64_t uses = inst.uses();
+        for (int reg = 1; reg < 32; reg++) {
+            if (uses & 1ULL << reg && state.copyOf[reg] >= 0)
+                changed |= inst.replaceUse(reg, state.copyOf[reg]);
+        }
+
+        int     constReg;
+        int64_t value;
+        bool    isConst = isConstantLoad(inst, constReg, value);
+        if (isConst && state.isConstant[constReg] && state.constant[constReg] == value) {
+            removed[i] = true;
+            continue;
+        }
+
+        if (inst.opcode == MipsOp::MOVE && inst.regs[0] == inst.regs[1]) {
+            removed[i] = true;
+            continue;
+        }
+
+        int laReg = inst.opcode == MipsOp::LA ? inst.regs[0] : -1;
+        if (laReg > 0 && isSameAddress(state.addressOf[laReg], inst)) {
+            removed[i] = true;
+            continue;
+        }
+
+        // Forward the register last stored to, or loaded from, the same word
+        if (inst.opcode == MipsOp::LW || inst.opcode == MipsOp::SW) {
+            auto it  = state.memory.find(Address(inst));
+            int  reg = inst.regs[0];
+
+            if (it != state.memory.end() && it->second == reg) {
+                removed[i] = true;
+                continue;
+            }
+            if (it != state.memory.end() && inst.opcode == MipsOp::LW) {
+                inst    = MipsInst::make(MipsOp::MOVE, reg, it->second);
+                changed = true;
+            }
+        }
+
+        // Update what is known
+        if (inst.isCall())
+            state.memory.clear();
+
+        uint64_t defs = inst.defs();
+        for (int reg = 0; reg < RegCount; reg++) {
+            if (defs & 1ULL << reg)
+                state.kill(reg);
+        }
+
+        if (inst.opcode == MipsOp::MOVE) {
+            int dst = inst.regs[0];
+            int src = inst.regs[1];
+            if (dst > 0 && src >= 0) {
+                state.copyOf[dst]    = src;
+                state.addressOf[dst] = state.addressOf[src];
+                if (src == ZERO || state.isConstant[src]) {
+                    state.isConstant[dst] = true;
+                    state.constant[dst]   = src == ZERO ? 0 : state.constant[src];
+                }
+            }
+        }
+        else if (isConst) {
+            state.isConstant[constReg] = true;
+            state.constant[constReg]   = value;
+        }
+        else if (laReg > 0) {
+            state.addressOf[laReg] = &inst;
+        }
+        else if (inst.opcode == MipsOp::LW) {
+            int dst = inst.regs[0];
+            if (dst > 0 && inst.regs[1] != dst)
+                state.memory[Address(inst)] = dst;
+        }
+        else if (inst.opcode == MipsOp::SW) {
+            state.store(Address(inst), inst.regs[0]);
+        }
+        else if (inst.isStore()) {
+            state.store(Address(inst), -1);
+        }
+    }
+
+    return changed;
+}
+
+// Removes branches and jumps to a label which directly follows them
+void removeRedundantJumps(MipsInstList &insts, std::vector<bool> &removed)
+{
+    for (size_t i = 0; i < insts.size(); i++) {
+        StringRef target = insts[i].target();
+        if (removed[i] || target.empty())
+            continue;
+
+        for (size_t j = i + 1; j < insts.size(); j++) {
+            if (insts[j].kind == MipsInst::Comment || removed[j])
+                continue;
+            if (insts[j].kind != MipsInst::Label)
+                break;
+            if (insts[j].symbol == target) {
+                removed[i] = true;
+                break;
+            }
+        }
+    }
+}
+
+// Removes instructions without side effects whose results are never read,
+// using register liveness over the basic blocks of the function
+void removeDeadInstructions(MipsInstList &insts, std::vector<bool> &removed)
+{
+    struct Block
+    {
+        size_t           begin, end;
+        std::vector<int> succs;  // -1 for a return, -2 for an unknown target
+        uint64_t         liveIn, liveOut;
+    };
+    std::vector<Block>       blocks;
+    std::map<StringRef, int> labelBlock;
+
+    // Blocks begin at labels and end after branches and jumps
+    for (size_t i = 0; i < insts.size(); i++) {
+        if (removed[i])
+            continue;
+
+        bool isLabel = insts[i].kind == MipsInst::Label;
+        if (blocks.empty() || isLabel && blocks.back().end > blocks.back().begin)
+            blocks.push_back({i, i, {}, 0, 0});
+        if (isLabel)
+            labelBlock[insts[i].symbol] = blocks.size() - 1;
+
+        blocks.back().end = i + 1;
+        if (insts[i].isBranch() || insts[i].isJump())
+            blocks.push_back({i + 1, i + 1, {}, 0, 0});
+    }
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        auto &block = blocks[b];
+
+        const MipsInst *last = nullptr;
+        for (size_t i = block.begin; i < block.end; i++) {
+            if (!removed[i] && insts[i].isInstruction())
+                last = &insts[i];
+        }
+
+        if (last && (last->isBranch() || last->isJump()) && !last->isReturn()) {
+            auto it = labelBlock.find(last->target());
+            block.succs.push_back(it != labelBlock.end() ? it->second : -2);
+        }
+        if (last && last->isReturn())
+            block.succs.push_back(-1);
+        else if (!last || !last->isJump())
+            block.succs.push_back(b + 1 < blocks.size() ? (int)b + 1 : -1);
+    }
+
+    auto transfer = [&](size_t i, uint64_t live) {
+        const auto &inst = insts[i];
+        if (!inst.isInstruction())
+            return live;
+        if (inst.isReturn())
+            live |= ReturnLiveRegs;
+        return (live & ~inst.defs()) | inst.uses();
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t b = blocks.size(); b-- > 0;) {
+            auto &   block   = blocks[b];
+            uint64_t liveOut = 0;
+            for (int succ : block.succs) {
+                if (succ == -1)
+                    liveOut |= ReturnLiveRegs;
+                else if (succ == -2)
+                    liveOut = ~0ULL;
+                else
+                    liveOut |= blocks[succ].liveIn;
+            }
+
+            uint64_t live = liveOut;
+            for (size_t i = block.end; i-- > block.begin;) {
+                if (!removed[i])
+                    live = transfer(i, live);
+            }
+
+            if (live != block.liveIn || liveOut != block.liveOut) {
+                block.liveIn  = live;
+                block.liveOut = liveOut;
+                changed       = true;
+            }
+        }
+    }
+
+    for (const auto &block : blocks) {
+        uint64_t live = block.liveOut;
+        for (size_t i = block.end; i-- > block.begin;) {
+            if (removed[i] || !insts[i].isInstruction())
+                continue;
+
+            uint64_t defs = insts[i].defs();
+            if (!insts[i].hasSideEffects() && defs && !(defs & live))
+                removed[i] = true;
+            else
+                live = transfer(i, live);
+        }
+    }
+}
+
+size_t eraseRemoved(MipsInstList &insts, std::vector<bool> &removed)
+{
+    size_t count = 0, j = 0;
+    for (size_t i = 0; i < insts.size(); i++) {
+        if (removed[i])
+            count++;
+        else if (j++ != i)
+            insts[j - 1] = std::move(insts[i]);
+    }
+    insts.resize(j);
+    removed.assign(j, false);
+    return count;
+}
+
+}  // namespace
+
+unsigned runMipsPeephole(MipsInstList &insts)
+{
+    std::vector<bool> removed(insts.size(), false);
+    unsigned          removedCount = 0;
+
+    // Each transformation may expose work for the others
+    for (int round = 0; round < 4; round++) {
+        bool changed = propagateLocal(insts, removed);
+        removeRedundantJumps(insts, removed);
+        removeDeadInstructions(insts, removed);
+
+        size_t count = eraseRemoved(insts, removed);
+        removedCount += count;
+        if (!changed && !count)
+            break;
+    }
+
+    return removedCount;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "MipsInst.h"
+
+// Runs peephole optimizations over the assembly of one function: copy
+// propagation, store-to-load forwarding, removal of redundant constant loads,
+// of jumps to the next label and of dead instructions. Returns the number of
+// instructions removed.
+unsigned runMipsPeephole(MipsInstList &insts);
@@ -0,0 +1,237 @@
+#include "MipsScheduler.h"
+
+#include "MipsEncoder.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+
+const int GP = 28;
+const int SP = 29;
+const int RA = 31;
+
+// Longest run of instructions scheduled together, bounding the quadratic
+// dependence construction
+const size_t MaxRegionSize = 64;
+
+// How far back a delay slot candidate is searched for
+const size_t MaxSlotSearch = 16;
+
+// Cycles from issue until the result can be used without a stall
+int resultLatency(const MipsInst &inst)
+{
+    if (inst.isLoad())
+        return 2;
+
+    switch (inst.opcode) {
+    case MipsOp::MUL: return 4;
+    case MipsOp::MULT:
+    case MipsOp::MULTU: return 5;
+    case MipsOp::DIV:
+    case MipsOp::DIVU: return 35;
+    default: return 1;
+    }
+}
+
+bool hasDelaySlot(const MipsInst &inst)
+{
+    return inst.isBranch() || inst.isJump() || inst.opcode == MipsOp::JAL
+           || inst.opcode == MipsOp::JALR;
+}
+
+// Instructions which are never moved, and end a scheduling region
+bool isBarrier(const MipsInst &inst)
+{
+    return !inst.isInstruction() || hasDelaySlot(inst) || inst.isCall();
+}
+
+// Whether two memory accesses may touch the same word. Stack and global
+// accesses through different offsets, or to different globals, are distinct.
+bool mayAlias(const MipsInst &a, const MipsInst &b)
+{
+    int baseA = a.regs[1];
+    int baseB = b.regs[1];
+
+    bool fixedA = baseA == SP || baseA == GP;
+    bool fixedB = baseB == SP || baseB == GP;
+    if (fixedA && fixedB)
+        return baseA == baseB && a.symbol == b.symbol && a.imm == b.imm;
+    return true;
+}
+
+// Whether later has to stay after earlier
+bool dependsOn(const MipsInst &later, const MipsInst &earlier)
+{
+    uint64_t earlierDefs = earlier.defs(), laterDefs = later.defs();
+    if (earlierDefs & (later.uses() | laterDefs) || earlier.uses() & laterDefs)
+        return true;
+
+    bool memEarlier = earlier.isLoad() || earlier.isStore();
+    bool memLater   = later.isLoad() || later.isStore();
+    return memEarlier && memLater && (earlier.isStore() || later.isStore())
+           && mayAlias(earlier, later);
+}
+
+// List schedules insts[begin, end), preferring the instruction on the longest
+// latency path among those whose operands are ready
+void scheduleRegion(MipsInstList &insts, size_t begin, size_t end)
+{
+    size_t n = end - begin;
+    if (n < 2)
+        return;
+
+    struct Node
+    {
+        std::vector<std::pair<size_t, int>> succs;  // successor and latency
+        int                                 predCount   = 0;
+        int                                 height      = 0;
+        int                                 readyCycle  = 0;
+        bool                                isScheduled = false;
+    };
+    std::vector<Node> nodes(n);
+
+    for (size_t b = 1; b < n; b++) {
+        const auto &later = insts[begin + b];
+        for (size_t a = 0; a < b; a++) {
+            const auto &earlier = insts[begin + a];
+            if (!dependsOn(later, earlier))
+                continue;
+
+            bool isFlow = earlier.defs() & later.uses();
+            nodes[a].succs.push_back({b, isFlow ? resultLatency(earlier) : 1});
+            nodes[b].predCount++;
+        }
+    }
+
+    for (size_t a = n; a-- > 0;) {
+        auto &node  = nodes[a];
+        node.height = resultLatency(insts[begin + a]);
+        for (auto succ : node.succs)
+            node.height = std::max(node.height, succ.second + nodes[succ.first].height);
+    }
+
+    std::vector<size_t> order;
+    for (int cycle = 0; order.size() < n;) {
+        size_t pick = n, waiting = n;
+        for (size_t a = 0; a < n; a++) {
+            const auto &node = nodes[a];
+            if (node.isScheduled || node.predCount)
+                continue;
+
+            if (node.readyCycle > cycle) {
+                if (waiting == n || node.readyCycle < nodes[waiting].readyCycle)
+                    waiting = a;
+            }
+            else if (pick == n || node.height > nodes[pick].height)
+                pick = a;
+        }
+
+        // Nothing is ready, stall until the earliest operand arrives
+        if (pick == n) {
+            cycle = nodes[waiting].readyCycle;
+            continue;
+        }
+
+        nodes[pick].isScheduled = true;
+        order.push_back(pick);
+        for (auto succ : nodes[pick].succs) {
+            auto &node      = nodes[succ.first];
+            node.readyCycle = std::max(node.readyCycle, cycle + succ.second);
+            node.predCount--;
+        }
+        cycle++;
+    }
+
+    MipsInstList scheduled;
+    for (size_t a : order)
+        scheduled.push_back(std::move(insts[begin + a]));
+    std::move(scheduled.begin(), scheduled.end(), insts.begin() + begin);
+}
+
+// Whether inst can execute in the delay slot of control, after it instead of
+// before it. Only single machine instructions fit, not the pseudo instructions
+// and large immediates an assembler expands.
+bool fitsDelaySlot(const MipsInst &inst, const MipsInst &control)
+{
+    if (encodedWords(inst) != 1)
+        return false;
+    if (control.isCall()) {
+        // jal writes $ra before the delay slot executes
+        uint64_t conflicts = 1ULL << RA;
+        if (control.opcode == MipsOp::JALR)
+            conflicts |= 1ULL << control.regs[0];
+        return !((inst.uses() | inst.defs()) & 1ULL << RA) && !(inst.defs() & conflicts);
+    }
+    return !(inst.defs() & control.uses());
+}
+
+}  // namespace
+
+unsigned runMipsScheduler(MipsInstList &insts)
+{
+    // Schedule runs of instructions between barriers
+    for (size_t begin = 0; begin < insts.size();) {
+        if (isBarrier(insts[begin])) {
+            begin++;
+            continue;
+        }
+
+        size_t end = begin;
+        while (end < insts.size() && end - begin < MaxRegionSize
+               && !isBarrier(insts[end]))
+            end++;
+        scheduleRegion(insts, begin, end);
+        begin = end;
+    }
+
+    // Fill delay slots, moving the latest independent instruction of the region
+    // before each branch, jump or call after it
+    MipsInstList output;
+    size_t       regionStart = 0;
+    unsigned     filled      = 0;
+
+    for (auto &inst : insts) {
+        if (!hasDelaySlot(inst)) {
+            bool isBarrierInst = isBarrier(inst);
+            output.push_back(std::move(inst));
+            if (isBarrierInst)
+                regionStart = output.size();
+            continue;
+        }
+
+        size_t slot  = output.size();
+        size_t limit = regionStart;
+        if (output.size() - limit > MaxSlotSearch)
+            limit = output.size() - MaxSlotSearch;
+        for (size_t k = output.size(); k-- > limit;) {
+            if (!fitsDelaySlot(output[k], inst))
+                continue;
+
+            bool isIndependent = true;
+            for (size_t j = k + 1; j < output.size() && isIndependent; j++)
+                isIndependent = !dependsOn(output[j], output[k]);
+            if (isIndependent) {
+                slot = k;
+                break;
+            }
+        }
+
+        if (slot < output.size()) {
+            MipsInst delayed = std::move(output[slot]);
+            output.erase(output.begin() + slot);
+            output.push_back(std::move(inst));
+            output.push_back(std::move(delayed));
+            filled++;
+        }
+        else {
+            output.push_back(std::move(inst));
+            output.push_back(MipsInst::make(MipsOp::NOP));
+        }
+        regionStart = output.size();
+    }
+
+    insts = std::move(output);
+    return filled;
+}
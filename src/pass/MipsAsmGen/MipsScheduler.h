@@ -0,0 +1,10 @@
+#pragma once
+
+#include "MipsInst.h"
+
+// Schedules the assembly of one function for the classic MIPS pipeline, to be
+// emitted under ".set noreorder". Straight-line code is list scheduled so that
+// loads and multiplications are separated from their first use, and the delay
+// slot of every branch, jump and call is filled with an independent instruction
+// or a nop. Returns the number of delay slots filled with useful instructions.
+unsigned runMipsScheduler(MipsInstList &insts);
@@ -0,0 +1,50 @@
+#include "simulator.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+    bool          quiet           = false;
+    std::uint64_t maxInstructions = 0;
+    std::string   filename;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-q") == 0)
+            quiet = true;
+        else if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 < argc)
+                maxInstructions = std::strtoull(argv[++i], nullptr, 10);
+            else {
+                std::cerr << "Require instruction limit!\n";
+                return 1;
+            }
+        }
+        else
+            filename = argv[i];
+    }
+
+    if (filename.empty()) {
+        std::cerr << "usage: mipssim [-q] [-n max_instructions] file.s|file.o\n";
+        return 1;
+    }
+
+    std::ifstream source(filename, std::ios::binary);
+    if (!source) {
+        std::cerr << "Could not open file: " << filename << '\n';
+        return 1;
+    }
+
+    MipsSimulator simulator(std::cout, std::cin, std::cerr);
+    if (!simulator.Load(source))
+        return 1;
+
+    bool finished = simulator.Run(maxInstructions);
+    std::cout.flush();
+
+    if (!quiet)
+        simulator.PrintStats(std::cerr);
+
+    return finished ? simulator.ExitCode() : 1;
+}
@@ -0,0 +1,1132 @@
+#include "simulator.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+namespace {
+
+enum { ZERO = 0, V0 = 2, A0 = 4, GP = 28, SP = 29, FP = 30, RA = 31 };
+
+// ELF constants of the relocatable objects loaded
+enum { ET_REL = 1, EM_MIPS = 8, SHN_UNDEF = 0, SHN_ABS = 0xfff1 };
+enum { SHT_SYMTAB = 2, SHT_NOBITS = 8, SHT_REL = 9 };
+enum : std::uint32_t {
+    SHF_ALLOC      = 0x2,
+    SHF_EXECINSTR  = 0x4,
+    SHF_MIPS_GPREL = 0x10000000
+};
+enum { R_MIPS_32 = 2, R_MIPS_26 = 4, R_MIPS_HI16, R_MIPS_LO16, R_MIPS_GPREL16 };
+
+const char *RegNames[32] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+                            "t0",   "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+                            "s0",   "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+                            "t8",   "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
+
+std::string Trim(const std::string &s)
+{
+    auto begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return "";
+    auto end = s.find_last_not_of(" \t\r\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+bool IsLabelChar(char c)
+{
+    return std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$';
+}
+
+// Removes a trailing '#' comment outside of string and character literals
+std::string StripComment(const std::string &line)
+{
+    char quote = 0;
+    for (std::size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quote) {
+            if (c == '\\')
+                i++;
+            else if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'')
+            quote = c;
+        else if (c == '#')
+            return line.substr(0, i);
+    }
+    return line;
+}
+
+// Splits operands on commas outside of string and character literals
+std::vector<std::string> SplitOperands(const std::string &args)
+{
+    std::vector<std::string> result;
+    std::string              current;
+    char                     quote = 0;
+
+    for (std::size_t i = 0; i < args.size(); i++) {
+        char c = args[i];
+        if (quote) {
+            current += c;
+            if (c == '\\' && i + 1 < args.size())
+                current += args[++i];
+            else if (c == quote)
+                quote = 0;
+        }
+        else if (c == '"' || c == '\'') {
+            quote = c;
+            current += c;
+        }
+        else if (c == ',') {
+            result.push_back(Trim(current));
+            current.clear();
+        }
+        else
+            current += c;
+    }
+
+    current = Trim(current);
+    if (!current.empty() || !result.empty())
+        result.push_back(current);
+    return result;
+}
+
+char Unescape(char c)
+{
+    switch (c) {
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    case '0':
+        return '\0';
+    default:
+        return c;
+    }
+}
+
+int ParseRegister(const std::string &name)
+{
+    if (name.size() < 2 || name[0] != '$')
+        return -1;
+
+    if (std::isdigit((unsigned char)name[1])) {
+        int n = std::atoi(name.c_str() + 1);
+        return n >= 0 && n < 32 ? n : -1;
+    }
+
+    for (int i = 0; i < 32; i++) {
+        if (name.compare(1, std::string::npos, RegNames[i]) == 0)
+            return i;
+    }
+    return name == "$s8" ? FP : -1;
+}
+
+}  // namespace
+
+MipsSimulator::MipsSimulator(std::ostream &output,
+                             std::istream &input,
+                             std::ostream &errorStream)
+    : output(output)
+    , input(input)
+    , errorStream(errorStream)
+    , dataTop(DataBase)
+    , gpTop(SmallDataBase)
+    , inText(true)
+    , inSmallData(false)
+    , noReorder(false)
+    , stats {}
+    , exitCode(0)
+    , halted(false)
+{}
+
+bool MipsSimulator::Error(int lineNo, const std::string &message)
+{
+    errorStream << "line " << lineNo << ": " << message << '\n';
+    return false;
+}
+
+bool MipsSimulator::Load(std::istream &source)
+{
+    std::string image((std::istreambuf_iterator<char>(source)),
+                      std::istreambuf_iterator<char>());
+
+    labels.clear();
+    memory.clear();
+
+    if (image.compare(0, 4, "\x7f" "ELF") == 0)
+        return LoadObject(image);
+
+    std::vector<std::string> lines;
+    std::istringstream       stream(image);
+    for (std::string line; std::getline(stream, line);)
+        lines.push_back(line);
+
+    // First pass records label addresses, second pass resolves references to them
+    return Assemble(lines, false) && Assemble(lines, true);
+}
+
+bool MipsSimulator::LoadObject(const std::string &image)
+{
+    auto read = [&](std::size_t offset, int size) {
+        std::uint32_t value = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            auto byte = offset + i < image.size() ? std::uint8_t(image[offset + i]) : 0;
+            value     = value << 8 | byte;
+        }
+        return value;
+    };
+    auto readString = [&](std::size_t offset) {
+        return std::string(offset < image.size() ? image.c_str() + offset : "");
+    };
+    auto error = [&](const std::string &message) {
+        errorStream << "object: " << message << '\n';
+        return false;
+    };
+
+    if (image.size() < 52 || image[4] != 1 || image[5] != 1 || read(16, 2) != ET_REL
+        || read(18, 2) != EM_MIPS)
+        return error("not a relocatable little-endian MIPS32 object");
+
+    struct Section
+    {
+        std::uint32_t type, flags, offset, size, link, info;
+        std::uint32_t address;  // where an allocated section is placed
+    };
+
+    std::uint32_t sectionOffset = read(32, 4);
+    std::uint32_t entrySize = read(46, 2), count = read(48, 2);
+    if (sectionOffset + std::uint64_t(count) * entrySize > image.size())
+        return error("truncated section headers");
+
+    // Place the sections and copy their contents
+    std::vector<Section> sections(count);
+    std::uint32_t        textTop = TextBase;
+    dataTop = DataBase;
+    gpTop   = SmallDataBase;
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        std::uint32_t header  = sectionOffset + i * entrySize;
+        Section &     section = sections[i];
+        section = {read(header + 4, 4),  read(header + 8, 4),  read(header + 16, 4),
+                   read(header + 20, 4), read(header + 24, 4), read(header + 28, 4), 0};
+        if (!(section.flags & SHF_ALLOC))
+            continue;
+
+        bool hasBits = section.type != SHT_NOBITS;
+        if (hasBits && std::uint64_t(section.offset) + section.size > image.size())
+            return error("truncated section");
+
+        auto &top = section.flags & SHF_EXECINSTR    ? textTop
+                    : section.flags & SHF_MIPS_GPREL ? gpTop
+                                                     : dataTop;
+        std::uint32_t align = std::max(read(header + 32, 4), 1u);
+        top                 = (top + align - 1) & ~(align - 1);
+        section.address     = top;
+        top += section.size;
+
+        for (std::uint32_t j = 0; j < section.size; j++)
+            MemByte(section.address + j) = hasBits ? image[section.offset + j] : 0;
+    }
+
+    // Symbol addresses, undefined symbols are only reported when referenced
+    std::vector<std::uint32_t> symbols;
+    std::vector<std::string>   undefined;
+    for (const auto &section : sections) {
+        if (section.type != SHT_SYMTAB || section.link >= count)
+            continue;
+        std::uint32_t end = section.offset + section.size;
+        for (std::uint32_t offset = section.offset; offset + 16 <= end; offset += 16) {
+            std::uint32_t value = read(offset + 4, 4), index = read(offset + 14, 2);
+            bool isUndefined    = index == SHN_UNDEF && !symbols.empty();
+
+            symbols.push_back(index == SHN_ABS || index >= count
+                                  ? value
+                                  : sections[index].address + value);
+            undefined.push_back(isUndefined ? readString(sections[section.link].offset
+                                                         + read(offset, 4))
+                                            : "");
+        }
+    }
+
+    // Apply the relocations of the allocated sections. R_MIPS_HI16 takes the low
+    // half of its addend from the R_MIPS_LO16 following it.
+    for (const auto &section : sections) {
+        if (section.type != SHT_REL || section.info >= count
+            || !(sections[section.info].flags & SHF_ALLOC))
+            continue;
+
+        std::vector<std::uint32_t> pendingHi;
+        std::uint32_t end = section.offset + section.size;
+        for (std::uint32_t offset = section.offset; offset + 8 <= end; offset += 8) {
+            std::uint32_t place  = sections[section.info].address + read(offset, 4);
+            std::uint32_t info   = read(offset + 4, 4);
+            std::uint32_t symbol = info >> 8, type = info & 0xff;
+
+            if (symbol >= symbols.size())
+                return error("bad symbol index " + std::to_string(symbol));
+            if (!undefined[symbol].empty())
+                return error("undefined symbol " + undefined[symbol]);
+
+            std::uint32_t address = symbols[symbol], word = LoadMem(place, 4, false);
+            std::int32_t  low     = std::int16_t(word);
+
+            switch (type) {
+            case R_MIPS_32:
+                StoreMem(place, address + word, 4);
+                break;
+            case R_MIPS_26: {
+                std::uint32_t target = ((word & 0x3ffffff) << 2) + address;
+                StoreMem(place, (word & 0xfc000000) | (target >> 2 & 0x3ffffff), 4);
+                break;
+            }
+            case R_MIPS_HI16:
+                pendingHi.push_back(place);
+                break;
+            case R_MIPS_LO16:
+                for (auto hiPlace : pendingHi) {
+                    std::uint32_t hiWord = LoadMem(hiPlace, 4, false);
+                    std::uint32_t value  = address + (hiWord << 16) + low;
+                    hiWord = (hiWord & 0xffff0000) | ((value + 0x8000) >> 16);
+                    StoreMem(hiPlace, hiWord, 4);
+                }
+                pendingHi.clear();
+                StoreMem(place, (word & 0xffff0000) | ((address + low) & 0xffff), 4);
+                break;
+            case R_MIPS_GPREL16: {
+                std::int64_t value = std::int64_t(address) + low - GlobalPtr;
+                if (value < -0x8000 || value > 0x7fff)
+                    return error("$gp-relative reference out of range");
+                StoreMem(place, (word & 0xffff0000) | (std::uint32_t(value) & 0xffff), 4);
+                break;
+            }
+            default:
+                return error("unsupported relocation type " + std::to_string(type));
+            }
+        }
+    }
+
+    text.clear();
+    for (std::uint32_t pc = TextBase; pc < textTop; pc += 4) {
+        text.emplace_back();
+        if (!Decode(LoadMem(pc, 4, false), pc, text.back()))
+            return false;
+    }
+
+    // The object holds the delay slot instructions of every branch
+    noReorder = true;
+    return true;
+}
+
+// Instructions are numbered in place of source lines
+bool MipsSimulator::Decode(std::uint32_t word, std::uint32_t pc, Inst &inst)
+{
+    int           opcode = word >> 26, funct = word & 63;
+    int           rs = word >> 21 & 31, rt = word >> 16 & 31, rd = word >> 11 & 31;
+    std::int32_t  simm   = std::int16_t(word), uimm = word & 0xffff;
+    std::uint32_t branch = pc + 4 + std::uint32_t(simm) * 4;
+    std::uint32_t jump   = ((pc + 4) & 0xf0000000) | (word & 0x3ffffff) << 2;
+    int           number = int((pc - TextBase) / 4 + 1);
+
+    // Functions of SPECIAL instructions, and opcodes of the others
+    static const std::unordered_map<int, Opcode> registerOps = {
+        {0x20, ADDU}, {0x21, ADDU}, {0x22, SUBU}, {0x23, SUBU}, {0x24, AND},
+        {0x25, OR},   {0x26, XOR},  {0x27, NOR},  {0x2a, SLT},  {0x2b, SLTU}};
+    static const std::unordered_map<int, Opcode> shiftOps = {
+        {0x00, SLL}, {0x02, SRL}, {0x03, SRA}};
+    static const std::unordered_map<int, Opcode> hiloOps = {
+        {0x18, MULT}, {0x19, MULTU}, {0x1a, DIV}, {0x1b, DIVU}};
+    static const std::unordered_map<int, Opcode> immediateOps = {
+        {0x08, ADDU}, {0x09, ADDU}, {0x0a, SLT}, {0x0b, SLTU},
+        {0x0c, AND},  {0x0d, OR},   {0x0e, XOR}};
+    static const std::unordered_map<int, Opcode> branchOps = {
+        {0x04, BEQ}, {0x05, BNE}, {0x06, BLEZ}, {0x07, BGTZ}};
+    static const std::unordered_map<int, Opcode> memOps = {
+        {0x20, LB},  {0x21, LH}, {0x23, LW}, {0x24, LBU},
+        {0x25, LHU}, {0x28, SB}, {0x29, SH}, {0x2b, SW}};
+
+    Opcode op;
+    auto   find = [&](const std::unordered_map<int, Opcode> &table, int key) {
+        auto it = table.find(key);
+        if (it == table.end())
+            return false;
+        op = it->second;
+        return true;
+    };
+    auto set = [&](Opcode op, int rd, int rs, int rt, std::int32_t imm) {
+        inst = {op, rd, rs, rt, imm, number};
+        return true;
+    };
+
+    if (word == 0)
+        return set(NOP, -1, -1, -1, 0);
+
+    if (opcode == 0x00) {
+        if (find(registerOps, funct))
+            return set(op, rd, rs, rt, 0);
+        if (find(shiftOps, funct))
+            return set(op, rd, rt, -1, word >> 6 & 31);
+        if (find(shiftOps, funct - 4))  // sllv, srlv and srav
+            return set(op, rd, rt, rs, 0);
+        if (find(hiloOps, funct))
+            return set(op, -1, rs, rt, 0);
+        if (funct == 0x10 || funct == 0x12)
+            return set(funct == 0x10 ? MFHI : MFLO, rd, -1, -1, 0);
+        if (funct == 0x11 || funct == 0x13)
+            return set(funct == 0x11 ? MTHI : MTLO, -1, rs, -1, 0);
+        if (funct == 0x08)
+            return set(JR, -1, rs, -1, 0);
+        if (funct == 0x09)
+            return set(JALR, rd, rs, -1, 0);
+        if (funct == 0x0c)
+            return set(SYSCALL, -1, -1, -1, 0);
+    }
+    else if (find(immediateOps, opcode))
+        return set(op, rt, rs, -1, op == AND || op == OR || op == XOR ? uimm : simm);
+    else if (find(branchOps, opcode))
+        return set(op, -1, rs, op == BEQ || op == BNE ? rt : -1, branch);
+    else if (find(memOps, opcode))
+        return op >= SW ? set(op, -1, rs, rt, simm) : set(op, rt, rs, -1, simm);
+    else if (opcode == 0x01 && rt <= 1)
+        return set(rt ? BGEZ : BLTZ, -1, rs, -1, branch);
+    else if (opcode == 0x02 || opcode == 0x03)
+        return opcode == 0x02 ? set(J, -1, -1, -1, jump) : set(JAL, RA, -1, -1, jump);
+    else if (opcode == 0x0f)
+        return set(LUI, rt, -1, -1, uimm);
+    else if (opcode == 0x1c && funct == 0x02)
+        return set(MUL, rd, rs, rt, 0);
+
+    std::ostringstream message;
+    message << "cannot decode instruction 0x" << std::hex << word << " at 0x" << pc;
+    return Error(number, message.str());
+}
+
+bool MipsSimulator::Assemble(const std::vector<std::string> &lines, bool resolve)
+{
+    text.clear();
+    dataTop     = DataBase;
+    gpTop       = SmallDataBase;
+    inText      = true;
+    inSmallData = false;
+    noReorder   = false;
+
+    for (std::size_t i = 0; i < lines.size(); i++) {
+        int         lineNo = int(i + 1);
+        std::string line   = Trim(StripComment(lines[i]));
+
+        // Leading labels
+        for (;;) {
+            std::size_t n = 0;
+            while (n < line.size() && IsLabelChar(line[n]))
+                n++;
+            if (n == 0 || n >= line.size() || line[n] != ':')
+                break;
+
+            std::string name = line.substr(0, n);
+            if (!resolve) {
+                if (labels.count(name))
+                    return Error(lineNo, "duplicate label " + name);
+                labels[name] = inText        ? TextBase + 4 * std::uint32_t(text.size())
+                               : inSmallData ? gpTop
+                                             : dataTop;
+            }
+            line = Trim(line.substr(n + 1));
+        }
+
+        if (line.empty())
+            continue;
+
+        auto        split    = line.find_first_of(" \t");
+        std::string mnemonic = line.substr(0, split);
+        std::string args     = split == std::string::npos ? "" : Trim(line.substr(split));
+
+        if (mnemonic[0] == '.') {
+            if (!AssembleDirective(mnemonic, args, lineNo, resolve))
+                return false;
+            continue;
+        }
+
+        if (!inText)
+            return Error(lineNo, "instruction outside of .text section");
+
+        std::vector<Operand> ops;
+        for (const auto &arg : SplitOperands(args)) {
+            ops.emplace_back();
+            if (!ParseOperand(arg, ops.back(), lineNo, resolve))
+                return false;
+        }
+
+        if (!AssembleInstruction(mnemonic, ops, lineNo))
+            return false;
+    }
+
+    return true;
+}
+
+bool MipsSimulator::ParseOperand(std::string text, Operand &op, int lineNo, bool resolve)
+{
+    op = {-1, -1, 0};
+
+    if (text.empty())
+        return Error(lineNo, "missing operand");
+
+    // %gp_rel(sum), possibly followed by (base), is the sum less $gp
+    bool isGpRel = text.compare(0, 8, "%gp_rel(") == 0;
+    if (isGpRel) {
+        auto close = text.find(')');
+        if (close == std::string::npos)
+            return Error(lineNo, "missing ')' in " + text);
+        text = text.substr(8, close - 8) + text.substr(close + 1);
+    }
+
+    if (text[0] == '$') {
+        op.reg = ParseRegister(text);
+        return op.reg >= 0 || Error(lineNo, "unknown register " + text);
+    }
+
+    // offset(base)
+    auto paren = text.find('(');
+    if (paren != std::string::npos) {
+        auto close = text.find(')', paren);
+        if (close == std::string::npos)
+            return Error(lineNo, "missing ')' in " + text);
+
+        op.base = ParseRegister(Trim(text.substr(paren + 1, close - paren - 1)));
+        if (op.base < 0)
+            return Error(lineNo, "bad base register in " + text);
+        text = Trim(text.substr(0, paren));
+    }
+
+    // Sum of numbers, character literals and labels
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        int sign = 1;
+        while (pos < text.size() && (text[pos] == '+' || text[pos] == '-' || text[pos] == ' ')) {
+            if (text[pos] == '-')
+                sign = -sign;
+            pos++;
+        }
+
+        std::int64_t term = 0;
+        if (pos < text.size() && text[pos] == '\'') {
+            if (pos + 2 < text.size() && text[pos + 1] == '\\') {
+                term = Unescape(text[pos + 2]);
+                pos += 4;
+            }
+            else {
+                term = (unsigned char)text[pos + 1];
+                pos += 3;
+            }
+        }
+        else if (pos < text.size() && std::isdigit((unsigned char)text[pos])) {
+            std::size_t len;
+            term = std::stoll(text.substr(pos), &len, 0);
+            pos += len;
+        }
+        else {
+            std::size_t n = pos;
+            while (n < text.size() && IsLabelChar(text[n]))
+                n++;
+            if (n == pos)
+                return Error(lineNo, "bad operand " + text);
+
+            auto name = text.substr(pos, n - pos);
+            auto it   = labels.find(name);
+            if (it != labels.end())
+                term = it->second;
+            else if (resolve)
+                return Error(lineNo, "undefined label " + name);
+            pos = n;
+        }
+
+        op.value += std::int32_t(sign * term);
+    }
+
+    if (isGpRel) {
+        std::int64_t value = std::int64_t(std::uint32_t(op.value)) - GlobalPtr;
+        if (resolve && (value < -0x8000 || value > 0x7fff))
+            return Error(lineNo, "$gp-relative reference out of range: " + text);
+        op.value = std::int32_t(value);
+    }
+
+    return true;
+}
+
+bool MipsSimulator::AssembleInstruction(std::string                 mnemonic,
+                                        const std::vector<Operand> &ops,
+                                        int                         lineNo)
+{
+    std::transform(mnemonic.begin(), mnemonic.end(), mnemonic.begin(), ::tolower);
+
+    auto expect = [&](std::size_t count) {
+        return ops.size() == count
+               || Error(lineNo, mnemonic + " expects " + std::to_string(count) + " operands");
+    };
+    auto isReg = [&](std::size_t i) { return ops[i].reg >= 0; };
+    auto emit  = [&](Opcode op, int rd, int rs, int rt, std::int32_t imm) {
+        text.push_back({op, rd, rs, rt, imm, lineNo});
+        return true;
+    };
+
+    static const std::unordered_map<std::string, Opcode> aluOps = {
+        {"addu", ADDU},  {"add", ADDU},   {"addiu", ADDU}, {"addi", ADDU}, {"subu", SUBU},
+        {"sub", SUBU},   {"and", AND},    {"andi", AND},   {"or", OR},     {"ori", OR},
+        {"xor", XOR},    {"xori", XOR},   {"nor", NOR},    {"slt", SLT},   {"slti", SLT},
+        {"sltu", SLTU},  {"sltiu", SLTU}, {"sll", SLL},    {"sllv", SLL},  {"srl", SRL},
+        {"srlv", SRL},   {"sra", SRA},    {"srav", SRA},   {"mul", MUL}};
+    static const std::unordered_map<std::string, Opcode> hiloOps = {
+        {"mult", MULT}, {"multu", MULTU}, {"div", DIV}, {"divu", DIVU}};
+    static const std::unordered_map<std::string, Opcode> memOps = {
+        {"lw", LW}, {"lh", LH}, {"lhu", LHU}, {"lb", LB},
+        {"lbu", LBU}, {"sw", SW}, {"sh", SH}, {"sb", SB}};
+    static const std::unordered_map<std::string, Opcode> branchOps = {
+        {"blez", BLEZ}, {"bgtz", BGTZ}, {"bltz", BLTZ}, {"bgez", BGEZ}};
+
+    auto it = aluOps.find(mnemonic);
+    if (it != aluOps.end()) {
+        if (!expect(3) || !isReg(0) || !isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return isReg(2) ? emit(it->second, ops[0].reg, ops[1].reg, ops[2].reg, 0)
+                        : emit(it->second, ops[0].reg, ops[1].reg, -1, ops[2].value);
+    }
+
+    it = hiloOps.find(mnemonic);
+    if (it != hiloOps.end()) {
+        if (!expect(2) || !isReg(0) || !isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(it->second, -1, ops[0].reg, ops[1].reg, 0);
+    }
+
+    it = memOps.find(mnemonic);
+    if (it != memOps.end()) {
+        if (!expect(2) || !isReg(0) || isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        int base = ops[1].base >= 0 ? ops[1].base : ZERO;
+        if (it->second >= SW)
+            return emit(it->second, -1, base, ops[0].reg, ops[1].value);
+        return emit(it->second, ops[0].reg, base, -1, ops[1].value);
+    }
+
+    it = branchOps.find(mnemonic);
+    if (it != branchOps.end()) {
+        if (!expect(2) || !isReg(0) || isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(it->second, -1, ops[0].reg, -1, ops[1].value);
+    }
+
+    if (mnemonic == "beq" || mnemonic == "bne") {
+        if (!expect(3) || !isReg(0) || isReg(2) || (!isReg(1) && ops[1].value != 0))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(mnemonic == "beq" ? BEQ : BNE, -1, ops[0].reg,
+                    isReg(1) ? ops[1].reg : ZERO, ops[2].value);
+    }
+    if (mnemonic == "beqz" || mnemonic == "bnez") {
+        if (!expect(2) || !isReg(0) || isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(mnemonic == "beqz" ? BEQ : BNE, -1, ops[0].reg, ZERO, ops[1].value);
+    }
+    if (mnemonic == "b" || mnemonic == "j" || mnemonic == "jal") {
+        if (!expect(1) || isReg(0))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        if (mnemonic == "b")
+            return emit(BEQ, -1, ZERO, ZERO, ops[0].value);
+        return mnemonic == "j" ? emit(J, -1, -1, -1, ops[0].value)
+                               : emit(JAL, RA, -1, -1, ops[0].value);
+    }
+    if (mnemonic == "jr") {
+        if (!expect(1) || !isReg(0))
+            return Error(lineNo, "bad operands for jr");
+        return emit(JR, -1, ops[0].reg, -1, 0);
+    }
+    if (mnemonic == "jalr") {
+        if (ops.size() == 1 && isReg(0))
+            return emit(JALR, RA, ops[0].reg, -1, 0);
+        if (!expect(2) || !isReg(0) || !isReg(1))
+            return Error(lineNo, "bad operands for jalr");
+        return emit(JALR, ops[0].reg, ops[1].reg, -1, 0);
+    }
+    if (mnemonic == "mfhi" || mnemonic == "mflo") {
+        if (!expect(1) || !isReg(0))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(mnemonic == "mfhi" ? MFHI : MFLO, ops[0].reg, -1, -1, 0);
+    }
+    if (mnemonic == "mthi" || mnemonic == "mtlo") {
+        if (!expect(1) || !isReg(0))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        return emit(mnemonic == "mthi" ? MTHI : MTLO, -1, ops[0].reg, -1, 0);
+    }
+    if (mnemonic == "move" || mnemonic == "negu" || mnemonic == "neg"
+        || mnemonic == "not") {
+        if (!expect(2) || !isReg(0) || !isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        if (mnemonic == "move")
+            return emit(ADDU, ops[0].reg, ops[1].reg, ZERO, 0);
+        if (mnemonic == "not")
+            return emit(NOR, ops[0].reg, ops[1].reg, ZERO, 0);
+        return emit(SUBU, ops[0].reg, ZERO, ops[1].reg, 0);
+    }
+    if (mnemonic == "li" || mnemonic == "la" || mnemonic == "lui") {
+        if (!expect(2) || !isReg(0) || isReg(1))
+            return Error(lineNo, "bad operands for " + mnemonic);
+        if (mnemonic == "lui")
+            return emit(LUI, ops[0].reg, -1, -1, ops[1].value);
+        int base = ops[1].base >= 0 ? ops[1].base : ZERO;
+        return emit(ADDU, ops[0].reg, base, -1, ops[1].value);
+    }
+    if (mnemonic == "syscall" || mnemonic == "nop") {
+        if (!expect(0))
+            return false;
+        return emit(mnemonic == "nop" ? NOP : SYSCALL, -1, -1, -1, 0);
+    }
+
+    return Error(lineNo, "unknown instruction " + mnemonic);
+}
+
+bool MipsSimulator::AssembleDirective(const std::string &directive,
+                                      const std::string &args,
+                                      int                lineNo,
+                                      bool               resolve)
+{
+    if (directive == ".text") {
+        inText = true;
+        return true;
+    }
+    if (directive == ".data" || directive == ".rdata" || directive == ".rodata"
+        || directive == ".sdata" || directive == ".bss" || directive == ".sbss") {
+        // Small data is laid out from $gp, .sbss following .sdata
+        inText      = false;
+        inSmallData = directive == ".sdata" || directive == ".sbss";
+        return true;
+    }
+    if (directive == ".set") {
+        if (args == "noreorder")
+            noReorder = true;
+        else if (args == "reorder")
+            noReorder = false;
+        return true;
+    }
+    if (inText) {
+        // .globl, .ent, .end, .align and similar have no effect on execution
+        return true;
+    }
+
+    auto &top   = inSmallData ? gpTop : dataTop;
+    auto  align = [&](std::uint32_t alignment) {
+        top = (top + alignment - 1) & ~(alignment - 1);
+    };
+
+    if (directive == ".align") {
+        align(1u << std::atoi(args.c_str()));
+    }
+    else if (directive == ".space") {
+        Operand size;
+        if (!ParseOperand(args, size, lineNo, resolve))
+            return false;
+        for (std::int32_t i = 0; i < size.value; i++)
+            MemByte(top++) = 0;
+    }
+    else if (directive == ".word" || directive == ".half" || directive == ".byte") {
+        int size = directive == ".word" ? 4 : directive == ".half" ? 2 : 1;
+        align(size);
+        for (const auto &arg : SplitOperands(args)) {
+            Operand value;
+            if (!ParseOperand(arg, value, lineNo, resolve))
+                return false;
+            StoreMem(top, value.value, size);
+            top += size;
+        }
+    }
+    else if (directive == ".ascii" || directive == ".asciiz") {
+        auto begin = args.find('"'), end = args.rfind('"');
+        if (begin == std::string::npos || end == begin)
+            return Error(lineNo, "bad string literal");
+        for (auto i = begin + 1; i < end; i++) {
+            char c = args[i];
+            if (c == '\\' && i + 1 < end)
+                c = Unescape(args[++i]);
+            MemByte(top++) = c;
+        }
+        if (directive == ".asciiz")
+            MemByte(top++) = 0;
+    }
+    // Other directives (.globl, .type, .size, ...) are ignored
+
+    return true;
+}
+
+std::uint8_t &MipsSimulator::MemByte(std::uint32_t addr)
+{
+    auto &page = memory[addr >> 12];
+    if (page.empty())
+        page.resize(4096);
+    return page[addr & 4095];
+}
+
+std::uint32_t MipsSimulator::LoadMem(std::uint32_t addr, int size, bool isSigned)
+{
+    std::uint32_t value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = (value << 8) | MemByte(addr + i);
+
+    if (isSigned && size < 4 && (value >> (size * 8 - 1)) & 1)
+        value |= ~0u << (size * 8);
+    return value;
+}
+
+void MipsSimulator::StoreMem(std::uint32_t addr, std::uint32_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+        MemByte(addr + i) = std::uint8_t(value >> (i * 8));
+}
+
+void MipsSimulator::Issue(const Inst &inst)
+{
+    std::uint64_t ready = stats.cycles;
+
+    if (inst.rs > 0)
+        ready = std::max(ready, regReady[inst.rs]);
+    if (inst.rt > 0)
+        ready = std::max(ready, regReady[inst.rt]);
+    if (inst.op == MFHI || inst.op == MFLO)
+        ready = std::max(ready, hiloReady);
+    if (inst.op == SYSCALL)
+        ready = std::max({ready, regReady[V0], regReady[A0]});
+
+    stats.stallCycles += ready - stats.cycles;
+    stats.cycles = ready + 1;
+
+    std::uint64_t latency = 1;
+    switch (inst.op) {
+    case LW:
+    case LH:
+    case LHU:
+    case LB:
+    case LBU:
+        latency = 2;
+        break;
+    case MUL:
+        latency = 4;
+        break;
+    case MULT:
+    case MULTU:
+        hiloReady = ready + 5;
+        break;
+    case DIV:
+    case DIVU:
+        hiloReady = ready + 35;
+        break;
+    default:
+        break;
+    }
+
+    if (inst.rd > 0)
+        regReady[inst.rd] = ready + latency;
+
+    if (inst.op >= BEQ && inst.op <= JALR && !noReorder) {
+        stats.cycles++;
+        stats.delayCycles++;
+    }
+}
+
+bool MipsSimulator::Syscall()
+{
+    stats.syscalls++;
+
+    switch (reg[V0]) {
+    case 1:
+        output << std::int32_t(reg[A0]);
+        break;
+    case 4:
+        for (auto addr = reg[A0]; MemByte(addr); addr++)
+            output << char(MemByte(addr));
+        break;
+    case 5: {
+        int value = 0;
+        input >> value;
+        reg[V0] = value;
+        break;
+    }
+    case 9:
+        reg[V0] = heapTop;
+        heapTop = (heapTop + reg[A0] + 7) & ~7u;
+        break;
+    case 10:
+        halted = true;
+        break;
+    case 11:
+        output << char(reg[A0]);
+        break;
+    case 12:
+        reg[V0] = input.get();
+        break;
+    case 17:
+        exitCode = std::int32_t(reg[A0]);
+        halted   = true;
+        break;
+    default:
+        errorStream << "unsupported syscall " << reg[V0] << '\n';
+        return false;
+    }
+    return true;
+}
+
+bool MipsSimulator::Run(std::uint64_t maxInstructions)
+{
+    std::fill(std::begin(reg), std::end(reg), 0);
+    std::fill(std::begin(regReady), std::end(regReady), 0);
+    reg[GP]   = GlobalPtr;
+    reg[SP]   = StackTop;
+    hi        = lo = 0;
+    hiloReady = 0;
+    heapTop   = HeapBase;
+    stats     = {};
+    exitCode  = 0;
+    halted    = false;
+
+    std::uint32_t pc = TextBase, delayTarget = 0;
+    bool          delayed = false;
+
+    while (!halted) {
+        std::uint32_t index = (pc - TextBase) / 4;
+        if (pc < TextBase || (pc & 3) || index >= text.size()) {
+            errorStream << "runtime error: pc 0x" << std::hex << pc << std::dec
+                        << " outside of text segment\n";
+            return false;
+        }
+        if (maxInstructions && stats.instructions >= maxInstructions) {
+            errorStream << "instruction limit " << maxInstructions << " reached\n";
+            return false;
+        }
+
+        const Inst &inst = text[index];
+        Issue(inst);
+        stats.instructions++;
+
+        std::uint32_t a = inst.rs >= 0 ? reg[inst.rs] : 0;
+        std::uint32_t b = inst.rt >= 0 ? reg[inst.rt] : std::uint32_t(inst.imm);
+        std::uint32_t result = 0, next = pc + 4, link = pc + (noReorder ? 8 : 4);
+        bool          jump   = false;
+
+        switch (inst.op) {
+        case ADDU:
+            result = a + b;
+            break;
+        case SUBU:
+            result = a - b;
+            break;
+        case AND:
+            result = a & b;
+            break;
+        case OR:
+            result = a | b;
+            break;
+        case XOR:
+            result = a ^ b;
+            break;
+        case NOR:
+            result = ~(a | b);
+            break;
+        case SLT:
+            result = std::int32_t(a) < std::int32_t(b);
+            break;
+        case SLTU:
+            result = a < b;
+            break;
+        case SLL:
+            result = a << (b & 31);
+            break;
+        case SRL:
+            result = a >> (b & 31);
+            break;
+        case SRA:
+            result = std::uint32_t(std::int32_t(a) >> (b & 31));
+            break;
+        case MUL:
+            result = std::uint32_t(std::int64_t(std::int32_t(a)) * std::int32_t(b));
+            break;
+        case LUI:
+            result = std::uint32_t(inst.imm) << 16;
+            break;
+        case MULT: {
+            auto product = std::int64_t(std::int32_t(a)) * std::int32_t(b);
+            lo           = std::uint32_t(product);
+            hi           = std::uint32_t(std::uint64_t(product) >> 32);
+            break;
+        }
+        case MULTU: {
+            auto product = std::uint64_t(a) * b;
+            lo           = std::uint32_t(product);
+            hi           = std::uint32_t(product >> 32);
+            break;
+        }
+        case DIV:
+            if (b != 0 && !(a == 0x80000000u && b == ~0u)) {
+                lo = std::uint32_t(std::int32_t(a) / std::int32_t(b));
+                hi = std::uint32_t(std::int32_t(a) % std::int32_t(b));
+            }
+            break;
+        case DIVU:
+            if (b != 0) {
+                lo = a / b;
+                hi = a % b;
+            }
+            break;
+        case MFHI:
+            result = hi;
+            break;
+        case MFLO:
+            result = lo;
+            break;
+        case MTHI:
+            hi = a;
+            break;
+        case MTLO:
+            lo = a;
+            break;
+        case LW:
+        case LH:
+        case LHU:
+        case LB:
+        case LBU: {
+            int size = inst.op == LW ? 4 : inst.op == LH || inst.op == LHU ? 2 : 1;
+            auto addr = a + inst.imm;
+            if (addr & (size - 1)) {
+                errorStream << "runtime error at line " << inst.line
+                            << ": unaligned load from 0x" << std::hex << addr << std::dec
+                            << '\n';
+                return false;
+            }
+            result = LoadMem(addr, size, inst.op == LH || inst.op == LB);
+            stats.loads++;
+            break;
+        }
+        case SW:
+        case SH:
+        case SB: {
+            int  size = inst.op == SW ? 4 : inst.op == SH ? 2 : 1;
+            auto addr = a + inst.imm;
+            if (addr & (size - 1)) {
+                errorStream << "runtime error at line " << inst.line
+                            << ": unaligned store to 0x" << std::hex << addr << std::dec
+                            << '\n';
+                return false;
+            }
+            StoreMem(addr, reg[inst.rt], size);
+            stats.stores++;
+            break;
+        }
+        case BEQ:
+        case BNE:
+        case BLEZ:
+        case BGTZ:
+        case BLTZ:
+        case BGEZ: {
+            auto sa = std::int32_t(a);
+            switch (inst.op) {
+            case BEQ:
+                jump = a == reg[inst.rt];
+                break;
+            case BNE:
+                jump = a != reg[inst.rt];
+                break;
+            case BLEZ:
+                jump = sa <= 0;
+                break;
+            case BGTZ:
+                jump = sa > 0;
+                break;
+            case BLTZ:
+                jump = sa < 0;
+                break;
+            default:
+                jump = sa >= 0;
+                break;
+            }
+            stats.branches++;
+            stats.takenBranches += jump;
+            b = inst.imm;
+            break;
+        }
+        case J:
+        case JAL:
+            jump = true;
+            b    = inst.imm;
+            stats.jumps++;
+            stats.calls += inst.op == JAL;
+            result = link;
+            break;
+        case JR:
+        case JALR:
+            jump = true;
+            b    = a;
+            stats.jumps++;
+            stats.calls += inst.op == JALR;
+            result = link;
+            break;
+        case SYSCALL:
+            if (!Syscall())
+                return false;
+            break;
+        case NOP:
+            break;
+        }
+
+        if (inst.rd > 0)
+            reg[inst.rd] = result;
+
+        if (delayed) {
+            next    = delayTarget;
+            delayed = false;
+        }
+        if (jump) {
+            if (noReorder) {
+                delayed     = true;
+                delayTarget = b;
+            }
+            else
+                next = b;
+        }
+        pc = next;
+    }
+
+    // Drain the remaining pipeline stages
+    stats.cycles += 4;
+    return true;
+}
+
+void MipsSimulator::PrintStats(std::ostream &os) const
+{
+    auto flags     = os.flags();
+    auto precision = os.precision();
+
+    const std::pair<const char *, std::uint64_t> counters[] = {
+        {"instructions", stats.instructions},
+        {"loads", stats.loads},
+        {"stores", stats.stores},
+        {"branches", stats.branches},
+        {"branches taken", stats.takenBranches},
+        {"jumps", stats.jumps},
+        {"calls", stats.calls},
+        {"syscalls", stats.syscalls},
+        {"stall cycles", stats.stallCycles},
+        {"delay slot cycles", stats.delayCycles},
+        {"cycles", stats.cycles}};
+
+    os << std::string(40, '-') << '\n';
+    os << std::left << std::setw(24) << "Counter" << std::right << std::setw(16)
+       << "Count" << '\n';
+    for (const auto &c : counters)
+        os << std::left << std::setw(24) << c.first << std::right << std::setw(16)
+           << c.second << '\n';
+    os << std::left << std::setw(24) << "CPI" << std::right << std::setw(16) << std::fixed
+       << std::setprecision(3)
+       << (stats.instructions ? double(stats.cycles) / stats.instructions : 0.0) << '\n';
+    os << std::string(40, '-') << '\n';
+
+    os.flags(flags);
+    os.precision(precision);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Dynamic counters collected while running a program
+struct SimStats
+{
+    std::uint64_t instructions;   // executed instructions
+    std::uint64_t loads;          // memory loads
+    std::uint64_t stores;         // memory stores
+    std::uint64_t branches;       // conditional branches
+    std::uint64_t takenBranches;  // conditional branches taken
+    std::uint64_t jumps;          // unconditional jumps, calls and returns
+    std::uint64_t calls;          // jal/jalr
+    std::uint64_t syscalls;       // syscall instructions
+    std::uint64_t stallCycles;    // cycles lost waiting for operands
+    std::uint64_t delayCycles;    // cycles lost to unfilled branch delay slots
+    std::uint64_t cycles;         // estimated total cycles
+};
+
+// Interpreter for the MIPS32 assembly subset emitted by MipsAssemblyGenPass.
+//
+// Every source line holds at most one instruction, so pseudo instructions such as
+// li/la with 32-bit immediates are executed as a single instruction. Data in
+// .sdata and .sbss is laid out from SmallDataBase, that of other sections from
+// DataBase. $gp holds GlobalPtr, 0x7ff0 past the start of small data as with the
+// GNU linker, and %gp_rel(label) is the offset of label from it.
+//
+// Relocatable MIPS32 ELF objects, as written by the pass, are linked in place:
+// executable sections are placed at TextBase, $gp-relative ones at SmallDataBase
+// and other allocated sections at DataBase. Delay slots of objects always execute.
+//
+// Timing uses a simple in-order pipeline model: one instruction issues per cycle,
+// an instruction waits until its source operands are ready (results of loads are
+// ready after 2 cycles, mul 4, mult 5, div 35, all others 1), and each branch or
+// jump costs one cycle for its delay slot nop, unless the program is assembled
+// with ".set noreorder", in which case the delay slot instruction is executed.
+class MipsSimulator
+{
+public:
+    static const std::uint32_t TextBase      = 0x00400000;
+    static const std::uint32_t DataBase      = 0x10010000;
+    static const std::uint32_t GlobalPtr     = 0x10008000;
+    static const std::uint32_t SmallDataBase = GlobalPtr - 0x7ff0;
+    static const std::uint32_t HeapBase      = 0x10040000;
+    static const std::uint32_t StackTop      = 0x7fffeff8;  // 8-byte aligned, as O32 requires
+
+    MipsSimulator(std::ostream &output, std::istream &input, std::ostream &errorStream);
+
+    bool Load(std::istream &source);
+    bool Run(std::uint64_t maxInstructions = 0);
+
+    const SimStats &Stats() const { return stats; }
+    int             ExitCode() const { return exitCode; }
+    void            PrintStats(std::ostream &os) const;
+
+private:
+    // ALU opcodes take their second source from rt, or from imm when rt is -1
+    enum Opcode {
+        ADDU, SUBU, AND, OR, XOR, NOR, SLT, SLTU, SLL, SRL, SRA, MUL, LUI,
+        MULT, MULTU, DIV, DIVU, MFHI, MFLO, MTHI, MTLO,
+        LW, LH, LHU, LB, LBU, SW, SH, SB,
+        BEQ, BNE, BLEZ, BGTZ, BLTZ, BGEZ, J, JAL, JR, JALR,
+        SYSCALL, NOP
+    };
+
+    struct Inst
+    {
+        Opcode       op;
+        int          rd, rs, rt;
+        std::int32_t imm;  // immediate, memory offset or branch/jump target
+        int          line;
+    };
+
+    struct Operand
+    {
+        int          reg;    // register number, or -1 for an address/immediate
+        int          base;   // base register of "offset(base)", or -1
+        std::int32_t value;  // immediate value or resolved label address + offset
+    };
+
+    bool LoadObject(const std::string &image);
+    bool Decode(std::uint32_t word, std::uint32_t pc, Inst &inst);
+
+    bool Assemble(const std::vector<std::string> &lines, bool resolve);
+    bool AssembleInstruction(std::string               mnemonic,
+                             const std::vector<Operand> &ops,
+                             int                        lineNo);
+    bool AssembleDirective(const std::string &directive,
+                           const std::string &args,
+                           int                lineNo,
+                           bool               resolve);
+    bool ParseOperand(std::string text, Operand &op, int lineNo, bool resolve);
+    bool Error(int lineNo, const std::string &message);
+
+    std::uint8_t &MemByte(std::uint32_t addr);
+    std::uint32_t LoadMem(std::uint32_t addr, int size, bool isSigned);
+    void          StoreMem(std::uint32_t addr, std::uint32_t value, int size);
+    void          Issue(const Inst &inst);
+    bool          Syscall();
+
+    std::ostream &output;
+    std::istream &input;
+    std::ostream &errorStream;
+
+    std::vector<Inst>                                            text;
+    std::unordered_map<std::string, std::uint32_t>               labels;
+    std::unordered_map<std::uint32_t, std::vector<std::uint8_t>> memory;  // 4KB pages
+    std::uint32_t                                                dataTop;
+    std::uint32_t                                                gpTop;  // small data
+    bool                                                         inText;
+    bool                                                         inSmallData;
+    bool                                                         noReorder;
+
+    std::uint32_t reg[32], hi, lo, heapTop;
+    std::uint64_t regReady[32], hiloReady;
+    SimStats      stats;
+    int           exitCode;
+    bool          halted;
+};